@@ -0,0 +1,57 @@
+#!/usr/bin/env python2
+# Copyright (c) 2015 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Benchmark initial block download from several peers on loopback.
+# A number of regtest nodes share a chain; a fresh node then connects
+# to all of them and we time how long it takes to catch up, printing
+# the download rate and in-flight limit it settled on for each peer.
+#
+from test_framework import BitcoinTestFramework
+from util import *
+import time
+
+class IBDBenchmark(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--peers", dest="peers", default=3, type="int",
+                          help="Number of nodes to download from (default: %default)")
+        parser.add_option("--blocks", dest="blocks", default=2000, type="int",
+                          help="Length of the chain to download (default: %default)")
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, self.options.peers + 1)
+
+    def setup_network(self):
+        self.is_network_split = False
+        self.nodes = start_nodes(self.options.peers, self.options.tmpdir)
+        for i in range(1, self.options.peers):
+            connect_nodes_bi(self.nodes, i - 1, i)
+
+    def run_test(self):
+        peers = self.options.peers
+        print("Mining %d blocks" % self.options.blocks)
+        self.nodes[0].setgenerate(True, self.options.blocks)
+        sync_blocks(self.nodes)
+
+        self.nodes.append(start_node(peers, self.options.tmpdir, ["-debug=net"]))
+        node = self.nodes[peers]
+        start = time.time()
+        for i in range(peers):
+            connect_nodes(node, i)
+        while node.getblockcount() < self.options.blocks:
+            time.sleep(0.05)
+        elapsed = time.time() - start
+
+        assert_equal(node.getbestblockhash(), self.nodes[0].getbestblockhash())
+        print("Downloaded %d blocks from %d peers in %.2f s (%.0f blocks/s)" %
+              (self.options.blocks, peers, elapsed, self.options.blocks / elapsed))
+        for peer in node.getpeerinfo():
+            print("  peer %d: %d bytes received, %d bytes/s, in-flight limit %d" %
+                  (peer['id'], peer['bytesrecv'], peer['blockdownloadrate'], peer['inflightlimit']))
+
+if __name__ == '__main__':
+    IBDBenchmark().main()
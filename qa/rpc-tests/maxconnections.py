@@ -0,0 +1,87 @@
+#!/usr/bin/env python2
+# Copyright (c) 2015 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test a node with more connections than select() can watch: with epoll,
+# sockets numbered from FD_SETSIZE on are serviced, inbound and outbound.
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+import hashlib
+import random
+import resource
+import socket
+import struct
+
+FD_SETSIZE = 1024
+NUM_INBOUND = FD_SETSIZE + 16
+REGTEST_MAGIC = "\xfa\x0f\xa5\x5a"
+
+def version_message():
+    addr = struct.pack("<Q", 1) + "\x00" * 10 + "\xff\xff" + socket.inet_aton("127.0.0.1") + struct.pack(">H", 0)
+    payload = struct.pack("<iQq", 70002, 1, int(time.time())) + addr + addr
+    payload += struct.pack("<Q", random.getrandbits(64)) + "\x00" + struct.pack("<i", 0)
+    checksum = hashlib.sha256(hashlib.sha256(payload).digest()).digest()[:4]
+    return REGTEST_MAGIC + "version".ljust(12, "\x00") + struct.pack("<I", len(payload)) + checksum + payload
+
+def recv_command(sock):
+    header = ""
+    while len(header) < 24:
+        data = sock.recv(24 - len(header))
+        assert data, "connection closed"
+        header += data
+    assert_equal(header[:4], REGTEST_MAGIC)
+    return header[4:16].rstrip("\x00")
+
+class MaxConnectionsTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        self.nodes = []
+        self.is_network_split = False
+        # The node asks for its connections plus what it keeps for itself
+        args = ["-debug=net", "-maxconnections=%d" % (NUM_INBOUND + 32)]
+        self.nodes.append(start_node(0, self.options.tmpdir, args))
+        self.nodes.append(start_node(1, self.options.tmpdir, ["-debug=net"]))
+
+    def run_test(self):
+        soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+        if hard != resource.RLIM_INFINITY and hard < NUM_INBOUND + 256:
+            print("Skipping: the file descriptor limit %d is too low" % hard)
+            return
+        resource.setrlimit(resource.RLIMIT_NOFILE, (NUM_INBOUND + 256, hard))
+
+        print "Open %d inbound connections" % NUM_INBOUND
+        socks = []
+        for i in range(NUM_INBOUND):
+            socks.append(socket.create_connection(("127.0.0.1", p2p_port(0))))
+        while self.nodes[0].getconnectioncount() < NUM_INBOUND:
+            time.sleep(0.1)
+
+        print "The last of them, past FD_SETSIZE on the node, is serviced"
+        last = socks[-1]
+        last.settimeout(30)
+        last.sendall(version_message())
+        assert_equal(recv_command(last), "version")
+        assert_equal(recv_command(last), "verack")
+
+        print "So is an outbound connection past FD_SETSIZE"
+        self.nodes[0].addnode("127.0.0.1:"+str(p2p_port(1)), "onetry")
+        timeout = 30
+        while timeout > 0 and not any(peer['version'] != 0 for peer in self.nodes[1].getpeerinfo()):
+            time.sleep(0.1)
+            timeout -= 0.1
+        assert(timeout > 0)
+        assert_equal(self.nodes[0].getconnectioncount(), NUM_INBOUND + 1)
+
+        for sock in socks:
+            sock.close()
+
+if __name__ == '__main__':
+    MaxConnectionsTest().main()
@@ -0,0 +1,64 @@
+#!/usr/bin/env python2
+# Copyright (c) 2015 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test -prune configuration, and that a pruned node refuses the wallet
+# imports that would rescan blocks it may have deleted.
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+import os
+import subprocess
+
+class PruneTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        self.nodes = []
+        self.is_network_split = False
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-debug=prune", "-prune=550"]))
+
+    def refuses_to_start(self, args):
+        datadir = os.path.join(self.options.tmpdir, "node1")
+        devnull = open("/dev/null", "w+")
+        ret = subprocess.call([ os.getenv("BITCOIND", "bitcoind"), "-datadir="+datadir ] + args,
+                              stdout=devnull, stderr=devnull)
+        devnull.close()
+        return ret != 0
+
+    def run_test(self):
+        print "Bad -prune values are refused at startup"
+        assert(self.refuses_to_start(["-prune=-1"]))
+        assert(self.refuses_to_start(["-prune=549"]))
+        assert(self.refuses_to_start(["-prune=9223372036854775807"]))
+        assert(self.refuses_to_start(["-prune=550", "-txindex"]))
+        assert(self.refuses_to_start(["-prune=550", "-rescan"]))
+
+        print "The node reports that it prunes"
+        self.nodes[0].setgenerate(True, 10)
+        info = self.nodes[0].getblockchaininfo()
+        assert_equal(info['pruned'], True)
+        assert_equal(info['pruneheight'], 0)
+
+        print "Imports that would rescan are refused"
+        address = self.nodes[0].getnewaddress()
+        privkey = self.nodes[0].dumpprivkey(address)
+        assert_raises(JSONRPCException, self.nodes[0].importprivkey, privkey)
+        assert_raises(JSONRPCException, self.nodes[0].importprivkey, privkey, "", True)
+        assert_raises(JSONRPCException, self.nodes[0].importaddress, address)
+        walletfile = os.path.join(self.options.tmpdir, "wallet.dump")
+        self.nodes[0].dumpwallet(walletfile)
+        assert_raises(JSONRPCException, self.nodes[0].importwallet, walletfile)
+
+        print "Imports without a rescan are still allowed"
+        self.nodes[0].importprivkey(privkey, "", False)
+        self.nodes[0].importaddress(address, "", False)
+
+if __name__ == '__main__':
+    PruneTest().main()
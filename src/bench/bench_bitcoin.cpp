@@ -0,0 +1,20 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "crypto/sha256.h"
+#include "util.h"
+
+int
+main(int argc, char** argv)
+{
+    SetupEnvironment();
+    SHA256AutoDetect();
+    fPrintToDebugLog = false; // don't want to write to debug.log file
+    SelectParams(CBaseChainParams::REGTEST);
+
+    benchmark::BenchRunner::RunAll();
+}
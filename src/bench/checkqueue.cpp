@@ -0,0 +1,115 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "checkqueue.h"
+#include "hash.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// This Benchmark tests the CheckQueue with the lightest weight Checks, so it
+// should make any lock contention particularly visible
+static const int MIN_CORES = 2;
+static const size_t BATCHES = 101;
+static const size_t BATCH_SIZE = 30;
+static const int QUEUE_BATCH_SIZE = 128;
+
+struct FakeJobNoWork
+{
+    bool operator()()
+    {
+        return true;
+    }
+    void swap(FakeJobNoWork& x) {}
+};
+
+// Resembles a script check: a few microseconds of hashing
+struct FakeJobHash
+{
+    uint256 hash;
+    bool operator()()
+    {
+        for (int i = 0; i < 16; i++)
+            hash = Hash(hash.begin(), hash.end());
+        return true;
+    }
+    void swap(FakeJobHash& x) { std::swap(hash, x.hash); }
+};
+
+template <typename T>
+static void StartThreads(CCheckQueue<T>& queue, boost::thread_group& tg)
+{
+    int nThreads = std::max(MIN_CORES, (int)boost::thread::hardware_concurrency());
+    for (int i = 0; i < nThreads - 1; i++)
+        tg.create_thread(boost::bind(&CCheckQueue<T>::Thread, &queue));
+}
+
+static void CCheckQueueSpeed(benchmark::State& state)
+{
+    CCheckQueue<FakeJobNoWork> queue(QUEUE_BATCH_SIZE);
+    boost::thread_group tg;
+    StartThreads(queue, tg);
+    while (state.KeepRunning()) {
+        CCheckQueueControl<FakeJobNoWork> control(&queue);
+        // We call Add a number of times to simulate the behavior of adding
+        // a block of transactions at once.
+        for (size_t j = 0; j < BATCHES; ++j) {
+            std::vector<FakeJobNoWork> vChecks(BATCH_SIZE);
+            control.Add(vChecks);
+        }
+        // control waits for completion by RAII, but
+        // it is done explicitly here for clarity
+        control.Wait();
+    }
+    tg.interrupt_all();
+    tg.join_all();
+}
+
+// One Add per input, the way ConnectBlock feeds the queue
+static void CCheckQueueSingleAdds(benchmark::State& state)
+{
+    CCheckQueue<FakeJobHash> queue(QUEUE_BATCH_SIZE);
+    boost::thread_group tg;
+    StartThreads(queue, tg);
+    while (state.KeepRunning()) {
+        CCheckQueueControl<FakeJobHash> control(&queue);
+        for (size_t j = 0; j < BATCHES * BATCH_SIZE; ++j) {
+            std::vector<FakeJobHash> vChecks(1);
+            control.Add(vChecks);
+        }
+        control.Wait();
+    }
+    tg.interrupt_all();
+    tg.join_all();
+}
+
+// Fill the next block's session while the previous one is still running
+static void CCheckQueuePipelined(benchmark::State& state)
+{
+    CCheckQueue<FakeJobHash> queue(QUEUE_BATCH_SIZE);
+    boost::thread_group tg;
+    StartThreads(queue, tg);
+    std::auto_ptr<CCheckQueueControl<FakeJobHash> > pprev;
+    while (state.KeepRunning()) {
+        std::auto_ptr<CCheckQueueControl<FakeJobHash> > pcontrol(new CCheckQueueControl<FakeJobHash>(&queue));
+        for (size_t j = 0; j < BATCHES; ++j) {
+            std::vector<FakeJobHash> vChecks(BATCH_SIZE);
+            pcontrol->Add(vChecks);
+        }
+        if (pprev.get())
+            pprev->Wait();
+        pprev = pcontrol;
+    }
+    pprev.reset();
+    tg.interrupt_all();
+    tg.join_all();
+}
+
+BENCHMARK(CCheckQueueSpeed);
+BENCHMARK(CCheckQueueSingleAdds);
+BENCHMARK(CCheckQueuePipelined);
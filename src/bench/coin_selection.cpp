@@ -0,0 +1,61 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coinselection.h"
+#include "random.h"
+#include "wallet.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+// Choosing the inputs of a payment from a wallet with a great many coins of
+// assorted values, the way CreateTransaction does: the coins are indexed once
+// and then selected from for each fee the transaction is tried with.
+static const int FEE_ITERATIONS = 3;
+
+static void CoinSelection(benchmark::State& state, int nCoins)
+{
+    CWallet wallet;
+    CMutableTransaction tx;
+    tx.vout.resize(nCoins);
+    for (int i = 0; i < nCoins; i++)
+        tx.vout[i].nValue = (1 + insecure_rand() % 100000) * 10000;
+    CWalletTx wtx(&wallet, tx);
+
+    std::vector<COutput> vCoins;
+    vCoins.reserve(nCoins);
+    for (int i = 0; i < nCoins; i++)
+        vCoins.push_back(COutput(&wtx, i, 6 + insecure_rand() % 1000, true));
+
+    std::set<std::pair<const CWalletTx*, unsigned int> > setCoins;
+    CAmount nValueIn;
+    while (state.KeepRunning()) {
+        CAmount nTarget = (1 + insecure_rand() % 5000) * CENT + insecure_rand() % CENT;
+        CCoinSelector selector(vCoins, true);
+        for (int i = 0; i < FEE_ITERATIONS; i++)
+            selector.Select(nTarget + i * 10000, setCoins, nValueIn);
+    }
+}
+
+static void CoinSelection_10k(benchmark::State& state)
+{
+    CoinSelection(state, 10000);
+}
+
+static void CoinSelection_100k(benchmark::State& state)
+{
+    CoinSelection(state, 100000);
+}
+
+static void CoinSelection_1M(benchmark::State& state)
+{
+    CoinSelection(state, 1000000);
+}
+
+BENCHMARK(CoinSelection_10k);
+BENCHMARK(CoinSelection_100k);
+BENCHMARK(CoinSelection_1M);
@@ -0,0 +1,174 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "leveldbwrapper.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <iostream>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+// Write amplification of the chainstate: a block typically spends one or two
+// outputs of transactions that have many, so a layout with one record per
+// transaction rewrites all the remaining outputs on every flush.
+static const int TXS = 1000;
+static const int OUTPUTS_PER_TX = 50;
+static const int TOUCHED_PER_FLUSH = 200;
+
+static CTxOut RandomOutput()
+{
+    CTxOut out;
+    out.nValue = (insecure_rand() % 1000000) * 1000;
+    out.scriptPubKey << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, insecure_rand() & 0xff) << OP_EQUALVERIFY << OP_CHECKSIG;
+    return out;
+}
+
+namespace
+{
+// A synthetic UTXO set in which every flush flips one output of a number of
+// transactions between spent and unspent
+class CCoinsWorkload
+{
+private:
+    std::vector<uint256> vTxid;
+    std::vector<CCoins> vOriginal;
+
+public:
+    CCoinsWorkload()
+    {
+        for (int i = 0; i < TXS; i++) {
+            CCoins coins;
+            coins.nVersion = 1;
+            coins.nHeight = 100000 + i;
+            for (int j = 0; j < OUTPUTS_PER_TX; j++)
+                coins.vout.push_back(RandomOutput());
+            vTxid.push_back(GetRandHash());
+            vOriginal.push_back(coins);
+        }
+    }
+
+    void Create(CCoinsViewCache& view) const
+    {
+        for (int i = 0; i < TXS; i++)
+            *view.ModifyCoins(vTxid[i]) = vOriginal[i];
+    }
+
+    void Step(CCoinsViewCache& view) const
+    {
+        for (int i = 0; i < TOUCHED_PER_FLUSH; i++) {
+            int nTx = insecure_rand() % TXS;
+            int nOut = insecure_rand() % OUTPUTS_PER_TX;
+            CCoinsModifier coins = view.ModifyCoins(vTxid[nTx]);
+            if (coins->IsAvailable(nOut)) {
+                coins->Spend(nOut);
+            } else {
+                if (coins->vout.size() < (size_t)OUTPUTS_PER_TX)
+                    coins->vout.resize(OUTPUTS_PER_TX);
+                coins->nVersion = vOriginal[nTx].nVersion;
+                coins->nHeight = vOriginal[nTx].nHeight;
+                coins->vout[nOut] = vOriginal[nTx].vout[nOut];
+            }
+        }
+    }
+};
+
+struct CBenchDataDir
+{
+    boost::filesystem::path path;
+    CBenchDataDir()
+    {
+        path = GetTempPath() / strprintf("bench_bitcoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+        boost::filesystem::create_directories(path);
+        mapArgs["-datadir"] = path.string();
+    }
+    ~CBenchDataDir()
+    {
+        boost::filesystem::remove_all(path);
+    }
+};
+}
+
+// The current layout: only changed outputs are written
+static void CoinsFlushPerOutput(benchmark::State& state)
+{
+    CBenchDataDir datadir;
+    CCoinsViewDB db(1 << 20, true, true);
+    CCoinsWorkload workload;
+    {
+        CCoinsViewCache cache(&db);
+        workload.Create(cache);
+        cache.Flush();
+    }
+    uint64_t nBytesBefore = db.GetBytesWritten();
+    uint64_t nFlushes = 0;
+    while (state.KeepRunning()) {
+        CCoinsViewCache cache(&db);
+        workload.Step(cache);
+        cache.Flush();
+        nFlushes++;
+    }
+    std::cout << "# per output: " << (db.GetBytesWritten() - nBytesBefore) / nFlushes << " bytes per flush of " << TOUCHED_PER_FLUSH << " changed outputs\n";
+}
+
+// The layout before it, for comparison: every touched transaction's whole
+// record is rewritten
+class CCoinsViewLegacyDB : public CCoinsView
+{
+private:
+    CLevelDBWrapper db;
+
+public:
+    uint64_t nBytesWritten;
+
+    CCoinsViewLegacyDB(const boost::filesystem::path& path) : db(path, 1 << 20, true, true), nBytesWritten(0) {}
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const { return db.Read(std::make_pair('c', txid), coins); }
+    bool HaveCoins(const uint256& txid) const { return db.Exists(std::make_pair('c', txid)); }
+
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    {
+        CLevelDBBatch batch;
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                if (it->second.coins.IsPruned())
+                    batch.Erase(std::make_pair('c', it->first));
+                else
+                    batch.Write(std::make_pair('c', it->first), it->second.coins);
+            }
+            mapCoins.erase(it++);
+        }
+        nBytesWritten += batch.SizeEstimate();
+        return db.WriteBatch(batch);
+    }
+};
+
+static void CoinsFlushPerTransaction(benchmark::State& state)
+{
+    CBenchDataDir datadir;
+    CCoinsViewLegacyDB db(datadir.path / "legacy");
+    CCoinsWorkload workload;
+    {
+        CCoinsViewCache cache(&db);
+        workload.Create(cache);
+        cache.Flush();
+    }
+    uint64_t nBytesBefore = db.nBytesWritten;
+    uint64_t nFlushes = 0;
+    while (state.KeepRunning()) {
+        CCoinsViewCache cache(&db);
+        workload.Step(cache);
+        cache.Flush();
+        nFlushes++;
+    }
+    std::cout << "# per transaction: " << (db.nBytesWritten - nBytesBefore) / nFlushes << " bytes per flush of " << TOUCHED_PER_FLUSH << " changed outputs\n";
+}
+
+BENCHMARK(CoinsFlushPerOutput);
+BENCHMARK(CoinsFlushPerTransaction);
@@ -0,0 +1,62 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/sha256.h"
+#include "primitives/block.h"
+#include "random.h"
+
+#include <vector>
+
+/* Number of bytes to hash per iteration */
+static const uint64_t BUFFER_SIZE = 1000 * 1000;
+
+static void SHA256(benchmark::State& state)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    std::vector<unsigned char> in(BUFFER_SIZE, 0);
+    while (state.KeepRunning())
+        CSHA256().Write(&in[0], in.size()).Finalize(hash);
+}
+
+static void SHA256D64_1024(benchmark::State& state)
+{
+    std::vector<unsigned char> in(64 * 1024, 0);
+    std::vector<unsigned char> out(32 * 1024);
+    while (state.KeepRunning())
+        SHA256D64(&out[0], &in[0], 1024);
+}
+
+// Scanning 1024 nonces of a block header, as the miner does
+static void SHA256D80_1024(benchmark::State& state)
+{
+    unsigned char header[80] = {0};
+    std::vector<unsigned char> out(32 * 1024);
+    CSHA256D80 hasher(header);
+    uint32_t nNonce = 0;
+    while (state.KeepRunning()) {
+        hasher.Hash(&out[0], nNonce, 1024);
+        nNonce += 1024;
+    }
+}
+
+// The merkle root of a block with as many transactions as a full one
+static void MerkleRoot(benchmark::State& state)
+{
+    CBlock block;
+    block.vtx.resize(2000);
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = i;
+        block.vtx[i] = tx;
+    }
+    while (state.KeepRunning())
+        block.BuildMerkleTree();
+}
+
+BENCHMARK(SHA256);
+BENCHMARK(SHA256D64_1024);
+BENCHMARK(SHA256D80_1024);
+BENCHMARK(MerkleRoot);
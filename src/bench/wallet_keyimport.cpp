@@ -0,0 +1,60 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+#include "wallet.h"
+#include "walletdb.h"
+
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+
+// Importing keys into a wallet the way importwallet does, a file's worth at
+// a time: in one batch, which is committed and flushed to the log once,
+// rather than in a transaction and a log flush per record.
+static const int KEYS_PER_IMPORT = 100;
+
+static void ImportKeys(CWallet& wallet, bool fBatch)
+{
+    LOCK(wallet.cs_wallet);
+    boost::scoped_ptr<CWalletDBBatch> pwalletdb(fBatch ? new CWalletDBBatch(wallet.strWalletFile) : NULL);
+    for (int i = 0; i < KEYS_PER_IMPORT; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        wallet.AddKeyPubKey(key, key.GetPubKey());
+    }
+}
+
+static void WalletImportKeys(benchmark::State& state)
+{
+    // The database environment can only be opened once per process, so the
+    // import without a batch is timed here as well, for comparison
+    boost::filesystem::path path = GetTempPath() / strprintf("bench_bitcoin_wallet_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+    boost::filesystem::create_directories(path);
+    if (!bitdb.Open(path)) {
+        std::cout << "# cannot open the wallet database environment in " << path.string() << "\n";
+        return;
+    }
+    {
+        CWallet wallet("wallet_bench.dat");
+        CWalletDB(wallet.strWalletFile, "cr+");
+
+        while (state.KeepRunning())
+            ImportKeys(wallet, true);
+
+        int64_t nStart = GetTimeMicros();
+        ImportKeys(wallet, false);
+        std::cout << "# a transaction per record: " << (GetTimeMicros() - nStart) / 1000.0 << "ms to import " << KEYS_PER_IMPORT << " keys\n";
+    }
+    bitdb.Flush(true);
+    boost::filesystem::remove_all(path);
+}
+
+BENCHMARK(WalletImportKeys);
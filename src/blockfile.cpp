@@ -0,0 +1,175 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/** A read-only mapping of a whole file. */
+class CMappedFile
+{
+private:
+    char* pdata;
+    size_t nSize;
+
+    // Disallow copying
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    CMappedFile() : pdata(NULL), nSize(0) {}
+
+    ~CMappedFile()
+    {
+#ifndef WIN32
+        if (pdata)
+            munmap(pdata, nSize);
+#endif
+    }
+
+    bool Map(const boost::filesystem::path& path)
+    {
+#ifndef WIN32
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        pdata = static_cast<char*>(p);
+        nSize = st.st_size;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+CBlockFileCache::CBlockFileCache(size_t nMaxOpenIn) : nMaxOpen(nMaxOpenIn)
+{
+}
+
+CBlockFileCache::~CBlockFileCache()
+{
+}
+
+boost::shared_ptr<CMappedFile> CBlockFileCache::Open(int nFile, size_t nMinSize)
+{
+    typedef std::list<std::pair<int, boost::shared_ptr<CMappedFile> > >::iterator iterator;
+    for (iterator it = listOpen.begin(); it != listOpen.end(); it++) {
+        if (it->first != nFile)
+            continue;
+        // The file being written to may have grown past the mapping
+        if (it->second->size() < nMinSize) {
+            listOpen.erase(it);
+            break;
+        }
+        listOpen.splice(listOpen.begin(), listOpen, it);
+        return listOpen.front().second;
+    }
+
+    boost::shared_ptr<CMappedFile> pfile(new CMappedFile());
+    if (!pfile->Map(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk")))
+        return boost::shared_ptr<CMappedFile>();
+    listOpen.push_front(std::make_pair(nFile, pfile));
+    // Readers that still hold an evicted mapping keep it alive
+    while (listOpen.size() > nMaxOpen)
+        listOpen.pop_back();
+    return pfile;
+}
+
+bool CBlockFileCache::ReadRawBlock(const CDiskBlockPos& pos, CRawBlock& raw)
+{
+    // Each block is preceded by the network magic and its size
+    static const size_t nHeaderSize = MESSAGE_START_SIZE + sizeof(uint32_t);
+    if (pos.IsNull() || pos.nPos < nHeaderSize)
+        return error("%s : invalid position %u in blk%05u.dat", __func__, pos.nPos, pos.nFile);
+
+#ifndef WIN32
+    boost::shared_ptr<CMappedFile> pfile;
+    {
+        LOCK(cs);
+        pfile = Open(pos.nFile, pos.nPos);
+    }
+    if (!pfile)
+        return error("%s : cannot map blk%05u.dat", __func__, pos.nFile);
+    if (pfile->size() < pos.nPos)
+        return error("%s : position %u is beyond the end of blk%05u.dat", __func__, pos.nPos, pos.nFile);
+    const char* pheader = pfile->data() + pos.nPos - nHeaderSize;
+    if (memcmp(pheader, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return error("%s : no block at position %u in blk%05u.dat", __func__, pos.nPos, pos.nFile);
+    uint32_t nSize;
+    memcpy(&nSize, pheader + MESSAGE_START_SIZE, sizeof(nSize));
+    if (nSize > MAX_BLOCK_SIZE)
+        return error("%s : invalid block size %u at position %u in blk%05u.dat", __func__, nSize, pos.nPos, pos.nFile);
+    if (pfile->size() - pos.nPos < nSize) {
+        // Written after the file was mapped
+        LOCK(cs);
+        pfile = Open(pos.nFile, pos.nPos + nSize);
+        if (!pfile || pfile->size() < pos.nPos || pfile->size() - pos.nPos < nSize)
+            return error("%s : block at position %u extends beyond the end of blk%05u.dat", __func__, pos.nPos, pos.nFile);
+    }
+    raw.pfile = pfile;
+    raw.vData.clear();
+    raw.pbegin = pfile->data() + pos.nPos;
+    raw.nSize = nSize;
+    return true;
+#else
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - nHeaderSize), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : OpenBlockFile failed", __func__);
+    try {
+        MessageStartChars pchMessageStart;
+        uint32_t nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+            return error("%s : no block at position %u in blk%05u.dat", __func__, pos.nPos, pos.nFile);
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("%s : invalid block size %u at position %u in blk%05u.dat", __func__, nSize, pos.nPos, pos.nFile);
+        raw.vData.resize(nSize);
+        filein.read(&raw.vData[0], nSize);
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    raw.pfile.reset();
+    raw.pbegin = &raw.vData[0];
+    raw.nSize = raw.vData.size();
+    return true;
+#endif
+}
+
+void CBlockFileCache::Forget(int nFile)
+{
+    LOCK(cs);
+    typedef std::list<std::pair<int, boost::shared_ptr<CMappedFile> > >::iterator iterator;
+    for (iterator it = listOpen.begin(); it != listOpen.end(); it++) {
+        if (it->first == nFile) {
+            listOpen.erase(it);
+            return;
+        }
+    }
+}
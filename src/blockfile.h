@@ -0,0 +1,71 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "chain.h"
+#include "sync.h"
+
+#include <list>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+class CMappedFile;
+
+/**
+ * The serialized bytes of a block in a block file. On platforms with mmap
+ * they are read straight from the mapped file, which this object keeps
+ * alive; elsewhere they are copied into memory.
+ */
+class CRawBlock
+{
+private:
+    boost::shared_ptr<CMappedFile> pfile;
+    std::vector<char> vData;
+    const char* pbegin;
+    size_t nSize;
+
+    friend class CBlockFileCache;
+
+public:
+    CRawBlock() : pbegin(NULL), nSize(0) {}
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+};
+
+/**
+ * Read-only access to blk?????.dat files, keeping the most recently used
+ * ones memory-mapped so repeated reads don't reopen and seek the file.
+ */
+class CBlockFileCache
+{
+private:
+    CCriticalSection cs;
+    size_t nMaxOpen;
+    //! Open mappings, most recently used first
+    std::list<std::pair<int, boost::shared_ptr<CMappedFile> > > listOpen;
+
+    boost::shared_ptr<CMappedFile> Open(int nFile, size_t nMinSize);
+
+public:
+    CBlockFileCache(size_t nMaxOpenIn);
+    ~CBlockFileCache();
+
+    /**
+     * Find the serialized block at pos, checking the record header that
+     * precedes it in the file. Returns false if the file or the block
+     * cannot be read.
+     */
+    bool ReadRawBlock(const CDiskBlockPos& pos, CRawBlock& raw);
+
+    //! Drop the mapping of a file, before it is truncated or deleted
+    void Forget(int nFile);
+};
+
+#endif // BITCOIN_BLOCKFILE_H
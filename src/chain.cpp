@@ -7,6 +7,22 @@
 
 using namespace std;
 
+/**
+ * CBlockIndexArena implementation
+ */
+CBlockIndexArena::~CBlockIndexArena() {
+    for (size_t i = 0; i < vChunks.size(); i++)
+        delete[] vChunks[i];
+}
+
+CBlockIndex* CBlockIndexArena::New() {
+    if (vChunks.empty() || nUsed == nChunkSize) {
+        vChunks.push_back(new CBlockIndex[nChunkSize]);
+        nUsed = 0;
+    }
+    return &vChunks.back()[nUsed++];
+}
+
 /**
  * CChain implementation
  */
@@ -347,6 +347,30 @@ public:
     }
 };
 
+/**
+ * Allocates block index entries in chunks rather than one at a time. Entries
+ * are never freed individually; they live as long as the arena.
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<CBlockIndex*> vChunks;
+    const size_t nChunkSize;
+    //! Entries handed out from the last chunk
+    size_t nUsed;
+
+    // Disallow copying
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+
+public:
+    CBlockIndexArena(size_t nChunkSizeIn = 4096) : nChunkSize(nChunkSizeIn), nUsed(0) {}
+    ~CBlockIndexArena();
+
+    //! A new, default constructed entry
+    CBlockIndex* New();
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain {
 private:
@@ -6,17 +6,22 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <deque>
+#include <utility>
 #include <vector>
 
-#include <boost/foreach.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -25,151 +30,217 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread owns a deque of verifications. The master deals new work
+  * out over all deques, threads work through their own deque from the
+  * back and steal from the front of the others' when it runs dry, so the
+  * threads do not contend on a single lock.
+  *
+  * Verifications are grouped in sessions (one per CCheckQueueControl),
+  * which are waited for independently. A new session can be filled while
+  * the verifications of an earlier one are still being processed.
   */
 template <typename T>
 class CCheckQueue
 {
+public:
+    //! The verifications added through one CCheckQueueControl.
+    struct CSession
+    {
+        //! Number of verifications that haven't completed yet, including
+        //! those that are not in a deque anymore but in a thread's batch.
+        boost::atomic<unsigned int> nTodo;
+
+        //! Whether all verifications so far succeeded. Once cleared, the
+        //! remaining verifications of the session are skipped.
+        boost::atomic<bool> fAllOk;
+
+        CSession() : nTodo(0), fAllOk(true) {}
+    };
+
 private:
-    //! Mutex to protect the inner state
-    boost::mutex mutex;
+    typedef std::pair<T, CSession*> Item;
 
-    //! Worker threads block on this when out of work
-    boost::condition_variable condWorker;
+    struct CWorkerQueue
+    {
+        boost::mutex mutex;
+        std::deque<Item> items;
+    };
 
-    //! Master thread blocks on this when out of work
-    boost::condition_variable condMaster;
+    //! One deque per thread. Slot 0 is the master's, workers claim the others.
+    boost::scoped_array<CWorkerQueue> vQueues;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The number of deques available.
+    unsigned int nMaxQueues;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of deques in use (1 + the number of workers, capped).
+    boost::atomic<unsigned int> nQueues;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The number of workers that have started.
+    unsigned int nWorkers;
 
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! Deque the next batch of work is added to.
+    boost::atomic<unsigned int> nNextQueue;
 
-    /**
-     * Number of verifications that haven't completed yet.
-     * This includes elements that are not anymore in queue, but still in
-     * worker's own batches.
-     */
-    unsigned int nTodo;
+    //! The number of verifications sitting in deques. May briefly be
+    //! negative, as work can be taken before Add() accounts for it.
+    boost::atomic<int> nQueued;
+
+    //! Mutex for threads going to sleep, and for worker registration
+    boost::mutex mutex;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! Worker threads block on this when out of work
+    boost::condition_variable condWorker;
+
+    //! Master threads block on this when out of work
+    boost::condition_variable condMaster;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    /** Take a batch of work, from the own deque if possible or else from another one. */
+    bool Take(unsigned int nSelf, std::vector<Item>& vBatch)
+    {
+        unsigned int n = nQueues;
+        for (unsigned int i = 0; i < n; i++) {
+            bool fOwn = (i == 0);
+            CWorkerQueue& queue = vQueues[(nSelf + i) % n];
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            if (queue.items.empty())
+                continue;
+            // Aim for increasingly smaller batches as the deque drains, so that
+            // all threads finish approximately simultaneously, and leave half
+            // of a deque to its owner when stealing.
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.items.size() / 2));
+            vBatch.resize(nNow);
+            for (unsigned int j = 0; j < nNow; j++) {
+                // Swap jobs out of the deque instead of copying them
+                Item& item = fOwn ? queue.items.back() : queue.items.front();
+                vBatch[j].first.swap(item.first);
+                vBatch[j].second = item.second;
+                if (fOwn)
+                    queue.items.pop_back();
+                else
+                    queue.items.pop_front();
+            }
+            nQueued -= nNow;
+            return true;
+        }
+        return false;
+    }
+
+    /** Execute a batch, and report completion to the sessions it belongs to. */
+    void Run(std::vector<Item>& vBatch)
+    {
+        for (unsigned int i = 0; i < vBatch.size(); i++) {
+            CSession* psession = vBatch[i].second;
+            if (psession->fAllOk.load(boost::memory_order_relaxed) && !vBatch[i].first())
+                psession->fAllOk = false;
+        }
+        size_t nSize = vBatch.size();
+        size_t i = 0;
+        while (i < nSize) {
+            CSession* psession = vBatch[i].second;
+            unsigned int nDone = 0;
+            while (i < nSize && vBatch[i].second == psession) {
+                nDone++;
+                i++;
+            }
+            // The session may be gone as soon as its counter hits zero
+            if (psession->nTodo.fetch_sub(nDone) == nDone) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                condMaster.notify_all();
+            }
+        }
+        vBatch.clear();
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    void Loop(unsigned int nSelf, CSession* pwait)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
+        std::vector<Item> vBatch;
+        vBatch.reserve(nBatchSize);
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+            if (pwait != NULL && pwait->nTodo == 0)
+                return;
+            if (Take(nSelf, vBatch)) {
+                Run(vBatch);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (pwait == NULL) {
+                while (nQueued <= 0)
+                    condWorker.wait(lock);
+            } else {
+                while (nQueued <= 0 && pwait->nTodo > 0)
+                    condMaster.wait(lock);
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
         } while (true);
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkers = 64) :
+        vQueues(new CWorkerQueue[nMaxWorkers + 1]), nMaxQueues(nMaxWorkers + 1), nQueues(1),
+        nWorkers(0), nNextQueue(0), nQueued(0), nBatchSize(nBatchSizeIn) {}
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        unsigned int nSelf;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nWorkers++;
+            // Beyond nMaxWorkers, threads share deques
+            nSelf = 1 + (nWorkers - 1) % (nMaxQueues - 1);
+            nQueues = std::min(nWorkers + 1, nMaxQueues);
+        }
+        Loop(nSelf, NULL);
     }
 
-    //! Wait until execution finishes, and return whether all evaluations where successful.
-    bool Wait()
+    //! Wait until execution of a session finishes, and return whether all evaluations where successful.
+    bool Wait(CSession& session)
     {
-        return Loop(true);
+        Loop(0, &session);
+        return session.fAllOk;
     }
 
     //! Add a batch of checks to the queue
-    void Add(std::vector<T>& vChecks)
+    void Add(std::vector<T>& vChecks, CSession& session)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        session.nTodo += vChecks.size();
+
+        // Deal the checks out over the deques, so every thread finds local work
+        unsigned int n = nQueues;
+        size_t nChunk = std::max((size_t)1, std::min((size_t)nBatchSize, vChecks.size() / n));
+        size_t i = 0;
+        while (i < vChecks.size()) {
+            CWorkerQueue& queue = vQueues[nNextQueue++ % n];
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            size_t nEnd = std::min(vChecks.size(), i + nChunk);
+            for (; i < nEnd; i++) {
+                queue.items.push_back(Item(T(), &session));
+                queue.items.back().first.swap(vChecks[i]);
+            }
         }
-        nTodo += vChecks.size();
+        nQueued += vChecks.size();
+
+        boost::unique_lock<boost::mutex> lock(mutex);
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
+        condMaster.notify_all();
     }
 
     ~CCheckQueue()
     {
     }
-
-    bool IsIdle()
-    {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
-    }
-
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
  */
@@ -178,23 +249,19 @@ class CCheckQueueControl
 {
 private:
     CCheckQueue<T>* pqueue;
+    typename CCheckQueue<T>::CSession session;
     bool fDone;
 
 public:
     CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
     {
-        // passed queue is supposed to be unused, or NULL
-        if (pqueue != NULL) {
-            bool isIdle = pqueue->IsIdle();
-            assert(isIdle);
-        }
     }
 
     bool Wait()
     {
         if (pqueue == NULL)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = pqueue->Wait(session);
         fDone = true;
         return fRet;
     }
@@ -202,14 +269,72 @@ public:
     void Add(std::vector<T>& vChecks)
     {
         if (pqueue != NULL)
-            pqueue->Add(vChecks);
+            pqueue->Add(vChecks, session);
     }
 
     ~CCheckQueueControl()
     {
-        if (!fDone)
+        if (!fDone) {
+            // Nobody is interested in the result anymore: skip the remaining
+            // checks, but wait for the ones in progress, as they may refer
+            // to data owned by the caller.
+            session.fAllOk = false;
             Wait();
+        }
     }
 };
 
+/**
+ * A CCheckQueue with its own nThreads - 1 worker threads, the caller of Run
+ * being the last one, for parallel work that comes in several rounds and
+ * doesn't warrant a long-lived queue. The threads are stopped when it is
+ * destroyed.
+ */
+template <typename T>
+class CCheckQueuePool
+{
+private:
+    CCheckQueue<T> queue;
+    boost::thread_group threads;
+
+public:
+    CCheckQueuePool(int nThreads) : queue(1, std::max(nThreads - 1, 1))
+    {
+        for (int i = 0; i < nThreads - 1; i++)
+            threads.create_thread(boost::bind(&CCheckQueue<T>::Thread, &queue));
+    }
+
+    ~CCheckQueuePool()
+    {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+
+    /** Run a set of jobs, which are swapped out of vJobs. Returns whether all of them succeeded. */
+    bool Run(std::vector<T>& vJobs)
+    {
+        if (threads.size() == 0 || vJobs.size() < 2) {
+            for (size_t i = 0; i < vJobs.size(); i++)
+                if (!vJobs[i]())
+                    return false;
+            return true;
+        }
+        CCheckQueueControl<T> control(&queue);
+        control.Add(vJobs);
+        return control.Wait();
+    }
+};
+
+/**
+ * Run a one-off set of jobs on nThreads threads, the caller being one of them.
+ * The jobs are swapped out of vJobs. Returns whether all of them succeeded.
+ */
+template <typename T>
+bool RunParallel(std::vector<T>& vJobs, int nThreads)
+{
+    // Not worth starting threads for
+    CCheckQueuePool<T> pool(vJobs.size() < 2 ? 1 : nThreads);
+    return pool.Run(vJobs);
+}
+
 #endif // BITCOIN_CHECKQUEUE_H
@@ -6,6 +6,8 @@
 
 #include "random.h"
 
+#include <algorithm>
+
 #include <assert.h>
 
 /**
@@ -56,6 +58,12 @@ bool CCoins::Spend(int nPos) {
 
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
+void CCoinsView::GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<CCoins> &vCoins, std::vector<char> &vFound) const {
+    vCoins.resize(vTxid.size());
+    vFound.resize(vTxid.size());
+    for (size_t i = 0; i < vTxid.size(); i++)
+        vFound[i] = GetCoins(vTxid[i], vCoins[i]);
+}
 uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
 bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
@@ -71,7 +79,7 @@ bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0), cachedCoinsUsage(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -87,6 +95,7 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
     tmp.swap(ret->second.coins);
+    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
@@ -104,6 +113,46 @@ bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
     return false;
 }
 
+void CCoinsViewCache::GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<CCoins> &vCoins, std::vector<char> &vFound) const {
+    Prefetch(vTxid);
+    vCoins.resize(vTxid.size());
+    vFound.assign(vTxid.size(), false);
+    for (size_t i = 0; i < vTxid.size(); i++) {
+        CCoinsMap::const_iterator it = cacheCoins.find(vTxid[i]);
+        if (it != cacheCoins.end()) {
+            vCoins[i] = it->second.coins;
+            vFound[i] = true;
+        }
+    }
+}
+
+size_t CCoinsViewCache::Prefetch(const std::vector<uint256> &vTxid) const {
+    std::vector<uint256> vMissing;
+    for (size_t i = 0; i < vTxid.size(); i++) {
+        if (cacheCoins.find(vTxid[i]) == cacheCoins.end())
+            vMissing.push_back(vTxid[i]);
+    }
+    if (vMissing.empty())
+        return 0;
+    std::sort(vMissing.begin(), vMissing.end());
+    vMissing.erase(std::unique(vMissing.begin(), vMissing.end()), vMissing.end());
+
+    std::vector<CCoins> vCoins;
+    std::vector<char> vFound;
+    base->GetCoinsBatch(vMissing, vCoins, vFound);
+    for (size_t i = 0; i < vMissing.size(); i++) {
+        if (!vFound[i])
+            continue;
+        // Same as FetchCoins
+        CCoinsMap::iterator it = cacheCoins.insert(std::make_pair(vMissing[i], CCoinsCacheEntry())).first;
+        vCoins[i].swap(it->second.coins);
+        cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
+        if (it->second.coins.IsPruned())
+            it->second.flags = CCoinsCacheEntry::FRESH;
+    }
+    return vMissing.size();
+}
+
 CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
@@ -116,10 +165,11 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
+        cachedCoinsUsage += ret.first->second.coins.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    return CCoinsModifier(*this, &*ret.first, ret.first->second.coins.DynamicMemoryUsage());
 }
 
 const CCoins* CCoinsViewCache::AccessCoins(const uint256 &txid) const {
@@ -164,6 +214,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
                     entry.coins.swap(it->second.coins);
+                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
                 }
             } else {
@@ -171,10 +222,13 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
+                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
+                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.coins.swap(it->second.coins);
+                    cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
                 }
             }
@@ -189,6 +243,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
 bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
     return fOk;
 }
 
@@ -196,6 +251,10 @@ unsigned int CCoinsViewCache::GetCacheSize() const {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const {
+    return cacheCoins.DynamicMemoryUsage() + cachedCoinsUsage;
+}
+
 const CTxOut &CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
     const CCoins* coins = AccessCoins(input.prevout.hash);
@@ -246,7 +305,7 @@ double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_) {
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::value_type* pentry_, size_t nUsage) : cache(cache_), pentry(pentry_), nCachedUsage(nUsage) {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
 }
@@ -255,8 +314,11 @@ CCoinsModifier::~CCoinsModifier()
 {
     assert(cache.hasModifier);
     cache.hasModifier = false;
-    it->second.coins.Cleanup();
-    if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
-        cache.cacheCoins.erase(it);
+    pentry->second.coins.Cleanup();
+    cache.cachedCoinsUsage -= nCachedUsage;
+    if ((pentry->second.flags & CCoinsCacheEntry::FRESH) && pentry->second.coins.IsPruned()) {
+        cache.cacheCoins.erase(cache.cacheCoins.find(pentry->first));
+    } else {
+        cache.cachedCoinsUsage += pentry->second.coins.DynamicMemoryUsage();
     }
 }
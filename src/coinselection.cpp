@@ -0,0 +1,292 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+
+#include "random.h"
+#include "util.h"
+#include "utilmoneystr.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+namespace
+{
+struct CompareValueDescending
+{
+    bool operator()(const CSelectionCoin& t1, const CSelectionCoin& t2) const
+    {
+        return t1.first > t2.first;
+    }
+};
+
+/** A fast shuffle for tie-breaking; like the subset search this needs no cryptographic randomness. */
+int InsecureRandInt(int nMax)
+{
+    return insecure_rand() % nMax;
+}
+
+struct CompareValueAtLeast
+{
+    bool operator()(const CSelectionCoin& t, const CAmount& nValue) const
+    {
+        return t.first >= nValue;
+    }
+};
+}
+
+static void ApproximateBestSubset(const vector<CSelectionCoin>& vValue, size_t nBegin, const CAmount& nTotalLower, const CAmount& nTargetValue,
+                                  vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
+{
+    const size_t nCount = vValue.size() - nBegin;
+    vector<char> vfIncluded;
+    // Coins are only ever taken off again right after being added, so the
+    // ones included form a stack, and a better total found during a pass is
+    // what was on it then plus the coin that reached the target. Recording
+    // that instead of copying every flag keeps an improvement O(1).
+    vector<size_t> vIncluded, vBest;
+    bool fImproved = false;
+
+    nBest = nTotalLower;
+
+    seed_insecure_rand();
+
+    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    {
+        vfIncluded.assign(nCount, false);
+        vIncluded.clear();
+        size_t nBestDepth = 0, nBestLast = 0;
+        bool fImprovedRep = false;
+        CAmount nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        {
+            for (unsigned int i = 0; i < nCount; i++)
+            {
+                //The solver here uses a randomized algorithm,
+                //the randomness serves no real security purpose but is just
+                //needed to prevent degenerate behavior and it is important
+                //that the rng is fast. We do not use a constant random sequence,
+                //because there may be some privacy improvement by making
+                //the selection random.
+                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
+                {
+                    nTotal += vValue[nBegin + i].first;
+                    if (nTotal >= nTargetValue)
+                    {
+                        fReachedTarget = true;
+                        if (nTotal < nBest)
+                        {
+                            nBest = nTotal;
+                            nBestDepth = vIncluded.size();
+                            nBestLast = i;
+                            fImprovedRep = true;
+                        }
+                        nTotal -= vValue[nBegin + i].first;
+                    }
+                    else
+                    {
+                        vfIncluded[i] = true;
+                        vIncluded.push_back(i);
+                    }
+                }
+            }
+        }
+        if (fImprovedRep)
+        {
+            vBest.assign(vIncluded.begin(), vIncluded.begin() + nBestDepth);
+            vBest.push_back(nBestLast);
+            fImproved = true;
+        }
+    }
+
+    vfBest.assign(nCount, !fImproved);
+    BOOST_FOREACH(size_t i, vBest)
+        vfBest[i] = true;
+}
+
+CCoinSelectionSet::CCoinSelectionSet(const vector<COutput>& vCoins, int nConfMine, int nConfTheirs)
+{
+    BOOST_FOREACH(const COutput &output, vCoins)
+    {
+        if (!output.fSpendable)
+            continue;
+
+        const CWalletTx *pcoin = output.tx;
+
+        if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
+            continue;
+
+        vValue.push_back(make_pair(pcoin->vout[output.i].nValue, make_pair(pcoin, (unsigned int)output.i)));
+    }
+
+    // Shuffle first so that which of several equal coins gets picked is random
+    seed_insecure_rand();
+    random_shuffle(vValue.begin(), vValue.end(), InsecureRandInt);
+    stable_sort(vValue.begin(), vValue.end(), CompareValueDescending());
+
+    vTotal.resize(vValue.size() + 1);
+    vTotal[vValue.size()] = 0;
+    for (size_t i = vValue.size(); i-- > 0; )
+        vTotal[i] = vTotal[i + 1] + vValue[i].first;
+}
+
+size_t CCoinSelectionSet::FirstBelow(const CAmount& nValue) const
+{
+    return lower_bound(vValue.begin(), vValue.end(), nValue, CompareValueAtLeast()) - vValue.begin();
+}
+
+bool CCoinSelectionSet::FindExactSubset(size_t nBegin, const CAmount& nTargetValue, vector<size_t>& vSelected) const
+{
+    // Depth first from the largest coin down, taking each coin that still
+    // fits before trying without it. Coins too large for what is left are
+    // skipped with one binary search. A branch ends as soon as the coins left
+    // can't make up the difference, and leaving a coin out skips the equal
+    // coins after it, which could only reach the same sums.
+    vSelected.clear();
+    CAmount nTotal = 0;
+    size_t i = nBegin;
+    for (int nTries = 0; nTries < MAX_EXACT_MATCH_TRIES; nTries++)
+    {
+        if (nTotal == nTargetValue)
+            return true;
+
+        if (i < vValue.size() && nTotal + vTotal[i] >= nTargetValue)
+        {
+            if (nTotal + vValue[i].first <= nTargetValue)
+            {
+                vSelected.push_back(i);
+                nTotal += vValue[i].first;
+                i++;
+            }
+            else
+                i = FirstBelow(nTargetValue - nTotal + 1);
+            continue;
+        }
+
+        // Backtrack to the last coin taken and leave it out
+        if (vSelected.empty())
+            return false;
+        size_t j = vSelected.back();
+        vSelected.pop_back();
+        nTotal -= vValue[j].first;
+        i = j + 1;
+        while (i < vValue.size() && vValue[i].first == vValue[j].first)
+            i++;
+    }
+    return false;
+}
+
+bool CCoinSelectionSet::Select(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    // Coins from nSmaller on are worth at most the target
+    size_t nSmaller = FirstBelow(nTargetValue + 1);
+    if (nSmaller < vValue.size() && vValue[nSmaller].first == nTargetValue)
+    {
+        setCoinsRet.insert(vValue[nSmaller].second);
+        nValueRet += vValue[nSmaller].first;
+        return true;
+    }
+
+    // Coins from nLower on are worth less than the target plus a cent; the
+    // one just before them is the smallest worth more
+    size_t nLower = FirstBelow(nTargetValue + CENT);
+    CAmount nTotalLower = vTotal[nLower];
+    const CSelectionCoin* pcoinLowestLarger = nLower > 0 ? &vValue[nLower - 1] : NULL;
+
+    if (nTotalLower == nTargetValue)
+    {
+        for (size_t i = nLower; i < vValue.size(); ++i)
+        {
+            setCoinsRet.insert(vValue[i].second);
+            nValueRet += vValue[i].first;
+        }
+        return true;
+    }
+
+    if (nTotalLower < nTargetValue)
+    {
+        if (pcoinLowestLarger == NULL)
+            return false;
+        setCoinsRet.insert(pcoinLowestLarger->second);
+        nValueRet += pcoinLowestLarger->first;
+        return true;
+    }
+
+    vector<size_t> vExact;
+    if (FindExactSubset(nSmaller, nTargetValue, vExact))
+    {
+        BOOST_FOREACH(size_t i, vExact)
+        {
+            setCoinsRet.insert(vValue[i].second);
+            nValueRet += vValue[i].first;
+        }
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation, with fewer passes the
+    // more coins each one has to visit
+    vector<char> vfBest;
+    CAmount nBest;
+    int64_t nIterations = MAX_APPROXIMATE_SUBSET_WORK / (int64_t)(vValue.size() - nLower);
+    nIterations = std::max((int64_t)10, std::min((int64_t)1000, nIterations));
+
+    ApproximateBestSubset(vValue, nLower, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
+    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+        ApproximateBestSubset(vValue, nLower, nTotalLower, nTargetValue + CENT, vfBest, nBest, nIterations);
+
+    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+    //                                   or the next bigger coin is closer), return the bigger coin
+    if (pcoinLowestLarger &&
+        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || pcoinLowestLarger->first <= nBest))
+    {
+        setCoinsRet.insert(pcoinLowestLarger->second);
+        nValueRet += pcoinLowestLarger->first;
+    }
+    else {
+        for (size_t i = 0; i < vfBest.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[nLower + i].second);
+                nValueRet += vValue[nLower + i].first;
+            }
+
+        LogPrint("selectcoins", "SelectCoins() best subset: ");
+        for (size_t i = 0; i < vfBest.size(); i++)
+            if (vfBest[i])
+                LogPrint("selectcoins", "%s ", FormatMoney(vValue[nLower + i].first));
+        LogPrint("selectcoins", "total %s\n", FormatMoney(nBest));
+    }
+
+    return true;
+}
+
+CCoinSelector::CCoinSelector(const vector<COutput>& vAvailableIn, bool fSpendZeroConfChange) : vAvailable(vAvailableIn)
+{
+    vLevels.push_back(make_pair(1, 6));
+    vLevels.push_back(make_pair(1, 1));
+    if (fSpendZeroConfChange)
+        vLevels.push_back(make_pair(0, 1));
+    vSets.resize(vLevels.size());
+}
+
+bool CCoinSelector::Select(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet)
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+    for (size_t i = 0; i < vLevels.size(); i++)
+    {
+        if (!vSets[i])
+            vSets[i].reset(new CCoinSelectionSet(vAvailable, vLevels[i].first, vLevels[i].second));
+        if (vSets[i]->GetTotal() >= nTargetValue && vSets[i]->Select(nTargetValue, setCoinsRet, nValueRet))
+            return true;
+    }
+    return false;
+}
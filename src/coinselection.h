@@ -0,0 +1,78 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSELECTION_H
+#define BITCOIN_COINSELECTION_H
+
+#include "amount.h"
+#include "wallet.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+/** Upper bound on the branches the exact-match search visits per target */
+static const int MAX_EXACT_MATCH_TRIES = 100000;
+/** Upper bound on coins visited by the stochastic subset search per target */
+static const int64_t MAX_APPROXIMATE_SUBSET_WORK = 1000000;
+
+typedef std::pair<CAmount, std::pair<const CWalletTx*, unsigned int> > CSelectionCoin;
+
+/**
+ * The coins that may be spent at one confirmation level, sorted from the
+ * largest down with equal values in random order, and the running totals of
+ * their values from each position to the end. Finding the coins around a
+ * target takes a binary search rather than a pass over the wallet, so one
+ * set serves every fee a transaction is tried with.
+ */
+class CCoinSelectionSet
+{
+private:
+    std::vector<CSelectionCoin> vValue;
+    //! vTotal[i] is the sum of the values of vValue[i] onwards
+    std::vector<CAmount> vTotal;
+
+    /** The position of the first coin worth less than nValue, or size(). */
+    size_t FirstBelow(const CAmount& nValue) const;
+    /** Search the coins from nBegin on for a subset worth exactly nTargetValue, giving up after MAX_EXACT_MATCH_TRIES steps. */
+    bool FindExactSubset(size_t nBegin, const CAmount& nTargetValue, std::vector<size_t>& vSelected) const;
+
+public:
+    CCoinSelectionSet(const std::vector<COutput>& vCoins, int nConfMine, int nConfTheirs);
+
+    size_t size() const { return vValue.size(); }
+    CAmount GetTotal() const { return vTotal[0]; }
+
+    /**
+     * Choose coins worth at least nTargetValue: one coin of exactly that
+     * value, else a subset that adds up to it exactly, else the better of the
+     * smallest coin worth more and the closest subset the bounded stochastic
+     * search finds among the smaller ones.
+     */
+    bool Select(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+};
+
+/**
+ * Coin selection for one transaction: the wallet's available coins, indexed
+ * at each confirmation level the first time that level is needed.
+ */
+class CCoinSelector
+{
+private:
+    std::vector<COutput> vAvailable;
+    std::vector<std::pair<int, int> > vLevels;
+    std::vector<boost::shared_ptr<CCoinSelectionSet> > vSets;
+
+public:
+    CCoinSelector(const std::vector<COutput>& vAvailableIn, bool fSpendZeroConfChange);
+
+    const std::vector<COutput>& GetAvailable() const { return vAvailable; }
+
+    /** Select coins at the strictest confirmation level that can pay nTargetValue. */
+    bool Select(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet);
+};
+
+#endif // BITCOIN_COINSELECTION_H
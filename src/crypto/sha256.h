@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,36 @@ public:
     CSHA256& Reset();
 };
 
+/**
+ * Select the fastest SHA-256 implementation the CPU supports, and return a
+ * description of it. Until this is called the portable one is used.
+ */
+std::string SHA256AutoDetect();
+
+/**
+ * Compute the double-SHA256 of each of a number of 64-byte inputs, such as the
+ * pairs of hashes in a merkle tree, several at a time where the CPU allows.
+ * output: blocks * 32 bytes; input: blocks * 64 bytes.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/**
+ * The double-SHA256 of an 80-byte block header for a run of nonces, its last
+ * four bytes. The first 64 bytes are hashed once, when the hasher is created;
+ * each nonce then costs the second chunk and the second hash, computed several
+ * nonces at a time where the CPU allows.
+ */
+class CSHA256D80
+{
+private:
+    uint32_t midstate[8];
+    unsigned char tail[12];
+
+public:
+    //! header: the first 76 bytes of the block header, up to the nonce
+    explicit CSHA256D80(const unsigned char* header);
+    //! output: count * 32 bytes, the hashes with nonces nNonce .. nNonce + count - 1
+    void Hash(unsigned char* output, uint32_t nNonce, size_t count) const;
+};
+
 #endif // BITCOIN_CRYPTO_SHA256_H
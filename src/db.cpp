@@ -53,6 +53,9 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    nSyncRequested = 0;
+    nSyncDone = 0;
+    fSyncing = false;
 }
 
 CDBEnv::~CDBEnv()
@@ -218,7 +221,7 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL), batchTxn(NULL), fBatchOwner(false)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -273,6 +276,12 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
 
             bitdb.mapDb[strFile] = pdb;
         }
+
+        // Join this thread's batch on the file; writing beside it instead
+        // would wait for locks the batch holds until it commits
+        map<string, pair<DbTxn*, boost::thread::id> >::iterator mi = bitdb.mapBatchTxn.find(strFile);
+        if (mi != bitdb.mapBatchTxn.end() && mi->second.second == boost::this_thread::get_id())
+            activeTxn = batchTxn = mi->second.first;
     }
 }
 
@@ -281,23 +290,33 @@ void CDB::Flush()
     if (activeTxn)
         return;
 
-    // Flush database activity from memory pool to disk log
-    unsigned int nMinutes = 0;
-    if (fReadOnly)
-        nMinutes = 1;
-
-    bitdb.dbenv.txn_checkpoint(nMinutes ? GetArg("-dblogsize", 100) * 1024 : 0, nMinutes, 0);
+    // Move database activity from the memory pool to the data file once the
+    // log has grown or a minute has passed; what was committed since is
+    // already durable in the log, see SyncLog
+    bitdb.dbenv.txn_checkpoint(GetArg("-dblogsize", 100) * 1024, 1, 0);
 }
 
 void CDB::Close()
 {
     if (!pdb)
         return;
-    if (activeTxn)
+    if (activeTxn && activeTxn != batchTxn)
         activeTxn->abort();
     activeTxn = NULL;
+    if (fBatchOwner) {
+        LogPrintf("CDB::Close : aborting uncommitted batch on %s\n", strFile);
+        batchTxn->abort();
+        LOCK(bitdb.cs_db);
+        bitdb.mapBatchTxn.erase(strFile);
+        fBatchOwner = false;
+    }
+    // Writes into a batch are made durable when it commits
+    bool fSync = !fReadOnly && !batchTxn;
+    batchTxn = NULL;
     pdb = NULL;
 
+    if (fSync)
+        bitdb.SyncLog();
     Flush();
 
     {
@@ -306,6 +325,86 @@ void CDB::Close()
     }
 }
 
+bool CDB::BatchBegin()
+{
+    if (!pdb || activeTxn != batchTxn)
+        return false;
+    if (batchTxn)
+        return true;
+
+    DbTxn* ptxn = bitdb.TxnBegin();
+    if (!ptxn)
+        return false;
+    {
+        LOCK(bitdb.cs_db);
+        if (bitdb.mapBatchTxn.count(strFile)) {
+            // Another thread is batching this file
+            ptxn->abort();
+            return false;
+        }
+        bitdb.mapBatchTxn[strFile] = make_pair(ptxn, boost::this_thread::get_id());
+    }
+    activeTxn = batchTxn = ptxn;
+    fBatchOwner = true;
+    return true;
+}
+
+bool CDB::BatchCommit(bool fSync)
+{
+    if (!pdb || !batchTxn || activeTxn != batchTxn)
+        return false;
+    if (!fBatchOwner)
+        return true;
+
+    {
+        LOCK(bitdb.cs_db);
+        bitdb.mapBatchTxn.erase(strFile);
+    }
+    int ret = batchTxn->commit(0);
+    activeTxn = batchTxn = NULL;
+    fBatchOwner = false;
+    if (ret != 0)
+        return false;
+    bitdb.SyncLog(fSync);
+    return true;
+}
+
+void CDBEnv::SyncLog(bool fWait)
+{
+    if (!fDbEnvInit || fMockDb)
+        return;
+
+    boost::unique_lock<boost::mutex> lock(mutexSync);
+    // Any flush that starts from now on covers what this thread committed
+    uint64_t nTicket = ++nSyncRequested;
+    if (!fWait)
+        return;
+    while (nSyncDone < nTicket) {
+        if (fSyncing) {
+            condSync.wait(lock);
+            continue;
+        }
+        fSyncing = true;
+        uint64_t nCovered = nSyncRequested;
+        lock.unlock();
+        int ret = dbenv.log_flush(NULL);
+        lock.lock();
+        fSyncing = false;
+        if (ret != 0)
+            LogPrintf("CDBEnv::SyncLog : Error %d flushing log: %s\n", ret, DbEnv::strerror(ret));
+        // A failed flush releases the waiters all the same; the next
+        // checkpoint retries the write
+        nSyncDone = nCovered;
+        condSync.notify_all();
+    }
+}
+
+bool CDBEnv::IsSyncPending()
+{
+    boost::unique_lock<boost::mutex> lock(mutexSync);
+    return nSyncDone < nSyncRequested;
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
@@ -17,6 +17,9 @@
 #include <vector>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 #include <db_cxx.h>
 
@@ -37,6 +40,13 @@ private:
     bool fMockDb;
     boost::filesystem::path path;
 
+    //! Group commit state, see SyncLog
+    boost::mutex mutexSync;
+    boost::condition_variable condSync;
+    uint64_t nSyncRequested;
+    uint64_t nSyncDone;
+    bool fSyncing;
+
     void EnvShutdown();
 
 public:
@@ -44,6 +54,8 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    //! The open batch on each file and the thread it belongs to, see CDB::BatchBegin
+    std::map<std::string, std::pair<DbTxn*, boost::thread::id> > mapBatchTxn;
 
     CDBEnv();
     ~CDBEnv();
@@ -75,13 +87,24 @@ public:
     void Flush(bool fShutdown);
     void CheckpointLSN(const std::string& strFile);
 
+    /**
+     * Make every transaction committed so far durable. A thread that asks
+     * while a log flush is under way waits for the next one, which then
+     * covers all the threads that asked meanwhile, so a burst of commits
+     * costs one fsync rather than one each. With fWait false the flush is
+     * left to ThreadFlushWalletDB, which makes it within half a second.
+     */
+    void SyncLog(bool fWait = true);
+    /** Whether commits are waiting for a flush that SyncLog(false) deferred */
+    bool IsSyncPending();
+
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
-    DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC)
+    DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC, DbTxn* parent = NULL)
     {
         DbTxn* ptxn = NULL;
-        int ret = dbenv.txn_begin(NULL, &ptxn, flags);
+        int ret = dbenv.txn_begin(parent, &ptxn, flags);
         if (!ptxn || ret != 0)
             return NULL;
         return ptxn;
@@ -98,6 +121,9 @@ protected:
     Db* pdb;
     std::string strFile;
     DbTxn* activeTxn;
+    //! The batch this handle began or joined, which activeTxn falls back to
+    DbTxn* batchTxn;
+    bool fBatchOwner;
     bool fReadOnly;
 
     explicit CDB(const std::string& strFilename, const char* pszMode = "r+");
@@ -221,8 +247,10 @@ protected:
     {
         if (!pdb)
             return NULL;
+        // Read inside this handle's transaction: a cursor outside it would
+        // wait for the page locks the thread's own batch holds
         Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        int ret = pdb->cursor(activeTxn, &pcursor, 0);
         if (ret != 0)
             return NULL;
         return pcursor;
@@ -268,9 +296,9 @@ protected:
 public:
     bool TxnBegin()
     {
-        if (!pdb || activeTxn)
+        if (!pdb || activeTxn != batchTxn)
             return false;
-        DbTxn* ptxn = bitdb.TxnBegin();
+        DbTxn* ptxn = bitdb.TxnBegin(DB_TXN_WRITE_NOSYNC, batchTxn);
         if (!ptxn)
             return false;
         activeTxn = ptxn;
@@ -279,22 +307,33 @@ public:
 
     bool TxnCommit()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || activeTxn == batchTxn)
             return false;
         int ret = activeTxn->commit(0);
-        activeTxn = NULL;
+        activeTxn = batchTxn;
         return (ret == 0);
     }
 
     bool TxnAbort()
     {
-        if (!pdb || !activeTxn)
+        if (!pdb || activeTxn == batchTxn)
             return false;
         int ret = activeTxn->abort();
-        activeTxn = NULL;
+        activeTxn = batchTxn;
         return (ret == 0);
     }
 
+    /**
+     * Start a batch: until BatchCommit, the writes made through this handle
+     * and through every other handle the calling thread opens on the same
+     * file go into one transaction, which is made durable once rather than
+     * per write. A handle that joined a batch leaves it to its owner, and
+     * must be closed before the owner commits.
+     */
+    bool BatchBegin();
+    /** Commit the batch; with fSync false its durability is left to the flush thread. */
+    bool BatchCommit(bool fSync = true);
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
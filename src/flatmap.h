@@ -0,0 +1,255 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATMAP_H
+#define BITCOIN_FLATMAP_H
+
+#include "memusage.h"
+
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * STL-like hash map with open addressing.
+ *
+ * The table itself is a flat array of (hash tag, entry number) slots probed
+ * linearly, so a lookup touches one cache line before comparing any key.
+ * The entries live in an arena of fixed-size chunks and are never moved:
+ * pointers and references to elements stay valid until the element is
+ * erased, even when the table grows. Iterators are invalidated by insertion.
+ *
+ * Only the subset of the std::map interface needed by its users is provided.
+ */
+template <typename K, typename V, typename Hasher>
+class flatmap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef size_t size_type;
+
+private:
+    static const uint32_t SLOT_EMPTY = 0xffffffff;
+    static const uint32_t SLOT_DELETED = 0xfffffffe;
+    static const uint32_t CHUNK_BITS = 8;
+    static const uint32_t CHUNK_SIZE = 1 << CHUNK_BITS;
+
+    struct Slot
+    {
+        uint32_t nTag;
+        uint32_t nEntry;
+    };
+
+    Hasher hasher;
+    //! The table; its size is zero or a power of two
+    std::vector<Slot> vSlots;
+    //! Number of elements
+    size_t nUsed;
+    //! Number of slots of erased elements, which must be probed past
+    size_t nDeleted;
+    //! The entry arena
+    std::vector<value_type*> vChunks;
+    //! Arena entries below this number have been handed out at some point
+    uint32_t nEntries;
+    //! Arena entries that were freed by erase()
+    std::vector<uint32_t> vFree;
+
+    // Disallow copying
+    flatmap(const flatmap&);
+    flatmap& operator=(const flatmap&);
+
+    value_type* Entry(uint32_t nEntry) const
+    {
+        return vChunks[nEntry >> CHUNK_BITS] + (nEntry & (CHUNK_SIZE - 1));
+    }
+
+    uint32_t Tag(const K& k) const
+    {
+        return (uint32_t)hasher(k);
+    }
+
+    //! Position of the first slot at or after pos that holds an element
+    size_t Next(size_t pos) const
+    {
+        while (pos < vSlots.size() && vSlots[pos].nEntry >= SLOT_DELETED)
+            pos++;
+        return pos;
+    }
+
+    size_t Find(const K& k, uint32_t nTag) const
+    {
+        if (vSlots.empty())
+            return 0;
+        size_t mask = vSlots.size() - 1;
+        for (size_t pos = nTag & mask;; pos = (pos + 1) & mask) {
+            const Slot& slot = vSlots[pos];
+            if (slot.nEntry == SLOT_EMPTY)
+                return vSlots.size();
+            if (slot.nEntry != SLOT_DELETED && slot.nTag == nTag && Entry(slot.nEntry)->first == k)
+                return pos;
+        }
+    }
+
+    //! Position of the slot a new element with the given tag goes to
+    size_t FreeSlot(uint32_t nTag) const
+    {
+        size_t mask = vSlots.size() - 1;
+        size_t pos = nTag & mask;
+        while (vSlots[pos].nEntry < SLOT_DELETED)
+            pos = (pos + 1) & mask;
+        return pos;
+    }
+
+    //! Rebuild the table with room for at least nMin elements, dropping deleted slots
+    void Rehash(size_t nMin)
+    {
+        size_t nSize = std::max((size_t)16, vSlots.size());
+        while (nMin * 2 > nSize)
+            nSize *= 2;
+        std::vector<Slot> vOld;
+        vOld.swap(vSlots);
+        Slot empty = {0, SLOT_EMPTY};
+        vSlots.assign(nSize, empty);
+        for (size_t i = 0; i < vOld.size(); i++) {
+            if (vOld[i].nEntry < SLOT_DELETED)
+                vSlots[FreeSlot(vOld[i].nTag)] = vOld[i];
+        }
+        nDeleted = 0;
+    }
+
+    uint32_t AllocEntry()
+    {
+        if (!vFree.empty()) {
+            uint32_t nEntry = vFree.back();
+            vFree.pop_back();
+            return nEntry;
+        }
+        if (nEntries == vChunks.size() * CHUNK_SIZE)
+            vChunks.push_back(static_cast<value_type*>(::operator new(sizeof(value_type) * CHUNK_SIZE)));
+        return nEntries++;
+    }
+
+public:
+    template <typename Map, typename Value>
+    class iterator_base
+    {
+    private:
+        Map* map;
+        size_t pos;
+
+        template <typename, typename>
+        friend class iterator_base;
+        friend class flatmap;
+
+    public:
+        iterator_base() : map(NULL), pos(0) {}
+        iterator_base(Map* mapIn, size_t posIn) : map(mapIn), pos(posIn) {}
+        //! Allow conversion from iterator to const_iterator
+        template <typename Map2, typename Value2>
+        iterator_base(const iterator_base<Map2, Value2>& it) : map(it.map), pos(it.pos) {}
+
+        Value& operator*() const { return *map->Entry(map->vSlots[pos].nEntry); }
+        Value* operator->() const { return map->Entry(map->vSlots[pos].nEntry); }
+        iterator_base& operator++()
+        {
+            pos = map->Next(pos + 1);
+            return *this;
+        }
+        iterator_base operator++(int)
+        {
+            iterator_base ret = *this;
+            ++(*this);
+            return ret;
+        }
+        bool operator==(const iterator_base& it) const { return pos == it.pos; }
+        bool operator!=(const iterator_base& it) const { return pos != it.pos; }
+    };
+
+    typedef iterator_base<flatmap, value_type> iterator;
+    typedef iterator_base<const flatmap, const value_type> const_iterator;
+
+    flatmap() : nUsed(0), nDeleted(0), nEntries(0) {}
+    ~flatmap() { clear(); }
+
+    iterator begin() { return iterator(this, Next(0)); }
+    const_iterator begin() const { return const_iterator(this, Next(0)); }
+    iterator end() { return iterator(this, vSlots.size()); }
+    const_iterator end() const { return const_iterator(this, vSlots.size()); }
+    size_type size() const { return nUsed; }
+    bool empty() const { return nUsed == 0; }
+
+    iterator find(const key_type& k) { return iterator(this, Find(k, Tag(k))); }
+    const_iterator find(const key_type& k) const { return const_iterator(this, Find(k, Tag(k))); }
+    size_type count(const key_type& k) const { return Find(k, Tag(k)) != vSlots.size(); }
+
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        uint32_t nTag = Tag(value.first);
+        size_t pos = Find(value.first, nTag);
+        if (pos != vSlots.size())
+            return std::make_pair(iterator(this, pos), false);
+        // Keep at least a quarter of the slots empty, so probes stay short
+        if ((nUsed + nDeleted + 1) * 4 > vSlots.size() * 3)
+            Rehash(nUsed + 1);
+        uint32_t nEntry = AllocEntry();
+        try {
+            new (Entry(nEntry)) value_type(value);
+        } catch (...) {
+            vFree.push_back(nEntry);
+            throw;
+        }
+        pos = FreeSlot(nTag);
+        if (vSlots[pos].nEntry == SLOT_DELETED)
+            nDeleted--;
+        vSlots[pos].nTag = nTag;
+        vSlots[pos].nEntry = nEntry;
+        nUsed++;
+        return std::make_pair(iterator(this, pos), true);
+    }
+
+    mapped_type& operator[](const key_type& k)
+    {
+        return insert(value_type(k, mapped_type())).first->second;
+    }
+
+    //! Erase an element. Other iterators remain valid, so erase(it++) works.
+    void erase(iterator it)
+    {
+        Slot& slot = vSlots[it.pos];
+        Entry(slot.nEntry)->~value_type();
+        vFree.push_back(slot.nEntry);
+        slot.nEntry = SLOT_DELETED;
+        nUsed--;
+        nDeleted++;
+    }
+
+    //! Remove all elements and release all memory
+    void clear()
+    {
+        for (size_t pos = Next(0); pos < vSlots.size(); pos = Next(pos + 1))
+            Entry(vSlots[pos].nEntry)->~value_type();
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+        std::vector<Slot>().swap(vSlots);
+        std::vector<value_type*>().swap(vChunks);
+        std::vector<uint32_t>().swap(vFree);
+        nUsed = 0;
+        nDeleted = 0;
+        nEntries = 0;
+    }
+
+    //! Heap memory used by the table and the arena, excluding memory owned by the elements
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::DynamicUsage(vSlots) + memusage::DynamicUsage(vChunks) + memusage::DynamicUsage(vFree) +
+               vChunks.size() * memusage::MallocUsage(sizeof(value_type) * CHUNK_SIZE);
+    }
+};
+
+#endif // BITCOIN_FLATMAP_H
@@ -31,8 +31,20 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    //! Number of key and value bytes queued
+    size_t nSize;
 
 public:
+    CLevelDBBatch() : nSize(0) {}
+
+    size_t SizeEstimate() const { return nSize; }
+
+    void Clear()
+    {
+        batch.Clear();
+        nSize = 0;
+    }
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -47,6 +59,7 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        nSize += slKey.size() + slValue.size();
     }
 
     template <typename K>
@@ -58,6 +71,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        nSize += slKey.size();
     }
 };
 
@@ -164,7 +178,7 @@ public:
     }
 
     // not exactly clean encapsulation, but it's easiest for now
-    leveldb::Iterator* NewIterator()
+    leveldb::Iterator* NewIterator() const
     {
         return pdb->NewIterator(iteroptions);
     }
@@ -7,6 +7,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockfile.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -20,11 +21,13 @@
 #include "util.h"
 #include "utilmoneystr.h"
 
+#include <algorithm>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -52,7 +55,10 @@ bool fReindex = false;
 bool fTxIndex = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
+bool fHavePruned = false;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
 
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying and mining) */
@@ -142,6 +148,22 @@ namespace {
     /** Number of blocks in flight with validated headers. */
     int nQueuedValidatedHeaders = 0;
 
+    /**
+     * Blocks that were stored while a predecessor was still missing, kept in memory so that ConnectTip
+     * doesn't read them back from disk. Keyed by height so the ones needed last are dropped first.
+     * Protected by cs_main.
+     */
+    struct PendingBlock {
+        boost::shared_ptr<CBlock> pblock;
+        unsigned int nSize;  //! Serialized size.
+        int64_t nTime;  //! When it was queued, in microseconds.
+    };
+    map<pair<int, CBlockIndex*>, PendingBlock> mapPendingBlocks;
+    size_t nPendingBlocksSize = 0;
+
+    /** Moving average of the size of requested blocks as they arrive, in bytes. Protected by cs_main. */
+    int64_t nAverageBlockSize = 0;
+
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
@@ -150,6 +172,15 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /** Set when a block or undo file grew, so that the next flush checks whether to prune. */
+    bool fCheckForPruning = false;
+
+    /** Recently read block files, kept mapped. Fewer on 32-bit systems, where address space is scarce. */
+    CBlockFileCache blockfilecache(sizeof(void*) == 4 ? 2 : 8);
+
+    /** Storage of all entries of mapBlockIndex. */
+    CBlockIndexArena blockindexarena;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -258,6 +289,15 @@ struct CNodeState {
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
+    //! How many blocks may be in flight from this peer, sized to its download rate and ping time.
+    int nBlocksInTransitLimit;
+    //! Decaying totals of requested block bytes received from this peer and of the time spent receiving them (in microseconds).
+    int64_t nDownloadBytes;
+    int64_t nDownloadTime;
+    //! Number of requested blocks the totals above are based on.
+    int nDownloadSamples;
+    //! When the last requested block from this peer arrived (in microseconds), or 0.
+    int64_t nLastBlockReceived;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
 
@@ -271,6 +311,11 @@ struct CNodeState {
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
+        nBlocksInTransitLimit = DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+        nDownloadBytes = 0;
+        nDownloadTime = 0;
+        nDownloadSamples = 0;
+        nLastBlockReceived = 0;
         fPreferredDownload = false;
     }
 };
@@ -280,6 +325,7 @@ map<NodeId, CNodeState> mapNodeState;
 
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
+    AssertLockHeld(cs_main);
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
     if (it == mapNodeState.end())
         return NULL;
@@ -294,6 +340,7 @@ int GetHeight()
 
 void UpdatePreferredDownload(CNode* node, CNodeState* state)
 {
+    AssertLockHeld(cs_main);
     nPreferredDownload -= state->fPreferredDownload;
 
     // Whether this node should be marked as a preferred download node.
@@ -356,6 +403,67 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex *pindex
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+/** Download rate of requested blocks from a peer in bytes per second, or 0 if it isn't measured yet. */
+int64_t GetBlockDownloadRate(const CNodeState *state) {
+    if (state->nDownloadSamples < MIN_BLOCK_DOWNLOAD_SAMPLES || state->nDownloadTime == 0)
+        return 0;
+    return state->nDownloadBytes * 1000000 / state->nDownloadTime;
+}
+
+// Requires cs_main.
+/** Account for a block that arrived from a peer we requested it from, before it is marked as received. */
+void UpdateBlockDownloadRate(NodeId nodeid, const uint256& hash, unsigned int nSize) {
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid)
+        return;
+    CNodeState *state = State(nodeid);
+    int64_t nNow = GetTimeMicros();
+    // With several blocks requested at once, the peer only starts sending this one after the previous one, so
+    // only the time since then is spent on it. A peer that was idle also spends a round trip on it.
+    int64_t nStart = std::max(itInFlight->second.second->nTime, state->nLastBlockReceived);
+    state->nLastBlockReceived = nNow;
+    state->nDownloadBytes = state->nDownloadBytes - state->nDownloadBytes / 8 + nSize;
+    state->nDownloadTime = state->nDownloadTime - state->nDownloadTime / 8 + std::max<int64_t>(nNow - nStart, 1);
+    state->nDownloadSamples++;
+    if (nAverageBlockSize == 0)
+        nAverageBlockSize = nSize;
+    else
+        nAverageBlockSize += ((int64_t)nSize - nAverageBlockSize) / 16;
+}
+
+// Requires cs_main.
+/** Number of blocks to keep requested from a peer: enough to cover its round trip time and
+ *  BLOCK_DOWNLOAD_QUEUE_TIME more seconds at the rate it delivered blocks so far. */
+int GetBlocksInTransitLimit(const CNodeState *state, int64_t nPingUsecTime) {
+    int64_t nRate = GetBlockDownloadRate(state);
+    if (nRate == 0 || nAverageBlockSize == 0)
+        return DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nBytes = nRate * (nPingUsecTime + 1000000 * BLOCK_DOWNLOAD_QUEUE_TIME) / 1000000;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER, 1 + nBytes / nAverageBlockSize));
+}
+
+// Requires cs_main.
+/** Whether a block in flight from another peer is overdue for that peer's download rate, and nodeid
+ *  is fast enough that asking it instead is worthwhile. */
+bool IsBlockLagging(const uint256& hash, NodeId nodeid) {
+    const pair<NodeId, list<QueuedBlock>::iterator>& inflight = mapBlocksInFlight[hash];
+    int64_t nRate = GetBlockDownloadRate(State(nodeid));
+    CNodeState *stateFrom = State(inflight.first);
+    int64_t nRateFrom = GetBlockDownloadRate(stateFrom);
+    // Only peers that proved to be much faster take over blocks, so they don't bounce between peers.
+    if (nRate == 0 || (nRateFrom != 0 && nRate < 2 * nRateFrom))
+        return false;
+    // The blocks requested before it from the same peer arrive first.
+    int64_t nExpected = 0;
+    if (nRateFrom != 0) {
+        int nQueuedBefore = 0;
+        for (list<QueuedBlock>::iterator it = stateFrom->vBlocksInFlight.begin(); it != inflight.second; it++)
+            nQueuedBefore++;
+        nExpected = 2 * (nQueuedBefore + 1) * nAverageBlockSize * 1000000 / nRateFrom;
+    }
+    return inflight.second->nTime < GetTimeMicros() - std::max<int64_t>(nExpected, 1000000 * BLOCK_STALLING_TIMEOUT);
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -409,7 +517,8 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
+ *  at most count entries. The first block in flight, which holds back the download window, is added
+ *  too if it lags behind at a slower peer. */
 void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
     if (count == 0)
         return;
@@ -486,6 +595,15 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                if (waitingfor != nodeid && IsBlockLagging(pindex->GetBlockHash(), nodeid)) {
+                    LogPrint("net", "Block %s (%d) lags at peer=%d, re-requesting from peer=%d\n",
+                        pindex->GetBlockHash().ToString(), pindex->nHeight, waitingfor, nodeid);
+                    waitingfor = nodeid;
+                    vBlocks.push_back(pindex);
+                    if (vBlocks.size() == count) {
+                        return;
+                    }
+                }
             }
         }
     }
@@ -505,6 +623,8 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInTransitLimit = state->nBlocksInTransitLimit;
+    stats.nBlockDownloadRate = GetBlockDownloadRate(state);
     return true;
 }
 
@@ -931,8 +1051,18 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    std::list<CTransaction> removed;
+    pool.TrimToSize(limit, removed);
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee)
+                        bool* pfMissingInputs, bool fRejectInsaneFee, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1042,6 +1172,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                       hash.ToString(), nFees, txMinFee),
                              REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+        // A full pool only takes transactions paying more than what it evicted
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1097,8 +1232,29 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
+        // Calculate in-mempool ancestors, up to the chain limits. This and
+        // adding the transaction happen under one lock, so that the pool
+        // can't change in between.
+        LOCK(pool.cs);
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+            return state.DoS(0, error("AcceptToMemoryPool : %s : %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // Trim the pool, and only report the transaction as accepted if it survived
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1150,6 +1306,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
+            // The block may have been pruned
+            if (pindexSlow && !(pindexSlow->nStatus & BLOCK_HAVE_DATA))
+                pindexSlow = NULL;
         }
     }
 
@@ -1204,14 +1363,14 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
+    CRawBlock raw;
+    if (!blockfilecache.ReadRawBlock(pos, raw))
+        return error("ReadBlockFromDisk : ReadRawBlock failed");
 
     // Read block
     try {
-        filein >> block;
+        CDataStream ssBlock(raw.begin(), raw.end(), SER_DISK, CLIENT_VERSION);
+        ssBlock >> block;
     }
     catch (std::exception &e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -1233,6 +1392,21 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CRawBlock& raw, const CDiskBlockPos& pos, const uint256& hash)
+{
+    if (!blockfilecache.ReadRawBlock(pos, raw))
+        return error("ReadRawBlockFromDisk : ReadRawBlock failed");
+    // The header is enough to tell whether this is the right block
+    if (raw.size() < 80 || Hash(raw.begin(), raw.begin() + 80) != hash)
+        return error("ReadRawBlockFromDisk : block header doesn't match index");
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CRawBlock& raw, const CBlockIndex* pindex)
+{
+    return ReadRawBlockFromDisk(raw, pindex->GetBlockPos(), pindex->GetBlockHash());
+}
+
 CAmount GetBlockValue(int nHeight, const CAmount& nFees)
 {
     CAmount nMinSubsidy = 1 * COIN;
@@ -1348,12 +1522,12 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1623,6 +1797,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    // Don't keep a mapping that extends beyond the truncated file
+    if (fFinalize)
+        blockfilecache.Forget(nLastBlockFile);
+
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -1642,13 +1820,14 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -1673,6 +1852,27 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return true;
     }
 
+    // Load the coins spent by this block into the cache with one batch request,
+    // which the database serves with several threads, rather than stalling on
+    // every uncached input in the loop below.
+    int64_t nTimePrefetchStart = GetTimeMicros();
+    std::vector<uint256> vBlockTxid;
+    vBlockTxid.reserve(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vBlockTxid.push_back(tx.GetHash());
+    std::sort(vBlockTxid.begin(), vBlockTxid.end());
+    std::vector<uint256> vPrevTxid;
+    for (unsigned int i = 1; i < block.vtx.size(); i++) {
+        BOOST_FOREACH(const CTxIn& txin, block.vtx[i].vin) {
+            // Outputs created in this block can not be in the database
+            if (!std::binary_search(vBlockTxid.begin(), vBlockTxid.end(), txin.prevout.hash))
+                vPrevTxid.push_back(txin.prevout.hash);
+        }
+    }
+    size_t nPrefetched = view.Prefetch(vPrevTxid);
+    int64_t nTimePrefetchEnd = GetTimeMicros(); nTimePrefetch += nTimePrefetchEnd - nTimePrefetchStart;
+    LogPrint("bench", "      - Prefetch %u txins (%u uncached txs): %.2fms [%.2fs]\n", (unsigned int)vPrevTxid.size(), (unsigned int)nPrefetched, 0.001 * (nTimePrefetchEnd - nTimePrefetchStart), nTimePrefetch * 0.000001);
+
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
@@ -1752,7 +1952,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            // Only cache results of block templates; entries hit while really
+            // connecting a block are removed from the signature cache.
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fJustCheck, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -1824,23 +2026,148 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 }
 
 enum FlushStateMode {
+    FLUSH_STATE_NONE,
     FLUSH_STATE_IF_NEEDED,
     FLUSH_STATE_PERIODIC,
     FLUSH_STATE_ALWAYS
 };
 
+uint64_t CalculateCurrentUsage()
+{
+    LOCK(cs_LastBlockFile);
+
+    uint64_t nUsage = 0;
+    BOOST_FOREACH(const CBlockFileInfo &file, vinfoBlockFile) {
+        nUsage += file.nSize + file.nUndoSize;
+    }
+    return nUsage;
+}
+
+void PruneOneBlockFile(int nFile)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (!(pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO)) || pindex->nFile != nFile)
+            continue;
+        pindex->nStatus &= ~(BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO);
+        pindex->nFile = 0;
+        pindex->nDataPos = 0;
+        pindex->nUndoPos = 0;
+        setDirtyBlockIndex.insert(pindex);
+
+        // The block has to be downloaded again before its chain can be
+        // considered, at which point it re-enters mapBlocksUnlinked or
+        // setBlockIndexCandidates.
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first++;
+            if (itUnlinked->second == pindex)
+                mapBlocksUnlinked.erase(itUnlinked);
+        }
+    }
+
+    vinfoBlockFile[nFile].SetNull();
+    setDirtyFileInfo.insert(nFile);
+}
+
+void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        blockfilecache.Forget(*it);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+/**
+ * Select the oldest block files to delete so that block and undo files
+ * use less than nPruneTarget. Files holding blocks within
+ * MIN_BLOCKS_TO_KEEP of the tip, and the file being written to, are kept.
+ * The selected files are pruned in the block index, but not yet deleted.
+ */
+void static FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+    if ((unsigned int)chainActive.Height() <= MIN_BLOCKS_TO_KEEP)
+        return;
+
+    unsigned int nLastBlockWeCanPrune = chainActive.Height() - MIN_BLOCKS_TO_KEEP;
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    // Leave room for the pre-allocation of the files being written to
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    // During initial download, prune a bit more at once rather than a file per flush
+    if (IsInitialBlockDownload())
+        nBuffer += nPruneTarget / 10;
+    std::set<int> setSelected;
+    nCurrentUsage = SelectFilesToPrune(vinfoBlockFile, nLastBlockFile, nLastBlockWeCanPrune, nCurrentUsage, nBuffer, nPruneTarget, setSelected);
+    BOOST_FOREACH(int nFile, setSelected)
+        PruneOneBlockFile(nFile);
+    setFilesToPrune.insert(setSelected.begin(), setSelected.end());
+
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+           nPruneTarget/1024/1024, nCurrentUsage/1024/1024,
+           ((int64_t)nPruneTarget - (int64_t)nCurrentUsage)/1024/1024,
+           nLastBlockWeCanPrune, setSelected.size());
+}
+
+uint64_t SelectFilesToPrune(const std::vector<CBlockFileInfo>& vinfo, int nLastBlockFile, unsigned int nLastBlockWeCanPrune,
+                            uint64_t nUsage, uint64_t nBuffer, uint64_t nTarget, std::set<int>& setFilesToPrune)
+{
+    for (int nFile = 0; nFile < nLastBlockFile && nFile < (int)vinfo.size(); nFile++) {
+        if (nUsage + nBuffer < nTarget)
+            break;
+        if (vinfo[nFile].nSize == 0)
+            continue;
+        // Keep the reorganization window
+        if (vinfo[nFile].nHeightLast > nLastBlockWeCanPrune)
+            continue;
+
+        setFilesToPrune.insert(nFile);
+        nUsage -= std::min(nUsage, (uint64_t)vinfo[nFile].nSize + vinfo[nFile].nUndoSize);
+    }
+    return nUsage;
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed if either they're too large, forceWrite is set, or
  * fast is not set and it's been a while since the last write.
+ * The size of the coins cache is measured in bytes of memory actually in use.
+ * In -prune mode, block files selected for pruning are deleted once the
+ * block index and the chainstate no longer refer to them.
  */
 bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
-    LOCK(cs_main);
+    LOCK2(cs_main, cs_LastBlockFile);
     static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
     try {
-    if ((mode == FLUSH_STATE_ALWAYS) ||
-        ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
-        (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
+    if (fPruneMode && fCheckForPruning && !fReindex) {
+        FindFilesToPrune(setFilesToPrune);
+        fCheckForPruning = false;
+        if (!setFilesToPrune.empty()) {
+            fFlushForPrune = true;
+            if (!fHavePruned) {
+                pblocktree->WriteFlag("prunedblockfiles", true);
+                fHavePruned = true;
+            }
+        }
+    }
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // The cache is close to the limit, and we are between blocks: write it now, rather than in the middle of connecting one.
+    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
+    // The cache is over the limit, we have to write now.
+    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    // It's been a while since we wrote the chainstate.
+    bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000;
+    if (mode == FLUSH_STATE_ALWAYS || fCacheLarge || fCacheCritical || fPeriodicWrite || fFlushForPrune) {
+        LogPrint("bench", "    - Flush chainstate: %u txs, %.1fMiB in use, limit %.1fMiB\n", pcoinsTip->GetCacheSize(), cacheSize * (1.0 / 1048576), nCoinCacheUsage * (1.0 / 1048576));
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -1872,6 +2199,9 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // Finally flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return state.Abort("Failed to write to coin database");
+        // Nothing refers to the pruned files anymore.
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
         // Update best block in wallet (so we can detect restored wallets).
         if (mode != FLUSH_STATE_IF_NEEDED) {
             g_signals.SetBestChain(chainActive.GetLocator());
@@ -1889,6 +2219,12 @@ void FlushStateToDisk() {
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush() {
+    CValidationState state;
+    fCheckForPruning = true;
+    FlushStateToDisk(state, FLUSH_STATE_NONE);
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew) {
     chainActive.SetTip(pindexNew);
@@ -1897,10 +2233,10 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-      Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+      Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / 1048576), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -1950,13 +2286,20 @@ bool static DisconnectTip(CValidationState &state) {
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true))
             mempool.remove(tx, removed, true);
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
     }
+    // Pool transactions spending them became their descendants again
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    // Trim only once all of them are back, so that none is evicted before its descendants return
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
@@ -1969,6 +2312,34 @@ bool static DisconnectTip(CValidationState &state) {
     return true;
 }
 
+// Requires cs_main.
+/** Keep a block that cannot be connected yet in memory, within -maxblockqueue. */
+static void QueuePendingBlock(CBlockIndex *pindex, const CBlock& block) {
+    pair<int, CBlockIndex*> key = make_pair(pindex->nHeight, pindex);
+    if (mapPendingBlocks.count(key))
+        return;
+    PendingBlock& entry = mapPendingBlocks[key];
+    entry.pblock.reset(new CBlock(block));
+    entry.nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    entry.nTime = GetTimeMicros();
+    nPendingBlocksSize += entry.nSize;
+    size_t nMaxSize = std::max((int64_t)0, GetArg("-maxblockqueue", DEFAULT_MAX_BLOCK_QUEUE)) * 1000000;
+    while (nPendingBlocksSize > nMaxSize) {
+        map<pair<int, CBlockIndex*>, PendingBlock>::iterator it = --mapPendingBlocks.end();
+        nPendingBlocksSize -= it->second.nSize;
+        mapPendingBlocks.erase(it);
+    }
+}
+
+// Requires cs_main.
+/** Forget the pending blocks the active chain has reached. */
+static void PrunePendingBlocks() {
+    while (!mapPendingBlocks.empty() && mapPendingBlocks.begin()->first.first <= chainActive.Height()) {
+        nPendingBlocksSize -= mapPendingBlocks.begin()->second.nSize;
+        mapPendingBlocks.erase(mapPendingBlocks.begin());
+    }
+}
+
 static int64_t nTimeReadFromDisk = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
@@ -1982,18 +2353,28 @@ static int64_t nTimePostConnect = 0;
 bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *pblock) {
     assert(pindexNew->pprev == chainActive.Tip());
     mempool.check(pcoinsTip);
-    // Read block from disk.
+    // Read block from disk, unless it is still pending in memory.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
+    boost::shared_ptr<CBlock> pblockPending;
+    const char* strSource = "memory";
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
-            return state.Abort("Failed to read block");
-        pblock = &block;
+        map<pair<int, CBlockIndex*>, PendingBlock>::iterator it = mapPendingBlocks.find(make_pair(pindexNew->nHeight, pindexNew));
+        if (it != mapPendingBlocks.end()) {
+            pblockPending = it->second.pblock;
+            pblock = pblockPending.get();
+            LogPrint("bench", "  - Pending for: %.2fms\n", (nTime1 - it->second.nTime) * 0.001);
+        } else {
+            if (!ReadBlockFromDisk(block, pindexNew))
+                return state.Abort("Failed to read block");
+            pblock = &block;
+            strSource = "disk";
+        }
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
-    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    LogPrint("bench", "  - Load block from %s: %.2fms [%.2fs]\n", strSource, (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
         CCoinsViewCache view(pcoinsTip);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
@@ -2022,6 +2403,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    PrunePendingBlocks();
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH(const CTransaction &tx, txConflicted) {
@@ -2059,15 +2441,23 @@ static CBlockIndex* FindMostWorkChain() {
         CBlockIndex *pindexTest = pindexNew;
         bool fInvalidAncestor = false;
         while (pindexTest && !chainActive.Contains(pindexTest)) {
-            assert(pindexTest->nStatus & BLOCK_HAVE_DATA);
             assert(pindexTest->nChainTx || pindexTest->nHeight == 0);
-            if (pindexTest->nStatus & BLOCK_FAILED_MASK) {
-                // Candidate has an invalid ancestor, remove entire chain from the set.
-                if (pindexBestInvalid == NULL || pindexNew->nChainWork > pindexBestInvalid->nChainWork)
+            // A pruned node may have deleted the data of blocks off the active
+            // chain; it can only switch to a chain it has all blocks of.
+            bool fFailedChain = pindexTest->nStatus & BLOCK_FAILED_MASK;
+            bool fMissingData = !(pindexTest->nStatus & BLOCK_HAVE_DATA);
+            if (fFailedChain || fMissingData) {
+                // Candidate has an invalid or pruned ancestor, remove entire chain from the set.
+                if (fFailedChain && (pindexBestInvalid == NULL || pindexNew->nChainWork > pindexBestInvalid->nChainWork))
                     pindexBestInvalid = pindexNew;
                 CBlockIndex *pindexFailed = pindexNew;
                 while (pindexTest != pindexFailed) {
-                    pindexFailed->nStatus |= BLOCK_FAILED_CHILD;
+                    if (fFailedChain) {
+                        pindexFailed->nStatus |= BLOCK_FAILED_CHILD;
+                    } else {
+                        // Reconsider it when the missing block arrives again
+                        mapBlocksUnlinked.insert(std::make_pair(pindexFailed->pprev, pindexFailed));
+                    }
                     setBlockIndexCandidates.erase(pindexFailed);
                     pindexFailed = pindexFailed->pprev;
                 }
@@ -2291,8 +2681,8 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = NewBlockIndex();
+    *pindexNew = CBlockIndex(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -2395,6 +2785,8 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
+            if (fPruneMode)
+                fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE *file = OpenBlockFile(pos);
                 if (file) {
@@ -2426,6 +2818,8 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
+        if (fPruneMode)
+            fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE *file = OpenUndoFile(pos);
             if (file) {
@@ -2460,6 +2854,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
 {
     // These are checks that are independent of context.
 
+    // A block is checked outside cs_main when it arrives, and again by
+    // AcceptBlock and ConnectBlock
+    if (block.fChecked)
+        return true;
+
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
     if (!CheckBlockHeader(block, state, fCheckPOW))
@@ -2513,6 +2912,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
                          REJECT_INVALID, "bad-blk-sigops", true);
 
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
+
     return true;
 }
 
@@ -2740,11 +3142,20 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
+static int64_t nTimeCheckBlock = 0;
+static int64_t nTimeAcceptBlock = 0;
+static int64_t nTimeActivate = 0;
+
 bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
 {
-    // Preliminary checks
+    // Preliminary checks. They don't depend on the chain, so blocks arriving from different
+    // peers are checked concurrently by the message handler threads.
+    int64_t nTime1 = GetTimeMicros();
     bool checked = CheckBlock(*pblock, state);
+    int64_t nTime2 = GetTimeMicros(); nTimeCheckBlock += nTime2 - nTime1;
+    LogPrint("bench", "- Check block: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeCheckBlock * 0.000001);
 
+    CBlockIndex *pindex = NULL;
     {
         LOCK(cs_main);
         MarkBlockAsReceived(pblock->GetHash());
@@ -2753,7 +3164,6 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDis
         }
 
         // Store to disk
-        CBlockIndex *pindex = NULL;
         bool ret = AcceptBlock(*pblock, state, &pindex, dbp);
         if (pindex && pfrom) {
             mapBlockSource[pindex->GetBlockHash()] = pfrom->GetId();
@@ -2762,9 +3172,21 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDis
         if (!ret)
             return error("%s : AcceptBlock FAILED", __func__);
     }
+    int64_t nTime3 = GetTimeMicros(); nTimeAcceptBlock += nTime3 - nTime2;
+    LogPrint("bench", "- Accept block: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeAcceptBlock * 0.000001);
 
     if (!ActivateBestChain(state, pblock))
         return error("%s : ActivateBestChain failed", __func__);
+    int64_t nTime4 = GetTimeMicros(); nTimeActivate += nTime4 - nTime3;
+    LogPrint("bench", "- Activate best chain: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeActivate * 0.000001);
+
+    // Blocks arrive out of order during initial block download. One that is still waiting for its
+    // predecessors is connected in order later, from memory.
+    if (pindex) {
+        LOCK(cs_main);
+        if (pindex->nHeight > chainActive.Height() && (pindex->nStatus & BLOCK_HAVE_DATA) && !(pindex->nStatus & BLOCK_FAILED_MASK))
+            QueuePendingBlock(pindex, *pblock);
+    }
 
     return true;
 }
@@ -2857,6 +3279,11 @@ boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char
     return GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
 }
 
+CBlockIndex * NewBlockIndex()
+{
+    return blockindexarena.New();
+}
+
 CBlockIndex * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -2868,23 +3295,84 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = NewBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+namespace {
+
+/** Computes the proof of work of a range of block index entries, leaving it in nChainWork. */
+class CBlockProofJob
+{
+private:
+    const pair<int, CBlockIndex*>* pbegin;
+    const pair<int, CBlockIndex*>* pend;
+
+public:
+    CBlockProofJob() : pbegin(NULL), pend(NULL) {}
+    CBlockProofJob(const pair<int, CBlockIndex*>* pbeginIn, const pair<int, CBlockIndex*>* pendIn) : pbegin(pbeginIn), pend(pendIn) {}
+
+    bool operator()() {
+        for (const pair<int, CBlockIndex*>* p = pbegin; p != pend; p++)
+            p->second->nChainWork = GetBlockProof(*p->second);
+        return true;
+    }
+
+    void swap(CBlockProofJob& job) {
+        std::swap(pbegin, job.pbegin);
+        std::swap(pend, job.pend);
+    }
+};
+
+/**
+ * Sets the skip pointers of a range of block index entries on a given chain,
+ * which doesn't require the skip pointers of their ancestors to be set first.
+ */
+class CBlockSkipJob
+{
+private:
+    const CChain* pchain;
+    const pair<int, CBlockIndex*>* pbegin;
+    const pair<int, CBlockIndex*>* pend;
+
+public:
+    CBlockSkipJob() : pchain(NULL), pbegin(NULL), pend(NULL) {}
+    CBlockSkipJob(const CChain* pchainIn, const pair<int, CBlockIndex*>* pbeginIn, const pair<int, CBlockIndex*>* pendIn) :
+        pchain(pchainIn), pbegin(pbeginIn), pend(pendIn) {}
+
+    bool operator()() {
+        for (const pair<int, CBlockIndex*>* p = pbegin; p != pend; p++) {
+            CBlockIndex* pindex = p->second;
+            if (pindex->pprev && pchain->Contains(pindex))
+                pindex->pskip = (*pchain)[GetSkipHeight(pindex->nHeight)];
+        }
+        return true;
+    }
+
+    void swap(CBlockSkipJob& job) {
+        std::swap(pchain, job.pchain);
+        std::swap(pbegin, job.pbegin);
+        std::swap(pend, job.pend);
+    }
+};
+
+/** Number of block index entries, of consecutive heights, processed per job while loading. */
+const size_t LOAD_BATCH_SIZE = 1024;
+
+} // anon namespace
+
 bool static LoadBlockIndexDB()
 {
-    if (!pblocktree->LoadBlockIndexGuts())
+    int64_t nTimeStart = GetTimeMicros();
+    if (!pblocktree->LoadBlockIndexGuts(nScriptCheckThreads))
         return false;
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
+    int64_t nTimeGuts = GetTimeMicros();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -2893,10 +3381,20 @@ bool static LoadBlockIndexDB()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    int64_t nTimeSort = GetTimeMicros();
+
+    // Calculate nChainWork: the work of each block is computed in parallel,
+    // and only summing it along the chain is serial
+    const pair<int, CBlockIndex*>* pSorted = vSortedByHeight.empty() ? NULL : &vSortedByHeight[0];
+    vector<CBlockProofJob> vProofJobs;
+    for (size_t i = 0; i < vSortedByHeight.size(); i += LOAD_BATCH_SIZE)
+        vProofJobs.push_back(CBlockProofJob(pSorted + i, pSorted + std::min(vSortedByHeight.size(), i + LOAD_BATCH_SIZE)));
+    RunParallel(vProofJobs, nScriptCheckThreads);
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        if (pindex->pprev)
+            pindex->nChainWork += pindex->pprev->nChainWork;
         if (pindex->nStatus & BLOCK_HAVE_DATA) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
@@ -2913,11 +3411,27 @@ bool static LoadBlockIndexDB()
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
-        if (pindex->pprev)
-            pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
+    int64_t nTimeWork = GetTimeMicros();
+
+    // Build the skip lists. Entries on the best header chain can look their
+    // skip target up by height, in parallel; the rest (forks) are done in
+    // height order afterwards.
+    CChain chainHeaders;
+    chainHeaders.SetTip(pindexBestHeader);
+    vector<CBlockSkipJob> vSkipJobs;
+    for (size_t i = 0; i < vSortedByHeight.size(); i += LOAD_BATCH_SIZE)
+        vSkipJobs.push_back(CBlockSkipJob(&chainHeaders, pSorted + i, pSorted + std::min(vSortedByHeight.size(), i + LOAD_BATCH_SIZE)));
+    RunParallel(vSkipJobs, nScriptCheckThreads);
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        CBlockIndex* pindex = item.second;
+        if (pindex->pprev && !chainHeaders.Contains(pindex))
+            pindex->BuildSkip();
+    }
+    int64_t nTimeSkip = GetTimeMicros();
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -2953,6 +3467,15 @@ bool static LoadBlockIndexDB()
             return false;
         }
     }
+    int64_t nTimeFiles = GetTimeMicros();
+    LogPrintf("LoadBlockIndexDB(): loaded %u entries in %.2fms (%.2fms entries, %.2fms sort, %.2fms chain work, %.2fms skip lists, %.2fms block files)\n",
+        (unsigned int)vSortedByHeight.size(), 0.001 * (nTimeFiles - nTimeStart), 0.001 * (nTimeGuts - nTimeStart), 0.001 * (nTimeSort - nTimeGuts),
+        0.001 * (nTimeWork - nTimeSort), 0.001 * (nTimeSkip - nTimeWork), 0.001 * (nTimeFiles - nTimeSkip));
+
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
 
     // Check whether we need to continue reindexing
     bool fReindexing = false;
@@ -3013,6 +3536,11 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // Only go back as far as the blocks that have not been pruned
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruned)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3030,7 +3558,7 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3262,6 +3790,7 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL; // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL; // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL; // Oldest ancestor of pindex for which nTx == 0 (its data was never received, as opposed to pruned).
     CBlockIndex* pindexFirstNotTreeValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
@@ -3269,6 +3798,7 @@ void static CheckBlockIndex()
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -3279,12 +3809,19 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis()); // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+        if (!fHavePruned) {
+            // HAVE_DATA is equivalent to nTx > 0 (we stored the number of transactions in the block)
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            // Pruning clears HAVE_DATA but keeps nTx
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
+        // VALID_TRANSACTIONS is equivalent to nTx > 0
         assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0);  // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0)); // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having been processed is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0));
         assert(pindex->nHeight == nHeight); // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork); // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight))); // The pskip pointer must point back for all but the first 2 blocks.
@@ -3296,8 +3833,10 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            // If this block sorts at least as good as the current tip, is valid and we have the data of all its parents,
+            // it must be in setBlockIndexCandidates. The tip must be there even if some of its parents were pruned.
+            if (pindexFirstInvalid == NULL && (pindexFirstMissing == NULL || pindex == chainActive.Tip())) {
                  assert(setBlockIndexCandidates.count(pindex));
             }
         } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
@@ -3314,13 +3853,22 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
-            }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindexFirstMissing == NULL) {
+            // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
             assert(!foundInUnlinked);
         }
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // All parents were received at some point, but some were pruned since.
+            assert(fHavePruned);
+            // FindMostWorkChain moves such a block to mapBlocksUnlinked when it tries to switch to it, so if it
+            // sorts better than the tip and is not a candidate, it must be there.
+            if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && setBlockIndexCandidates.count(pindex) == 0 && pindexFirstInvalid == NULL)
+                assert(foundInUnlinked);
+        }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
 
@@ -3339,6 +3887,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -3464,8 +4013,8 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
+    // cs_main is only held to look requests up; blocks are read from disk
+    // without it, so serving them doesn't hold up validation
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3479,32 +4028,56 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CDiskBlockPos pos;
+                uint256 hashTip;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older than the best header
-                        // chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (mi->second->GetBlockTime() > pindexBestHeader->GetBlockTime() - 30 * 24 * 60 * 60);
-                        if (!send) {
-                            LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older than the best header
+                            // chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (mi->second->GetBlockTime() > pindexBestHeader->GetBlockTime() - 30 * 24 * 60 * 60);
+                            if (!send) {
+                                LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                            }
                         }
+                        // Pruned nodes may have deleted the block
+                        if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                            LogPrint("net", "ProcessGetData(): ignoring request from peer=%i for pruned block %s\n", pfrom->GetId(), inv.hash.ToString());
+                            send = false;
+                        }
+                        if (send)
+                            pos = mi->second->GetBlockPos();
                     }
+                    hashTip = chainActive.Tip()->GetBlockHash();
                 }
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        // Send the block as stored, without deserializing it.
+                        // It may have been pruned since it was looked up.
+                        CRawBlock raw;
+                        if (!ReadRawBlockFromDisk(raw, pos, inv.hash)) {
+                            vNotFound.push_back(inv);
+                            continue;
+                        }
+                        pfrom->PushRawMessage("block", raw.begin(), raw.size());
+                        pfrom->nBlockBytesServed += raw.size();
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, pos) || block.GetHash() != inv.hash) {
+                            vNotFound.push_back(inv);
+                            continue;
+                        }
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3532,7 +4105,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3661,7 +4234,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -3847,7 +4423,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        nodestate->nBlocksInFlight < nodestate->nBlocksInTransitLimit) {
                         vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
@@ -3907,6 +4483,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pindex)
             pindex = chainActive.Next(pindex);
         int nLimit = 500;
+        // In -prune mode, only announce blocks we are likely to still have
+        // when they are requested (within the next hour or so)
+        const int nPrunedBlocksLikelyToHave = MIN_BLOCKS_TO_KEEP - 3600 / Params().TargetSpacing();
         LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop==uint256(0) ? "end" : hashStop.ToString(), nLimit, pfrom->id);
         for (; pindex; pindex = chainActive.Next(pindex))
         {
@@ -3915,6 +4494,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            if (fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nHeight <= chainActive.Height() - nPrunedBlocksLikelyToHave))
+            {
+                LogPrint("net", "  getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -3977,14 +4561,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Context-free checks don't need cs_main, so malformed transactions
+        // are turned away without waiting for it
+        CValidationState state;
+        bool fValid = CheckTransaction(tx, state);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
-        CValidationState state;
 
         mapAlreadyAskedFor.erase(inv);
 
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        if (fValid && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
@@ -4055,7 +4643,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
+        } else if (fValid && pfrom->fWhitelisted) {
             // Always relay transactions received from whitelisted peers, even
             // if they are already in the mempool (allowing the node to function
             // as a gateway for nodes hidden behind it).
@@ -4132,12 +4720,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
+        unsigned int nSize = vRecv.size();
         vRecv >> block;
 
         CInv inv(MSG_BLOCK, block.GetHash());
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
         pfrom->AddInventoryKnown(inv);
+        {
+            LOCK(cs_main);
+            UpdateBlockDownloadRate(pfrom->GetId(), inv.hash, nSize);
+        }
 
         CValidationState state;
         ProcessNewBlock(state, pfrom, &block);
@@ -4161,7 +4754,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // getaddr message mitigates the attack.
     else if ((strCommand == "getaddr") && (pfrom->fInbound))
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4284,10 +4880,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             {
                 // Relay
                 pfrom->setKnown.insert(alertHash);
+                // Other message handlers may hold the send lock of a node
+                // and wait for cs_vNodes, so relay without holding it
+                vector<CNode*> vNodesCopy;
                 {
                     LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        alert.RelayTo(pnode);
+                    vNodesCopy = vNodes;
+                    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                        pnode->AddRef();
+                }
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    alert.RelayTo(pnode);
+                {
+                    LOCK(cs_vNodes);
+                    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                        pnode->Release();
                 }
             }
             else {
@@ -4333,10 +4940,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         {
             Misbehaving(pfrom->GetId(), 100);
         } else {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter)
-                pfrom->pfilter->insert(vData);
-            else
+            bool fHaveFilter;
+            {
+                LOCK(pfrom->cs_filter);
+                fHaveFilter = pfrom->pfilter != NULL;
+                if (fHaveFilter)
+                    pfrom->pfilter->insert(vData);
+            }
+            if (!fHaveFilter)
                 Misbehaving(pfrom->GetId(), 100);
         }
     }
@@ -4462,6 +5073,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -4493,6 +5105,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        RecordMessageLatency(strCommand, GetTimeMicros() - nStart);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -4502,7 +5115,7 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+        pfrom->EraseRecvMsgs(it);
 
     return fOk;
 }
@@ -4557,7 +5170,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->ClearAddressKnown();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -4572,24 +5185,20 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_vAddrToSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (size_t nStart = 0; nStart < vAddr.size(); nStart += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + nStart, vAddr.begin() + min(nStart + 1000, vAddr.size())));
         }
 
         CNodeState &state = *State(pto->GetId());
@@ -4706,10 +5315,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        state.nBlocksInTransitLimit = GetBlocksInTransitLimit(&state, pto->nPingUsecTime);
+        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < state.nBlocksInTransitLimit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), state.nBlocksInTransitLimit - state.nBlocksInFlight, vToDownload, staller);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
@@ -4816,10 +5426,7 @@ class CMainCleanup
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
-        // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
+        // block headers (freed along with blockindexarena)
         mapBlockIndex.clear();
 
         // orphan transactions
@@ -42,6 +42,7 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CInv;
+class CRawBlock;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
@@ -64,6 +65,20 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxblockqueue, maximum megabytes of received blocks kept in memory until they can be connected */
+static const unsigned int DEFAULT_MAX_BLOCK_QUEUE = 64;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -78,8 +93,15 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Number of blocks that can be requested at any given time from a peer whose download rate is not known yet. */
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the number of blocks in flight from a single peer, once it is sized to the peer's download rate. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** Blocks a peer must have delivered before its download rate is trusted. */
+static const int MIN_BLOCK_DOWNLOAD_SAMPLES = 4;
+/** Seconds of download, at a peer's measured rate, to keep requested from it on top of its round trip time. */
+static const unsigned int BLOCK_DOWNLOAD_QUEUE_TIME = 2;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -92,6 +114,10 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
+/** Block files containing a block within this many blocks of the tip are never pruned, so reorganizations stay possible. */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
+/** Smallest -prune target: room for MIN_BLOCKS_TO_KEEP full blocks and their undo data, in block files of MAX_BLOCKFILE_SIZE. */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 
@@ -127,7 +153,13 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
+/** True if any block files have ever been pruned. */
+extern bool fHavePruned;
+/** True if we're running in -prune mode. */
+extern bool fPruneMode;
+/** Number of bytes of block and undo files to aim for, in -prune mode. */
+extern uint64_t nPruneTarget;
 extern CFeeRate minRelayTxFee;
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
@@ -199,6 +231,8 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, b
 bool ActivateBestChain(CValidationState &state, CBlock *pblock = NULL);
 CAmount GetBlockValue(int nHeight, const CAmount& nFees);
 
+/** Allocate a block index entry that lives until shutdown, not yet added to mapBlockIndex */
+CBlockIndex * NewBlockIndex();
 /** Create a new block index entry for a given block hash */
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Abort with a message */
@@ -209,11 +243,22 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Prune block files if needed and flush all state to disk. */
+void PruneAndFlush();
+/** Number of bytes used by block and undo files. */
+uint64_t CalculateCurrentUsage();
+/** Mark all blocks of a block file as pruned, and forget the file. */
+void PruneOneBlockFile(int nFile);
+/** Delete the block and undo files of the given numbers from disk. */
+void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune);
 
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee=false);
+                        bool* pfMissingInputs, bool fRejectInsaneFee=false, bool fOverrideMempoolLimit=false);
+
+/** Expire old transactions from the pool, then evict the cheapest ones until it fits in limit bytes */
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age);
 
 
 struct CNodeStateStats {
@@ -221,6 +266,8 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInTransitLimit;
+    int64_t nBlockDownloadRate;
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -365,6 +412,9 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Find the serialized bytes of a block on disk, checking that its header matches pindex */
+bool ReadRawBlockFromDisk(CRawBlock& raw, const CDiskBlockPos& pos, const uint256& hash);
+bool ReadRawBlockFromDisk(CRawBlock& raw, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -449,6 +499,14 @@ public:
      }
 };
 
+/**
+ * Pick the oldest of the files before nLastBlockFile to prune until the
+ * usage of block and undo files plus nBuffer is below nTarget, keeping those
+ * with blocks above nLastBlockWeCanPrune. Returns the usage left.
+ */
+uint64_t SelectFilesToPrune(const std::vector<CBlockFileInfo>& vinfo, int nLastBlockFile, unsigned int nLastBlockWeCanPrune,
+                            uint64_t nUsage, uint64_t nBuffer, uint64_t nTarget, std::set<int>& setFilesToPrune);
+
 /** Capture information about block/transaction validation */
 class CValidationState {
 private:
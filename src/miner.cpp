@@ -6,6 +6,7 @@
 #include "miner.h"
 
 #include "amount.h"
+#include "crypto/sha256.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "hash.h"
@@ -19,6 +20,9 @@
 #include "wallet.h"
 #endif
 
+#include <limits>
+
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -79,6 +83,22 @@ public:
     }
 };
 
+// Largest block you're willing to create
+static unsigned int GetBlockMaxSize()
+{
+    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    return std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+}
+
+// Minimum block size you want to create; block will be filled with free transactions
+// until there are no more or the block reaches this size
+static unsigned int GetBlockMinSize(unsigned int nBlockMaxSize)
+{
+    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    return std::min(nBlockMaxSize, nBlockMinSize);
+}
+
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
@@ -113,20 +133,14 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+    unsigned int nBlockMaxSize = GetBlockMaxSize();
 
     // How much of the block should be dedicated to high-priority transactions,
     // included regardless of the fees they pay
     unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+    unsigned int nBlockMinSize = GetBlockMinSize(nBlockMaxSize);
 
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
@@ -145,10 +159,10 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
+        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
              mi != mempool.mapTx.end(); ++mi)
         {
-            const CTransaction& tx = mi->second.GetTx();
+            const CTransaction& tx = mi->GetTx();
             if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
                 continue;
 
@@ -164,7 +178,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                     // This should never happen; all transactions in the memory
                     // pool should connect to either transactions in the chain
                     // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
+                    CTxMemPool::indexed_transaction_set::iterator miPrev = mempool.mapTx.find(txin.prevout.hash);
+                    if (miPrev == mempool.mapTx.end())
                     {
                         LogPrintf("ERROR: mempool transaction missing input\n");
                         if (fDebug) assert("mempool transaction missing input" == 0);
@@ -183,7 +198,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                     }
                     mapDependers[txin.prevout.hash].push_back(porphan);
                     porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                    nTotalIn += miPrev->GetTx().vout[txin.prevout.n].nValue;
                     continue;
                 }
                 const CCoins* coins = view.AccessCoins(txin.prevout.hash);
@@ -213,7 +228,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 porphan->feeRate = feeRate;
             }
             else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
+                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->GetTx()));
         }
 
         // Collect transactions into block
@@ -340,16 +355,248 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     return pblocktemplate.release();
 }
 
-void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
+namespace {
+// Best packages first: by fee rate including all unconfirmed ancestors
+struct CompareTxIterByAncestorFeeRate
 {
-    // Update nExtraNonce
-    static uint256 hashPrevBlock;
-    if (hashPrevBlock != pblock->hashPrevBlock)
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
-        nExtraNonce = 0;
-        hashPrevBlock = pblock->hashPrevBlock;
+        double f1 = (double)a->GetModFeesWithAncestors() * b->GetSizeWithAncestors();
+        double f2 = (double)b->GetModFeesWithAncestors() * a->GetSizeWithAncestors();
+        if (f1 == f2)
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        return f1 > f2;
     }
-    ++nExtraNonce;
+};
+
+// A transaction has more ancestors than any of its ancestors, so this puts parents first
+struct CompareTxIterByAncestorCount
+{
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return a->GetTx().GetHash() < b->GetTx().GetHash();
+    }
+};
+}
+
+CBlockTemplateCache::CBlockTemplateCache(const CScript& scriptPubKeyIn) :
+    scriptPubKey(scriptPubKeyIn), pblocktemplate(NULL), pindexPrev(NULL), nTransactionsUpdatedLast(0),
+    nBlockSize(0), nBlockSigOps(0), nFees(0), nLastUpdate(0), nLastRebuild(0),
+    nLastUpdateMicros(0), fLastUpdateRebuilt(false), nRebuilds(0), nUpdates(0)
+{
+}
+
+CBlockTemplateCache::~CBlockTemplateCache()
+{
+    delete pblocktemplate;
+}
+
+bool CBlockTemplateCache::Update()
+{
+    LOCK2(cs_main, mempool.cs);
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    int64_t nNow = GetTime();
+    bool fNewTip = !pblocktemplate || pindexTip != pindexPrev;
+    if (!fNewTip && (mempool.GetTransactionsUpdated() == nTransactionsUpdatedLast || nNow - nLastUpdate < UPDATE_INTERVAL))
+        return false;
+
+    int64_t nStart = GetTimeMicros();
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+    nLastUpdate = nNow;
+    // A new tip changes the priority of what waits, and the full rebuild
+    // checks the whole block with TestBlockValidity
+    fLastUpdateRebuilt = fNewTip || nNow - nLastRebuild >= REBUILD_INTERVAL;
+    if (!fLastUpdateRebuilt) {
+        CFeeRate feeRateLowest = RemoveGone();
+        fLastUpdateRebuilt = AddPackages(feeRateLowest);
+    }
+    if (fLastUpdateRebuilt) {
+        Rebuild();
+        nRebuilds++;
+    } else {
+        UpdateHeader();
+        nUpdates++;
+    }
+    nLastBlockTx = pblocktemplate->block.vtx.size() - 1;
+    nLastBlockSize = nBlockSize;
+    nLastUpdateMicros = GetTimeMicros() - nStart;
+    LogPrint("bench", "%s block template: %u txs, %u bytes: %.2fms\n", fLastUpdateRebuilt ? "Rebuilt" : "Updated",
+             nLastBlockTx, nBlockSize, nLastUpdateMicros * 0.001);
+    return true;
+}
+
+void CBlockTemplateCache::Rebuild()
+{
+    delete pblocktemplate;
+    pblocktemplate = NULL;
+    pindexPrev = NULL;
+    CBlockTemplate* pblocktemplateNew = CreateNewBlock(scriptPubKey);
+    if (!pblocktemplateNew)
+        throw std::runtime_error("CBlockTemplateCache::Rebuild() : CreateNewBlock failed");
+    pblocktemplate = pblocktemplateNew;
+    pindexPrev = chainActive.Tip();
+    nLastRebuild = GetTime();
+
+    // The same reserves as CreateNewBlock, for the header and coinbase
+    setInBlock.clear();
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+    nFees = -pblocktemplate->vTxFees[0];
+    for (size_t i = 1; i < pblocktemplate->block.vtx.size(); i++) {
+        const CTransaction& tx = pblocktemplate->block.vtx[i];
+        setInBlock.insert(tx.GetHash());
+        nBlockSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        nBlockSigOps += pblocktemplate->vTxSigOps[i];
+    }
+}
+
+CFeeRate CBlockTemplateCache::RemoveGone()
+{
+    CBlockTemplate& tmpl = *pblocktemplate;
+    CFeeRate feeRateLowest(std::numeric_limits<CAmount>::max());
+    size_t j = 1;
+    for (size_t i = 1; i < tmpl.block.vtx.size(); i++) {
+        const uint256 hash = tmpl.block.vtx[i].GetHash();
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        bool fKeep = it != mempool.mapTx.end();
+        // Its unconfirmed parents have to stay ahead of it
+        if (fKeep) {
+            BOOST_FOREACH(const CTxMemPool::txiter& parent, mempool.GetMemPoolParents(it)) {
+                if (!setInBlock.count(parent->GetTx().GetHash())) {
+                    fKeep = false;
+                    break;
+                }
+            }
+        }
+        if (!fKeep) {
+            setInBlock.erase(hash);
+            nBlockSize -= ::GetSerializeSize(tmpl.block.vtx[i], SER_NETWORK, PROTOCOL_VERSION);
+            nBlockSigOps -= tmpl.vTxSigOps[i];
+            nFees -= tmpl.vTxFees[i];
+            continue;
+        }
+        if (i != j) {
+            tmpl.block.vtx[j] = tmpl.block.vtx[i];
+            tmpl.vTxFees[j] = tmpl.vTxFees[i];
+            tmpl.vTxSigOps[j] = tmpl.vTxSigOps[i];
+        }
+        feeRateLowest = std::min(feeRateLowest, CFeeRate(it->GetModifiedFee(), it->GetTxSize()));
+        j++;
+    }
+    tmpl.block.vtx.resize(j);
+    tmpl.vTxFees.resize(j);
+    tmpl.vTxSigOps.resize(j);
+    return feeRateLowest;
+}
+
+bool CBlockTemplateCache::AddPackages(const CFeeRate& feeRateLowest)
+{
+    const int nHeight = pindexPrev->nHeight + 1;
+    unsigned int nBlockMaxSize = GetBlockMaxSize();
+    unsigned int nBlockMinSize = GetBlockMinSize(nBlockMaxSize);
+
+    // Only mempool lookups so far: coins are only fetched for the
+    // transactions that are considered for inclusion
+    std::vector<CTxMemPool::txiter> vCandidates;
+    for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); it++) {
+        if (!setInBlock.count(it->GetTx().GetHash()))
+            vCandidates.push_back(it);
+    }
+    if (vCandidates.empty())
+        return false;
+    std::sort(vCandidates.begin(), vCandidates.end(), CompareTxIterByAncestorFeeRate());
+
+    CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+    CCoinsViewCache view(&viewMemPool);
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    BOOST_FOREACH(CTxMemPool::txiter it, vCandidates) {
+        if (setInBlock.count(it->GetTx().GetHash()))
+            continue;
+
+        // The package: the transaction and its ancestors not in the block yet
+        CTxMemPool::setEntries setAncestors;
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*it, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        std::vector<CTxMemPool::txiter> vPackage(1, it);
+        BOOST_FOREACH(CTxMemPool::txiter ancestor, setAncestors) {
+            if (!setInBlock.count(ancestor->GetTx().GetHash()))
+                vPackage.push_back(ancestor);
+        }
+
+        uint64_t nPackageSize = 0;
+        int64_t nPackageSigOps = 0;
+        CAmount nPackageFees = 0;
+        bool fValid = true;
+        BOOST_FOREACH(CTxMemPool::txiter pit, vPackage) {
+            const CTransaction& tx = pit->GetTx();
+            if (!IsFinalTx(tx, nHeight) || !view.HaveInputs(tx)) {
+                fValid = false;
+                break;
+            }
+            nPackageSize += pit->GetTxSize();
+            nPackageFees += pit->GetModifiedFee();
+            nPackageSigOps += GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
+        }
+        if (!fValid)
+            continue;
+        if (nBlockSize + nPackageSize >= nBlockMaxSize || nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS) {
+            // Only a rebuild can make room for a package that pays more
+            // than something already in the block
+            if (CFeeRate(nPackageFees, nPackageSize) > feeRateLowest)
+                return true;
+            if (nBlockSize + 1000 >= nBlockMaxSize)
+                break;
+            continue;
+        }
+        // Skip free transactions if we're past the minimum block size
+        if (CFeeRate(nPackageFees, nPackageSize) < ::minRelayTxFee && nBlockSize + nPackageSize >= nBlockMinSize)
+            continue;
+
+        // Scripts were checked against the mandatory flags when the
+        // transactions entered the mempool
+        std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+        BOOST_FOREACH(CTxMemPool::txiter pit, vPackage) {
+            const CTransaction& tx = pit->GetTx();
+            AddToBlock(tx, pit->GetFee(), GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view), pit->GetTxSize());
+        }
+    }
+    return false;
+}
+
+void CBlockTemplateCache::AddToBlock(const CTransaction& tx, CAmount nTxFee, int64_t nTxSigOps, unsigned int nTxSize)
+{
+    pblocktemplate->block.vtx.push_back(tx);
+    pblocktemplate->vTxFees.push_back(nTxFee);
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    setInBlock.insert(tx.GetHash());
+    nBlockSize += nTxSize;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFee;
+}
+
+void CBlockTemplateCache::UpdateHeader()
+{
+    CBlock& block = pblocktemplate->block;
+    const int nHeight = pindexPrev->nHeight + 1;
+
+    CMutableTransaction txCoinbase(block.vtx[0]);
+    txCoinbase.vout[0].nValue = GetBlockValue(nHeight, nFees);
+    txCoinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    block.vtx[0] = txCoinbase;
+    pblocktemplate->vTxFees[0] = -nFees;
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(block.vtx[0]);
+
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    UpdateTime(&block, pindexPrev);
+    block.nBits = GetNextWorkRequired(pindexPrev, &block);
+    block.nNonce = 0;
+}
+
+/** Put nExtraNonce in the coinbase of a block on top of pindexPrev, and update its merkle root */
+void static SetExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int nExtraNonce)
+{
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
     CMutableTransaction txCoinbase(pblock->vtx[0]);
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
@@ -359,6 +606,19 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
+void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
+{
+    // Update nExtraNonce
+    static uint256 hashPrevBlock;
+    if (hashPrevBlock != pblock->hashPrevBlock)
+    {
+        nExtraNonce = 0;
+        hashPrevBlock = pblock->hashPrevBlock;
+    }
+    ++nExtraNonce;
+    SetExtraNonce(pblock, pindexPrev, nExtraNonce);
+}
+
 #ifdef ENABLE_WALLET
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -367,32 +627,43 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 double dHashesPerSec = 0.0;
 int64_t nHPSTimerStart = 0;
 
+namespace {
+//! The last hash rate measured by each miner thread, and when
+CCriticalSection cs_hashmeter;
+std::vector<std::pair<double, int64_t> > vThreadHashRates;
+}
+
 //
 // ScanHash scans nonces looking for a hash with at least some zero bits.
+// The first 64 bytes of the header are hashed once per call, and the nonces
+// a batch at a time, several per SIMD register where the CPU allows.
 // The nonce is usually preserved between calls, but periodically or if the
 // nonce is 0xffff0000 or above, the block is rebuilt and nNonce starts over at
 // zero.
 //
 bool static ScanHash(const CBlockHeader *pblock, uint32_t& nNonce, uint256 *phash)
 {
-    // Write the first 76 bytes of the block header to a double-SHA256 state.
-    CHash256 hasher;
+    static const uint32_t nBatch = 64;
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
     ss << *pblock;
     assert(ss.size() == 80);
-    hasher.Write((unsigned char*)&ss[0], 76);
+    CSHA256D80 hasher((unsigned char*)&ss[0]);
+    unsigned char hashes[32 * nBatch];
 
     while (true) {
-        nNonce++;
-
-        // Write the last 4 bytes of the block header (the nonce) to a copy of
-        // the double-SHA256 state, and compute the result.
-        CHash256(hasher).Write((unsigned char*)&nNonce, 4).Finalize((unsigned char*)phash);
-
-        // Return the nonce if the hash has at least some zero bits,
-        // caller will check if it has enough to reach the target
-        if (((uint16_t*)phash)[15] == 0)
-            return true;
+        // End each batch at a multiple of 0x1000 nonces, for the checks below
+        uint32_t nCount = std::min(nBatch, 0x1000 - (nNonce & 0xfff));
+        hasher.Hash(hashes, nNonce + 1, nCount);
+        for (uint32_t i = 0; i < nCount; i++) {
+            nNonce++;
+
+            // Return the nonce if the hash has at least some zero bits,
+            // caller will check if it has enough to reach the target
+            if (hashes[32 * i + 30] == 0 && hashes[32 * i + 31] == 0) {
+                memcpy(phash, hashes + 32 * i, 32);
+                return true;
+            }
+        }
 
         // If nothing found after trying for a while, return -1
         if ((nNonce & 0xffff) == 0)
@@ -441,15 +712,99 @@ bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static BitcoinMiner(CWallet *pwallet)
+/**
+ * The block template shared by the miner threads. It is rebuilt when the tip
+ * changes, or when the mempool has and it is over a minute old; each thread
+ * that asks for work gets a copy with an extranonce no other thread has, so
+ * the threads search disjoint ranges of headers.
+ */
+class CMinerWork
+{
+private:
+    CCriticalSection cs;
+    CWallet* pwallet;
+    CReserveKey reservekey;
+    auto_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64_t nCreated;
+    unsigned int nExtraNonce;
+
+public:
+    CMinerWork(CWallet* pwalletIn) : pwallet(pwalletIn), reservekey(pwalletIn), pindexPrev(NULL),
+        nTransactionsUpdatedLast(0), nCreated(0), nExtraNonce(0) {}
+
+    /** Copy the template into block, with the next extranonce. Returns false if the keypool ran out. */
+    bool GetWork(CBlock& block, CBlockIndex*& pindexPrevOut)
+    {
+        LOCK(cs);
+        if (!pblocktemplate.get() || pindexPrev != chainActive.Tip() ||
+            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nCreated > 60))
+        {
+            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            pindexPrev = chainActive.Tip();
+            nCreated = GetTime();
+            nExtraNonce = 0;
+            pblocktemplate.reset(CreateNewBlockWithKey(reservekey));
+            if (!pblocktemplate.get())
+                return false;
+            LogPrintf("Running MazaMiner with %u transactions in block (%u bytes)\n", pblocktemplate->block.vtx.size(),
+                ::GetSerializeSize(pblocktemplate->block, SER_NETWORK, PROTOCOL_VERSION));
+        }
+        block = pblocktemplate->block;
+        pindexPrevOut = pindexPrev;
+        SetExtraNonce(&block, pindexPrev, ++nExtraNonce);
+        return true;
+    }
+
+    /** Process a solved block. The next request gets a new template, for a new key. */
+    bool BlockFound(CBlock& block)
+    {
+        LOCK(cs);
+        pblocktemplate.reset();
+        return ProcessBlockFound(&block, *pwallet, reservekey);
+    }
+};
+
+/** Record the hash rate a miner thread measured, and update the total */
+void static UpdateHashMeter(int nThread, double dRate)
+{
+    LOCK(cs_hashmeter);
+    int64_t nNow = GetTimeMillis();
+    if (nThread < (int)vThreadHashRates.size())
+        vThreadHashRates[nThread] = make_pair(dRate, nNow);
+    dHashesPerSec = 0.0;
+    for (unsigned int i = 0; i < vThreadHashRates.size(); i++)
+        if (nNow - vThreadHashRates[i].second <= 8000)
+            dHashesPerSec += vThreadHashRates[i].first;
+    nHPSTimerStart = nNow;
+
+    static int64_t nLogTime;
+    if (GetTime() - nLogTime > 30 * 60)
+    {
+        nLogTime = GetTime();
+        LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
+    }
+}
+
+std::vector<double> GetMinerThreadHashesPerSec()
+{
+    LOCK(cs_hashmeter);
+    int64_t nNow = GetTimeMillis();
+    std::vector<double> vRates;
+    for (unsigned int i = 0; i < vThreadHashRates.size(); i++)
+        vRates.push_back(nNow - vThreadHashRates[i].second <= 8000 ? vThreadHashRates[i].first : 0.0);
+    return vRates;
+}
+
+void static BitcoinMiner(boost::shared_ptr<CMinerWork> work, int nThread)
 {
     LogPrintf("MazaMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("bitcoin-miner");
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+    int64_t nTimerStart = GetTimeMillis();
+    int64_t nHashCounter = 0;
 
     try {
         while (true) {
@@ -469,22 +824,17 @@ void static BitcoinMiner(CWallet *pwallet)
             }
 
             //
-            // Create new block
+            // Get a copy of the shared block, with our own extranonce
             //
             unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrev = chainActive.Tip();
-
-            auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-            if (!pblocktemplate.get())
+            CBlock block;
+            CBlockIndex* pindexPrev;
+            if (!work->GetWork(block, pindexPrev))
             {
                 LogPrintf("Error in MazaMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
                 return;
             }
-            CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-            LogPrintf("Running MazaMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+            CBlock *pblock = &block;
 
             //
             // Search
@@ -511,7 +861,7 @@ void static BitcoinMiner(CWallet *pwallet)
                         SetThreadPriority(THREAD_PRIORITY_NORMAL);
                         LogPrintf("MazaMiner:\n");
                         LogPrintf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex(), hashTarget.GetHex());
-                        ProcessBlockFound(pblock, *pwallet, reservekey);
+                        work->BlockFound(*pblock);
                         SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
                         // In regression test mode, stop mining after a block is found.
@@ -523,33 +873,13 @@ void static BitcoinMiner(CWallet *pwallet)
                 }
 
                 // Meter hashes/sec
-                static int64_t nHashCounter;
-                if (nHPSTimerStart == 0)
+                nHashCounter += nHashesDone;
+                if (GetTimeMillis() - nTimerStart > 4000)
                 {
-                    nHPSTimerStart = GetTimeMillis();
+                    UpdateHashMeter(nThread, 1000.0 * nHashCounter / (GetTimeMillis() - nTimerStart));
+                    nTimerStart = GetTimeMillis();
                     nHashCounter = 0;
                 }
-                else
-                    nHashCounter += nHashesDone;
-                if (GetTimeMillis() - nHPSTimerStart > 4000)
-                {
-                    static CCriticalSection cs;
-                    {
-                        LOCK(cs);
-                        if (GetTimeMillis() - nHPSTimerStart > 4000)
-                        {
-                            dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                            nHPSTimerStart = GetTimeMillis();
-                            nHashCounter = 0;
-                            static int64_t nLogTime;
-                            if (GetTime() - nLogTime > 30 * 60)
-                            {
-                                nLogTime = GetTime();
-                                LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                            }
-                        }
-                    }
-                }
 
                 // Check for stop or if block needs to be rebuilt
                 boost::this_thread::interruption_point();
@@ -604,12 +934,19 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
         minerThreads = NULL;
     }
 
+    {
+        LOCK(cs_hashmeter);
+        vThreadHashRates.assign(fGenerate ? nThreads : 0, make_pair(0.0, (int64_t)0));
+    }
+
     if (nThreads == 0 || !fGenerate)
         return;
 
+    // The threads share one template, and whichever finishes last frees it
+    boost::shared_ptr<CMinerWork> work(new CMinerWork(pwallet));
     minerThreads = new boost::thread_group();
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&BitcoinMiner, work, i));
 }
 
 #endif // ENABLE_WALLET
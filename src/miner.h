@@ -6,7 +6,13 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "amount.h"
+#include "script/script.h"
+#include "uint256.h"
+
+#include <set>
 #include <stdint.h>
+#include <vector>
 
 class CBlock;
 class CBlockHeader;
@@ -15,6 +21,8 @@ class CReserveKey;
 class CScript;
 class CWallet;
 
+class CTransaction;
+
 struct CBlockTemplate;
 
 /** Run the miner threads */
@@ -28,7 +36,65 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 void UpdateTime(CBlockHeader* block, const CBlockIndex* pindexPrev);
 
+/**
+ * A block template that is kept up to date with the chain tip and the
+ * mempool. It is built with CreateNewBlock on every new tip and every
+ * REBUILD_INTERVAL seconds. In between, mempool changes are picked up at
+ * most every UPDATE_INTERVAL seconds: transactions that left the mempool are
+ * dropped from the template, and new ones are appended as packages with
+ * their unconfirmed ancestors, highest ancestor fee rate first. A package
+ * that does not fit but pays a higher fee rate than a transaction in the
+ * template can only displace it by a rebuild, so that triggers one too.
+ * Requires cs_main.
+ */
+class CBlockTemplateCache
+{
+public:
+    //! Seconds between updates for mempool changes alone
+    static const int64_t UPDATE_INTERVAL = 5;
+    //! Seconds after which the template is built from scratch again
+    static const int64_t REBUILD_INTERVAL = 60;
+
+private:
+    CScript scriptPubKey;
+    CBlockTemplate* pblocktemplate;
+    const CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    std::set<uint256> setInBlock;
+    uint64_t nBlockSize;
+    int64_t nBlockSigOps;
+    CAmount nFees;
+    int64_t nLastUpdate;
+    int64_t nLastRebuild;
+
+    void Rebuild();
+    //! Drop what left the mempool; returns the lowest fee rate of what stays
+    CFeeRate RemoveGone();
+    //! Append packages; returns whether one that did not fit beats feeRateLowest
+    bool AddPackages(const CFeeRate& feeRateLowest);
+    void AddToBlock(const CTransaction& tx, CAmount nTxFee, int64_t nTxSigOps, unsigned int nTxSize);
+    void UpdateHeader();
+
+public:
+    //! Duration of the last update, in microseconds
+    int64_t nLastUpdateMicros;
+    //! Whether the last update rebuilt the template from scratch
+    bool fLastUpdateRebuilt;
+    uint64_t nRebuilds;
+    uint64_t nUpdates;
+
+    CBlockTemplateCache(const CScript& scriptPubKeyIn);
+    ~CBlockTemplateCache();
+
+    /** Bring the template up to date. Returns whether it changed. */
+    bool Update();
+    /** The current template; only valid after Update(). */
+    CBlockTemplate& Get() { return *pblocktemplate; }
+};
+
 extern double dHashesPerSec;
 extern int64_t nHPSTimerStart;
+/** The hashes per second of each miner thread, or 0 for one not measured lately */
+std::vector<double> GetMinerThreadHashesPerSec();
 
 #endif // BITCOIN_MINER_H
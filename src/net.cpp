@@ -21,6 +21,12 @@
 #include <fcntl.h>
 #endif
 
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -99,12 +105,171 @@ CCriticalSection cs_vAddedNodes;
 NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
+static bool IsServiceableSocket(SOCKET hSocket);
+static void RegisterNodeSocket(CNode* pnode);
+static void WakeSocketHandler(CNode* pnode);
+
 static CSemaphore *semOutbound = NULL;
 
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+//! Commands with their own latency histogram; whatever else peers send is lumped together
+static const char* ppszLatencyCommands[] = {
+    "version", "verack", "addr", "inv", "getdata", "merkleblock", "getblocks", "getheaders",
+    "tx", "headers", "block", "getaddr", "mempool", "ping", "pong", "alert", "notfound",
+    "filterload", "filteradd", "filterclear", "reject"
+};
+static const set<string> setLatencyCommands(ppszLatencyCommands, ppszLatencyCommands + ARRAYLEN(ppszLatencyCommands));
+static CCriticalSection cs_mapMessageLatency;
+static map<string, CLatencyHistogram> mapMessageLatency;
+
+CLatencyHistogram::CLatencyHistogram() : nCount(0), nTotalMicros(0), nMaxMicros(0)
+{
+    memset(vBuckets, 0, sizeof(vBuckets));
+}
+
+void CLatencyHistogram::Add(int64_t nMicros)
+{
+    nMicros = max(nMicros, (int64_t)0);
+    int nBucket = 0;
+    while (nBucket < BUCKETS - 1 && (nMicros >> (nBucket + 1)) != 0)
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nTotalMicros += nMicros;
+    nMaxMicros = max(nMaxMicros, nMicros);
+}
+
+int64_t CLatencyHistogram::Percentile(double dFraction) const
+{
+    if (nCount == 0)
+        return 0;
+    uint64_t nTarget = max((uint64_t)1, (uint64_t)ceil(dFraction * nCount));
+    uint64_t nSeen = 0;
+    for (int i = 0; i < BUCKETS - 1; i++) {
+        nSeen += vBuckets[i];
+        if (nSeen >= nTarget)
+            return min((int64_t)1 << (i + 1), nMaxMicros);
+    }
+    return nMaxMicros;
+}
+
+void RecordMessageLatency(const string& strCommand, int64_t nMicros)
+{
+    LOCK(cs_mapMessageLatency);
+    mapMessageLatency[setLatencyCommands.count(strCommand) ? strCommand : "other"].Add(nMicros);
+}
+
+void GetMessageLatencies(map<string, CLatencyHistogram>& mapLatencies)
+{
+    LOCK(cs_mapMessageLatency);
+    mapLatencies = mapMessageLatency;
+}
+
+const size_t CNetBufferPool::CLASS_SIZE[CNetBufferPool::CLASSES] = {1 << 10, 1 << 14, 1 << 20, MAX_PROTOCOL_MESSAGE_LENGTH + 24};
+const size_t CNetBufferPool::CLASS_BUFFERS[CNetBufferPool::CLASSES] = {256, 64, 8, 2};
+
+CNetBufferPool::CNetBufferPool(size_t nMaxBytesIn) : nMaxBytes(nMaxBytesIn), nBytes(0), nBuffers(0),
+    nRecvMessages(0), nRecvAllocated(0), nSendMessages(0), nSendAllocated(0)
+{
+    for (int c = 0; c < CLASSES; c++)
+        vFree[c].reserve(CLASS_BUFFERS[c]);
+}
+
+bool CNetBufferPool::Get(CSerializeData& buf, size_t nSize)
+{
+    {
+        LOCK(cs);
+        // Buffers in the class nSize falls in may be too small; all above fit
+        int nFirst = 0;
+        while (nFirst + 1 < CLASSES && CLASS_SIZE[nFirst + 1] <= nSize)
+            nFirst++;
+        for (int c = nFirst; c < CLASSES; c++) {
+            vector<CSerializeData>& vClass = vFree[c];
+            for (size_t i = 0; i < vClass.size(); i++) {
+                if (vClass[i].capacity() < nSize)
+                    continue;
+                nBytes -= vClass[i].capacity();
+                nBuffers--;
+                vClass[i].swap(vClass.back());
+                buf.swap(vClass.back());
+                vClass.pop_back();
+                buf.clear();
+                return true;
+            }
+        }
+    }
+    CSerializeData().swap(buf);
+    for (int c = 0; c < 2; c++) {
+        if (nSize <= CLASS_SIZE[c]) {
+            buf.reserve(CLASS_SIZE[c]);
+            break;
+        }
+    }
+    return false;
+}
+
+void CNetBufferPool::Put(CSerializeData& buf)
+{
+    size_t nCapacity = buf.capacity();
+    buf.clear();
+    if (nCapacity >= CLASS_SIZE[0]) {
+        LOCK(cs);
+        int c = CLASSES - 1;
+        while (c > 0 && CLASS_SIZE[c] > nCapacity)
+            c--;
+        if (vFree[c].size() < CLASS_BUFFERS[c] && nBytes + nCapacity <= nMaxBytes) {
+            vFree[c].push_back(CSerializeData());
+            vFree[c].back().swap(buf);
+            nBytes += nCapacity;
+            nBuffers++;
+            return;
+        }
+    }
+    CSerializeData().swap(buf);
+}
+
+void CNetBufferPool::RecordMessage(bool fSend, bool fAllocated)
+{
+    LOCK(cs);
+    if (fSend) {
+        nSendMessages++;
+        nSendAllocated += fAllocated;
+    } else {
+        nRecvMessages++;
+        nRecvAllocated += fAllocated;
+    }
+}
+
+size_t CNetBufferPool::GetPooledBuffers() const
+{
+    LOCK(cs);
+    return nBuffers;
+}
+
+size_t CNetBufferPool::GetPooledBytes() const
+{
+    LOCK(cs);
+    return nBytes;
+}
+
+void CNetBufferPool::GetMessageCounts(uint64_t& nRecv, uint64_t& nRecvAllocatedOut, uint64_t& nSend, uint64_t& nSendAllocatedOut) const
+{
+    LOCK(cs);
+    nRecv = nRecvMessages;
+    nRecvAllocatedOut = nRecvAllocated;
+    nSend = nSendMessages;
+    nSendAllocatedOut = nSendAllocated;
+}
+
+CNetBufferPool& GetNetBufferPool()
+{
+    static CNetBufferPool pool(16 * 1024 * 1024);
+    return pool;
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -405,6 +570,12 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     {
         addrman.Attempt(addrConnect);
 
+        if (!IsServiceableSocket(hSocket)) {
+            LogPrintf("socket %d does not fit in an fd_set, not connecting to %s\n", hSocket, addrConnect.ToString());
+            CloseSocket(hSocket);
+            return NULL;
+        }
+
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
@@ -412,6 +583,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            RegisterNodeSocket(pnode);
         }
 
         pnode->nTimeConnected = GetTime();
@@ -530,6 +702,7 @@ void CNode::copyStats(CNodeStats &stats)
     X(nStartingHeight);
     X(nSendBytes);
     X(nRecvBytes);
+    X(nBlockBytesServed);
     X(fWhitelisted);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -582,13 +755,63 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete())
+        if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            GetNetBufferPool().RecordMessage(false, msg.fAllocated);
+        }
     }
 
     return true;
 }
 
+unsigned int CNode::ReserveRecvBytes(char*& pch)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return 0;
+    return vRecvMsg.back().reserveData(pch);
+}
+
+void CNode::CommitRecvBytes(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.commitData(nBytes);
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        GetNetBufferPool().RecordMessage(false, msg.fAllocated);
+    }
+}
+
+void CNode::EraseRecvMsgs(std::deque<CNetMessage>::iterator itEnd)
+{
+    for (std::deque<CNetMessage>::iterator it = vRecvMsg.begin(); it != itEnd; it++) {
+        CSerializeData buf;
+        it->vRecv.swap(buf);
+        GetNetBufferPool().Put(buf);
+    }
+    vRecvMsg.erase(vRecvMsg.begin(), itEnd);
+}
+
+namespace {
+/** Deserializes out of a fixed buffer, without copying it into a stream first */
+class CBufferReader
+{
+private:
+    const char* pch;
+    const char* pend;
+
+public:
+    CBufferReader(const char* pbegin, const char* pendIn) : pch(pbegin), pend(pendIn) {}
+
+    void read(char* pchOut, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pch))
+            throw std::ios_base::failure("CBufferReader::read() : end of data");
+        memcpy(pchOut, pch, nSize);
+        pch += nSize;
+    }
+};
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -604,7 +827,8 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // deserialize to CMessageHeader
     try {
-        hdrbuf >> hdr;
+        CBufferReader reader(hdrbuf, hdrbuf + sizeof(hdrbuf));
+        hdr.Unserialize(reader, vRecv.GetType(), vRecv.GetVersion());
     }
     catch (const std::exception &) {
         return -1;
@@ -617,23 +841,51 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // The data goes into a buffer from the pool, if one fits
+    if (hdr.nMessageSize > 0 && hdr.nMessageSize <= MAX_PROTOCOL_MESSAGE_LENGTH) {
+        CSerializeData buf;
+        fAllocated = !GetNetBufferPool().Get(buf, hdr.nMessageSize);
+        vRecv.swap(buf);
+    }
+
     return nCopy;
 }
 
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
 {
-    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    unsigned int nCopied = 0;
+    while (nCopied < nBytes) {
+        char* pchData;
+        unsigned int nCopy = std::min(reserveData(pchData), nBytes - nCopied);
+        if (nCopy == 0)
+            break;
+        memcpy(pchData, pch + nCopied, nCopy);
+        commitData(nCopy);
+        nCopied += nCopy;
+    }
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    return nCopied;
+}
+
+unsigned int CNetMessage::reserveData(char*& pch)
+{
+    if (nDataPos == hdr.nMessageSize)
+        return 0;
+    if (vRecv.size() == nDataPos) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        size_t nCapacity = vRecv.capacity();
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + 256 * 1024));
+        if (vRecv.capacity() != nCapacity)
+            fAllocated = true;
     }
+    pch = &vRecv[nDataPos];
+    return vRecv.size() - nDataPos;
+}
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
-
-    return nCopy;
+void CNetMessage::commitData(unsigned int nBytes)
+{
+    assert(nDataPos + nBytes <= vRecv.size());
+    nDataPos += nBytes;
 }
 
 
@@ -685,317 +937,612 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
+    for (std::deque<CSerializeData>::iterator itSent = pnode->vSendMsg.begin(); itSent != it; itSent++)
+        GetNetBufferPool().Put(*itSent);
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+#ifdef USE_EPOLL
+//! epoll instance for all listening and node sockets, or -1 to use select()
+static int nEpollFd = -1;
+//! Interrupts epoll_wait when nodes in vNodesWakeup have something to send
+static int nWakeupFd = -1;
+static CCriticalSection cs_vNodesWakeup;
+static std::vector<CNode*> vNodesWakeup;
+//! Nodes that could not be serviced completely, with no event due to retry them
+static std::set<CNode*> setNodesPending;
+//! Whether accepting connections failed with something other than EWOULDBLOCK
+static bool fRetryAccept = false;
+
+static bool InitSocketEvents()
+{
+    nEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (nEpollFd == -1)
+        return error("%s : epoll_create1 failed: %s", __func__, NetworkErrorString(errno));
+    nWakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (nWakeupFd == -1 || epoll_ctl(nEpollFd, EPOLL_CTL_ADD, nWakeupFd, &event) != 0) {
+        error("%s : cannot set up wakeup event: %s", __func__, NetworkErrorString(errno));
+        close(nEpollFd);
+        nEpollFd = -1;
+        return false;
+    }
+    BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket) {
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = &hListenSocket;
+        if (epoll_ctl(nEpollFd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0) {
+            error("%s : cannot watch listening socket: %s", __func__, NetworkErrorString(errno));
+            close(nWakeupFd);
+            close(nEpollFd);
+            nEpollFd = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool IsListenSocketEvent(const void* ptr)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        if (ptr == &hListenSocket)
+            return true;
+    return false;
+}
+#endif
+
+/** Whether the socket loop in use can watch a socket: select() only takes those below FD_SETSIZE. */
+static bool IsServiceableSocket(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (nEpollFd != -1)
+        return true;
+#endif
+#ifdef WIN32
+    return true;
+#else
+    return hSocket < FD_SETSIZE;
+#endif
+}
+
+/** Start watching the socket of a node that was added to vNodes. */
+static void RegisterNodeSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (nEpollFd == -1)
+        return;
+    // Edge-triggered: the socket handler reads and writes until the socket
+    // would block, and only hears from this socket again when that changes.
+    // Closing the socket unregisters it.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(nEpollFd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
+/** Have the socket handler send a node's queued messages. */
+static void WakeSocketHandler(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (nEpollFd == -1)
+        return;
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodesWakeup);
+        vNodesWakeup.push_back(pnode);
+    }
+    uint64_t nOne = 1;
+    if (write(nWakeupFd, &nOne, sizeof(nOne)) != sizeof(nOne))
+        LogPrint("net", "socket wakeup failed: %s\n", NetworkErrorString(errno));
+#endif
+}
+
+static void DisconnectNodes()
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+#ifdef USE_EPOLL
+                    setNodesPending.erase(pnode);
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        LOCK(cs_vNodesWakeup);
+                        vNodesWakeup.erase(remove(vNodesWakeup.begin(), vNodesWakeup.end(), pnode), vNodesWakeup.end());
                     }
+#endif
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
-        }
+    }
+}
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+/** Accept a connection on a listening socket. Returns false if there was none to accept. */
+static bool AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
 
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK) {
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+#ifdef USE_EPOLL
+            fRetryAccept = true;
+#endif
         }
+        return false;
+    }
+    else if (!IsServiceableSocket(hSocket))
+    {
+        LogPrintf("connection from %s dropped: socket %d does not fit in an fd_set\n", addr.ToString(), hSocket);
+        CloseSocket(hSocket);
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        CloseSocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr) && !whitelisted)
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else
+    {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
 
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            vNodes.push_back(pnode);
+            RegisterNodeSocket(pnode);
+        }
+    }
+    return true;
+}
+
+/** Read from a node's socket into its receive buffer. Returns false once nothing more can be read. */
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    // The bulk of large messages is received straight into their buffer
+    char* pchDirect;
+    unsigned int nDirect = pnode->ReserveRecvBytes(pchDirect);
+    bool fDirect = nDirect >= sizeof(pchBuf) / 4;
+    int nBytes = recv(pnode->hSocket, fDirect ? pchDirect : pchBuf, fDirect ? nDirect : sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (fDirect)
+            pnode->CommitRecvBytes(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+/** Whether a node's receive buffer is too full to read more for now. */
+static bool ReceiveBufferFull(CNode* pnode)
+{
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+           pnode->GetTotalRecvSize() > ReceiveFloodSize();
+}
+
+static void ServiceSocketsSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+#ifndef WIN32
+            if (pnode->hSocket >= FD_SETSIZE) {
+                // Such sockets are refused when accepted or connected, see IsServiceableSocket
+                LogPrintf("socket %d does not fit in an fd_set, disconnecting peer=%d\n", pnode->hSocket, pnode->id);
+                pnode->fDisconnect = true;
+                continue;
+            }
+#endif
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
             {
-                if (pnode->hSocket == INVALID_SOCKET)
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
                     continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && !ReceiveBufferFull(pnode))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
         }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+    {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            AcceptConnection(hListenSocket);
+    }
+
+    //
+    // Service each socket
+    //
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+                SocketRecvData(pnode);
         }
 
         //
-        // Accept new connections
+        // Send
         //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend))
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                SocketSendData(pnode);
+        }
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
 
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
+#ifdef USE_EPOLL
+/**
+ * Send and receive on a node's socket until it would block, the same way
+ * the select() loop does: a node with data left to send is not read from.
+ * Returns false if that could not be finished and no event would tell us
+ * when to try again, because a lock was taken or the receive buffer is full.
+ */
+static bool ServiceNodeEpoll(CNode* pnode, bool fRecv, bool fSend)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return true;
 
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
+    bool fSendPending = false;
+    if (fSend)
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend)
+            return false;
+        if (!pnode->vSendMsg.empty())
+            SocketSendData(pnode);
+        fSendPending = !pnode->vSendMsg.empty();
+    }
+    else
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend)
+            return false;
+        fSendPending = !pnode->vSendMsg.empty();
+    }
 
-                if (hSocket == INVALID_SOCKET)
-                {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                }
-                else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-                {
-                    CloseSocket(hSocket);
-                }
-                else if (CNode::IsBanned(addr) && !whitelisted)
-                {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else
-                {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
+    if (fRecv && pnode->hSocket != INVALID_SOCKET)
+    {
+        // Reading resumes once the peer has taken what we have for it
+        if (fSendPending)
+            return false;
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv)
+            return false;
+        while (true) {
+            if (ReceiveBufferFull(pnode))
+                return false;
+            if (!SocketRecvData(pnode))
+                break;
+        }
+    }
+    return true;
+}
 
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+static void ServiceSocketsEpoll()
+{
+    static const int MAX_EVENTS = 256;
+    struct epoll_event events[MAX_EVENTS];
+    // Nodes left pending are retried at the rate select() polls
+    int nTimeout = (setNodesPending.empty() && !fRetryAccept) ? 1000 : 50;
+    int nEvents = epoll_wait(nEpollFd, events, MAX_EVENTS, nTimeout);
+    boost::this_thread::interruption_point();
+    if (nEvents < 0) {
+        int nErr = errno;
+        if (nErr != EINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+            MilliSleep(50);
         }
+        nEvents = 0;
+    }
 
-        //
-        // Service each socket
-        //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+    // Only the nodes with something to do are visited
+    static const int SERVICE_RECV = 1;
+    static const int SERVICE_SEND = 2;
+    std::map<CNode*, int> mapService;
+    BOOST_FOREACH(CNode* pnode, setNodesPending)
+        mapService[pnode] = SERVICE_RECV | SERVICE_SEND;
+    setNodesPending.clear();
+    bool fAccept = fRetryAccept;
+    fRetryAccept = false;
+    for (int i = 0; i < nEvents; i++) {
+        void* ptr = events[i].data.ptr;
+        if (ptr == NULL) {
+            uint64_t nCount;
+            if (read(nWakeupFd, &nCount, sizeof(nCount)) < 0 && errno != EAGAIN)
+                LogPrint("net", "socket wakeup read failed: %s\n", NetworkErrorString(errno));
+            LOCK(cs_vNodesWakeup);
+            BOOST_FOREACH(CNode* pnode, vNodesWakeup)
+                mapService[pnode] |= SERVICE_SEND;
+            vNodesWakeup.clear();
+        } else if (IsListenSocketEvent(ptr)) {
+            fAccept = true;
+        } else {
+            int nService = 0;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                nService |= SERVICE_RECV;
+            if (events[i].events & EPOLLOUT)
+                nService |= SERVICE_SEND;
+            mapService[(CNode*)ptr] |= nService;
         }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            boost::this_thread::interruption_point();
+    }
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+    if (fAccept) {
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            while (hListenSocket.socket != INVALID_SOCKET && AcceptConnection(hListenSocket))
+                boost::this_thread::interruption_point();
+    }
+
+    for (std::map<CNode*, int>::iterator it = mapService.begin(); it != mapService.end(); it++) {
+        boost::this_thread::interruption_point();
+        if (!ServiceNodeEpoll(it->first, it->second & SERVICE_RECV, it->second & SERVICE_SEND))
+            setNodesPending.insert(it->first);
+    }
+}
+#endif
+
+static void CheckInactivity()
+{
+    LOCK(cs_vNodes);
+    int64_t nTime = GetTime();
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (nTime - pnode->nTimeConnected > 60)
+        {
+            if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+                pnode->fDisconnect = true;
             }
-
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
+                LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+                pnode->fDisconnect = true;
             }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+            else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
+                LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+                pnode->fDisconnect = true;
+            }
+            else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+            {
+                LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+                pnode->fDisconnect = true;
             }
         }
+    }
+}
+
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastSweep = 0;
+    int64_t nLastInactivityCheck = 0;
+    while (true)
+    {
+        bool fEpoll = false;
+#ifdef USE_EPOLL
+        fEpoll = nEpollFd != -1;
+#endif
+        // The select() loop visits every node on every iteration anyway.
+        // With epoll, iterations are driven by events, and the sweeps over
+        // all nodes only run a few times per second.
+        int64_t nNow = GetTimeMillis();
+        if (!fEpoll || nNow - nLastSweep >= 100)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            nLastSweep = nNow;
+            DisconnectNodes();
+            if(vNodes.size() != nPrevNodeCount) {
+                nPrevNodeCount = vNodes.size();
+                uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            }
+        }
+
+#ifdef USE_EPOLL
+        if (fEpoll)
+            ServiceSocketsEpoll();
+        else
+#endif
+            ServiceSocketsSelect();
+
+        if (GetTime() != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = GetTime();
+            CheckInactivity();
         }
     }
 }
@@ -1406,7 +1953,14 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+/**
+ * Message handler threads share the nodes between them: a thread that
+ * finds a node busy moves on to the next one, so each node's messages are
+ * still processed one at a time and in order, while a slow peer only
+ * holds up the thread working on it. Threads start at different nodes so
+ * they don't queue up behind the same ones.
+ */
+void ThreadMessageHandler(int nThread, int nThreads)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
@@ -1422,16 +1976,22 @@ void ThreadMessageHandler()
 
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (nThread == 0 && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        size_t nOffset = vNodesCopy.size() * nThread / nThreads;
+        for (size_t i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nOffset + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
+            TRY_LOCK(pnode->cs_processing, lockProcessing);
+            if (!lockProcessing)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1638,6 +2198,13 @@ void StartNode(boost::thread_group& threadGroup)
 
     Discover(threadGroup);
 
+#ifdef USE_EPOLL
+    if (InitSocketEvents())
+        LogPrintf("Using epoll for socket events\n");
+    else
+        LogPrintf("Using select() for socket events, refusing sockets from %d on\n", FD_SETSIZE);
+#endif
+
     //
     // Start threads
     //
@@ -1660,7 +2227,12 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlerThreads = GetArg("-msghandthreads", DEFAULT_MESSAGE_HANDLER_THREADS);
+    nMessageHandlerThreads = max(1, min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+                                              boost::function<void()>(boost::bind(&ThreadMessageHandler, i, nMessageHandlerThreads))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1698,6 +2270,13 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef USE_EPOLL
+        if (nEpollFd != -1) {
+            close(nWakeupFd);
+            close(nEpollFd);
+            nEpollFd = -1;
+        }
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1936,6 +2515,7 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nLastSend = 0;
     nLastRecv = 0;
     nSendBytes = 0;
+    nBlockBytesServed = 0;
     nRecvBytes = 0;
     nTimeConnected = GetTime();
     addr = addrIn;
@@ -1952,6 +2532,7 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendMsgCapacity = 0;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
@@ -2020,10 +2601,19 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
-void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
+void CNode::BeginMessage(const char* pszCommand, size_t nPayloadSize) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
+    // Messages are built in a pooled buffer, which is handed on to vSendMsg
+    nSendMsgCapacity = ssSend.capacity();
+    if (nSendMsgCapacity < CMessageHeader::HEADER_SIZE + nPayloadSize) {
+        CSerializeData buf;
+        bool fPooled = GetNetBufferPool().Get(buf, CMessageHeader::HEADER_SIZE + nPayloadSize);
+        ssSend.swap(buf);
+        GetNetBufferPool().Put(buf);
+        nSendMsgCapacity = fPooled ? ssSend.capacity() : 0;
+    }
     ssSend << CMessageHeader(pszCommand, 0);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
@@ -2067,13 +2657,18 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
+    GetNetBufferPool().RecordMessage(true, nSendMsgCapacity == 0 || ssSend.capacity() > nSendMsgCapacity);
     std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
+    ssSend.swap(*it);
     nSendSize += (*it).size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (it == vSendMsg.begin()) {
         SocketSendData(this);
+        // What didn't fit is sent by the socket handler
+        if (!vSendMsg.empty())
+            WakeSocketHandler(this);
+    }
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
@@ -58,6 +58,10 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** -msghandthreads default */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -92,6 +96,34 @@ struct CNodeSignals
 
 CNodeSignals& GetNodeSignals();
 
+/**
+ * Distribution of the time taken to process messages, in buckets whose
+ * bounds double: bucket 0 counts times under 2us, bucket i times in
+ * [2^i, 2^(i+1)) us, and the last bucket everything slower.
+ */
+class CLatencyHistogram
+{
+public:
+    static const int BUCKETS = 24;
+
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    uint64_t vBuckets[BUCKETS];
+
+    CLatencyHistogram();
+
+    void Add(int64_t nMicros);
+
+    /** Upper bound of the bucket holding the given fraction of the samples, 0 if there are none */
+    int64_t Percentile(double dFraction) const;
+};
+
+/** Account the time taken to process a message of the given command */
+void RecordMessageLatency(const std::string& strCommand, int64_t nMicros);
+/** Message processing times by command; unknown commands are counted as "other" */
+void GetMessageLatencies(std::map<std::string, CLatencyHistogram>& mapLatencies);
+
 
 enum
 {
@@ -163,6 +195,7 @@ public:
     int nStartingHeight;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    uint64_t nBlockBytesServed;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -172,24 +205,73 @@ public:
 
 
 
+/**
+ * Storage of network message buffers, kept for reuse instead of being
+ * freed so a steady flow of messages doesn't keep going through the
+ * allocator. Free buffers are grouped by capacity in classes that fit the
+ * usual traffic: inv, ping and most transactions; large transactions and
+ * inventories; block-sized messages; and the largest ones allowed.
+ */
+class CNetBufferPool
+{
+public:
+    static const int CLASSES = 4;
+    static const size_t CLASS_SIZE[CLASSES];
+    static const size_t CLASS_BUFFERS[CLASSES];
+
+    CNetBufferPool(size_t nMaxBytesIn);
+
+    /**
+     * Replace buf with a free buffer that holds at least nSize bytes.
+     * Returns false if there was none; a small buffer is then allocated at
+     * the size of its class so it can be pooled later, and a large one is
+     * left empty to grow as the data comes in.
+     */
+    bool Get(CSerializeData& buf, size_t nSize);
+    /** Keep the storage of buf for reuse, or free it if the pool is full. buf is left empty. */
+    void Put(CSerializeData& buf);
+
+    /** Account a sent or received message, and whether its buffer had to be allocated or grown */
+    void RecordMessage(bool fSend, bool fAllocated);
+
+    size_t GetPooledBuffers() const;
+    size_t GetPooledBytes() const;
+    void GetMessageCounts(uint64_t& nRecv, uint64_t& nRecvAllocated, uint64_t& nSend, uint64_t& nSendAllocated) const;
+
+private:
+    mutable CCriticalSection cs;
+    size_t nMaxBytes;
+    size_t nBytes;
+    size_t nBuffers;
+    std::vector<CSerializeData> vFree[CLASSES];
+    uint64_t nRecvMessages;
+    uint64_t nRecvAllocated;
+    uint64_t nSendMessages;
+    uint64_t nSendAllocated;
+};
+
+/** The buffer pool for all connections */
+CNetBufferPool& GetNetBufferPool();
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char hdrbuf[24];                // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
+    bool fAllocated;                // whether vRecv didn't come from the buffer pool at full size
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        fAllocated = false;
         nTime = 0;
     }
 
@@ -202,12 +284,16 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Make room for more message data. Returns where it goes and how much fits. */
+    unsigned int reserveData(char*& pch);
+    /** Account nBytes written where reserveData pointed */
+    void commitData(unsigned int nBytes);
 };
 
 
@@ -227,12 +313,16 @@ public:
     uint64_t nSendBytes;
     std::deque<CSerializeData> vSendMsg;
     CCriticalSection cs_vSend;
+    size_t nSendMsgCapacity; // capacity of ssSend when the current message was begun, 0 if allocated for it
+    uint64_t nBlockBytesServed; // serialized blocks sent in response to getdata
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    //! Held by the message handler thread processing this node's messages
+    CCriticalSection cs_processing;
 
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -282,9 +372,10 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay; the message handlers of other nodes push addresses too
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -341,6 +432,20 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    /**
+     * Where the socket can receive straight into the data of the message
+     * being received, and how much fits there; 0 if it is still reading a
+     * header. Follow with CommitRecvBytes for what was written.
+     */
+    // requires LOCK(cs_vRecvMsg)
+    unsigned int ReserveRecvBytes(char*& pch);
+    // requires LOCK(cs_vRecvMsg)
+    void CommitRecvBytes(unsigned int nBytes);
+
+    /** Drop processed messages up to itEnd, keeping their buffers for reuse */
+    // requires LOCK(cs_vRecvMsg)
+    void EraseRecvMsgs(std::deque<CNetMessage>::iterator itEnd);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -364,11 +469,19 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
+    void ClearAddressKnown()
+    {
+        LOCK(cs_vAddrToSend);
+        setAddrKnown.clear();
+    }
+
     void PushAddress(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -402,7 +515,7 @@ public:
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
-    void BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
+    void BeginMessage(const char* pszCommand, size_t nPayloadSize = 0) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void AbortMessage() UNLOCK_FUNCTION(cs_vSend);
@@ -427,6 +540,22 @@ public:
         }
     }
 
+    //! Send a message whose payload is already serialized
+    void PushRawMessage(const char* pszCommand, const char* pch, size_t nSize)
+    {
+        try
+        {
+            BeginMessage(pszCommand, nSize);
+            ssSend.write(pch, nSize);
+            EndMessage();
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -5,10 +5,13 @@
 
 #include "primitives/block.h"
 
+#include "crypto/sha256.h"
 #include "hash.h"
 #include "tinyformat.h"
 #include "utilstrencodings.h"
 
+#include <string.h>
+
 uint256 CBlockHeader::GetHash() const
 {
     return Hash(BEGIN(nVersion), END(nNonce));
@@ -59,15 +62,20 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if (nSize % 2 == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
+        }
+        // The pairs of hashes are adjacent 64-byte inputs, so the whole level is
+        // hashed in one batch. An odd last hash is paired with itself.
+        size_t nPos = vMerkleTree.size();
+        vMerkleTree.resize(nPos + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[nPos].begin(), vMerkleTree[j].begin(), nSize / 2);
+        if (nSize % 2) {
+            unsigned char pair[64];
+            memcpy(pair, vMerkleTree[j+nSize-1].begin(), 32);
+            memcpy(pair + 32, vMerkleTree[j+nSize-1].begin(), 32);
+            SHA256D64(vMerkleTree.back().begin(), pair, 1);
         }
         j += nSize;
     }
@@ -82,6 +82,8 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    //! Whether CheckBlock passed with all checks, so it needn't run again
+    mutable bool fChecked;
 
     CBlock()
     {
@@ -107,6 +109,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        fChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
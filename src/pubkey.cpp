@@ -6,25 +6,160 @@
 
 #include "eccryptoverify.h"
 
-#ifdef USE_SECP256K1
 #include <secp256k1.h>
-#else
 #include "ecwrapper.h"
-#endif
+
+bool fVerifyOpenSSL = false;
+
+//! anonymous namespace
+namespace {
+
+class CSecp256k1VerifyInit {
+public:
+    CSecp256k1VerifyInit() {
+        secp256k1_start(SECP256K1_START_VERIFY);
+    }
+    ~CSecp256k1VerifyInit() {
+        secp256k1_stop();
+    }
+};
+static CSecp256k1VerifyInit instance_of_csecp256k1verifyinit;
+
+/**
+ * Parse a DER-encoded integer length. On success, *pos points at the first
+ * byte of the integer and *len holds its length.
+ */
+bool ParseDERLength(const unsigned char *input, size_t inputlen, size_t *pos, size_t *len)
+{
+    if (*pos == inputlen)
+        return false;
+    size_t lenbyte = input[(*pos)++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (*pos + lenbyte > inputlen)
+            return false;
+        while (lenbyte > 0 && input[*pos] == 0) {
+            (*pos)++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t))
+            return false;
+        *len = 0;
+        while (lenbyte > 0) {
+            *len = (*len << 8) + input[*pos];
+            (*pos)++;
+            lenbyte--;
+        }
+    } else {
+        *len = lenbyte;
+    }
+    return *len <= inputlen - *pos;
+}
+
+/**
+ * Parse a signature the way OpenSSL does, tolerating the DER violations
+ * (long-form lengths, excess padding, trailing garbage) that exist in the
+ * block chain. The R and S values are returned as 32-byte big endian
+ * numbers in rs[0..31] and rs[32..63]. Values that do not fit in 32 bytes
+ * cannot be valid and make parsing fail.
+ */
+bool ParseDERSignatureLax(const unsigned char *input, size_t inputlen, unsigned char rs[64])
+{
+    size_t pos = 0, rpos, rlen, spos, slen, seqlen;
+
+    // Sequence tag and length; the length itself is not enforced.
+    if (pos == inputlen || input[pos] != 0x30)
+        return false;
+    pos++;
+    if (pos == inputlen)
+        return false;
+    seqlen = input[pos++];
+    if (seqlen & 0x80) {
+        seqlen -= 0x80;
+        if (pos + seqlen > inputlen)
+            return false;
+        pos += seqlen;
+    }
+
+    // Integer tag and length for R
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+    if (!ParseDERLength(input, inputlen, &pos, &rlen))
+        return false;
+    rpos = pos;
+    pos += rlen;
+
+    // Integer tag and length for S
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+    if (!ParseDERLength(input, inputlen, &pos, &slen))
+        return false;
+    spos = pos;
+
+    // Strip leading zeroes and copy R and S
+    while (rlen > 0 && input[rpos] == 0) {
+        rlen--;
+        rpos++;
+    }
+    while (slen > 0 && input[spos] == 0) {
+        slen--;
+        spos++;
+    }
+    if (rlen > 32 || slen > 32)
+        return false;
+    memset(rs, 0, 64);
+    memcpy(rs + 32 - rlen, input + rpos, rlen);
+    memcpy(rs + 64 - slen, input + spos, slen);
+    return true;
+}
+
+/** Append a 32-byte big endian number as a minimally encoded DER integer. */
+void AppendDERInteger(std::vector<unsigned char>& vch, const unsigned char *num)
+{
+    int nSkip = 0;
+    while (nSkip < 31 && num[nSkip] == 0)
+        nSkip++;
+    bool fPad = (num[nSkip] & 0x80) != 0;
+    vch.push_back(0x02);
+    vch.push_back(32 - nSkip + (fPad ? 1 : 0));
+    if (fPad)
+        vch.push_back(0x00);
+    vch.insert(vch.end(), num + nSkip, num + 32);
+}
+
+} // anon namespace
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (fVerifyOpenSSL)
+        return VerifyOpenSSL(hash, vchSig);
     if (!IsValid())
         return false;
-#ifdef USE_SECP256K1
-    if (secp256k1_ecdsa_verify((const unsigned char*)&hash, 32, &vchSig[0], vchSig.size(), begin(), size()) != 1)
+    // libsecp256k1 only accepts strict DER, so re-encode what OpenSSL would have accepted.
+    unsigned char rs[64];
+    if (vchSig.empty() || !ParseDERSignatureLax(&vchSig[0], vchSig.size(), rs))
+        return false;
+    std::vector<unsigned char> vchDER;
+    vchDER.reserve(72);
+    vchDER.push_back(0x30);
+    vchDER.push_back(0);
+    AppendDERInteger(vchDER, rs);
+    AppendDERInteger(vchDER, rs + 32);
+    vchDER[1] = vchDER.size() - 2;
+    if (secp256k1_ecdsa_verify((const unsigned char*)&hash, 32, &vchDER[0], vchDER.size(), begin(), size()) != 1)
+        return false;
+    return true;
+}
+
+bool CPubKey::VerifyOpenSSL(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (!IsValid())
         return false;
-#else
     CECKey key;
     if (!key.SetPubKey(begin(), size()))
         return false;
     if (!key.Verify(hash, vchSig))
         return false;
-#endif
     return true;
 }
 
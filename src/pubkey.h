@@ -23,6 +23,9 @@
  * script supports up to 75 for single byte push
  */
 
+/** Make CPubKey::Verify use OpenSSL instead of libsecp256k1 (-verifyopenssl) */
+extern bool fVerifyOpenSSL;
+
 /** A reference to a CKey: the Hash160 of its serialized public key */
 class CKeyID : public uint160
 {
@@ -175,6 +178,9 @@ public:
      */
     bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
 
+    //! Verify a DER signature using OpenSSL instead of libsecp256k1 (for differential testing).
+    bool VerifyOpenSSL(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
+
     //! Recover a public key from a compact signature.
     bool RecoverCompact(const uint256& hash, const std::vector<unsigned char>& vchSig);
 
@@ -222,6 +222,9 @@ Value gethashespersec(const Array& params, bool fHelp)
 #endif
 
 
+// The template served by getblocktemplate, with the latency of its last update
+static CBlockTemplateCache blocktemplatecache(CScript() << OP_TRUE);
+
 Value getmininginfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -238,7 +241,11 @@ Value getmininginfo(const Array& params, bool fHelp)
             "  \"generate\": true|false     (boolean) If the generation is on or off (see getgenerate or setgenerate calls)\n"
             "  \"genproclimit\": n          (numeric) The processor limit for generation. -1 if no generation. (see getgenerate or setgenerate calls)\n"
             "  \"hashespersec\": n          (numeric) The hashes per second of the generation, or 0 if no generation.\n"
+            "  \"threadhashespersec\": [n,...] (array) The hashes per second of each generation thread\n"
             "  \"pooledtx\": n              (numeric) The size of the mem pool\n"
+            "  \"templatelatency\": xxx.xx  (numeric) Milliseconds taken by the last update of the getblocktemplate template\n"
+            "  \"templaterebuilds\": n      (numeric) Number of times the template was built from scratch\n"
+            "  \"templateupdates\": n       (numeric) Number of times the template was updated incrementally\n"
             "  \"testnet\": true|false      (boolean) If using testnet or not\n"
             "  \"chain\": \"xxxx\",         (string) current network name as defined in BIP70 (main, test, regtest)\n"
             "}\n"
@@ -256,11 +263,21 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("genproclimit",     (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("networkhashps",    getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
+    {
+        LOCK(cs_main);
+        obj.push_back(Pair("templatelatency",  blocktemplatecache.nLastUpdateMicros * 0.001));
+        obj.push_back(Pair("templaterebuilds", blocktemplatecache.nRebuilds));
+        obj.push_back(Pair("templateupdates",  blocktemplatecache.nUpdates));
+    }
     obj.push_back(Pair("testnet",          Params().TestnetToBeDeprecatedFieldRPC()));
     obj.push_back(Pair("chain",            Params().NetworkIDString()));
 #ifdef ENABLE_WALLET
     obj.push_back(Pair("generate",         getgenerate(params, false)));
     obj.push_back(Pair("hashespersec",     gethashespersec(params, false)));
+    Array threadRates;
+    BOOST_FOREACH(double dRate, GetMinerThreadHashesPerSec())
+        threadRates.push_back((int64_t)dRate);
+    obj.push_back(Pair("threadhashespersec", threadRates));
 #endif
     return obj;
 }
@@ -490,35 +507,13 @@ Value getblocktemplate(const Array& params, bool fHelp)
         // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
     }
 
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
+    // Update block: rebuilt on a new tip, and mempool changes are picked up
+    // at most every CBlockTemplateCache::UPDATE_INTERVAL seconds
+    unsigned int nTransactionsUpdatedNow = mempool.GetTransactionsUpdated();
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    if (blocktemplatecache.Update())
+        nTransactionsUpdatedLast = nTransactionsUpdatedNow;
+    CBlockTemplate* pblocktemplate = &blocktemplatecache.Get();
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     // Update nTime
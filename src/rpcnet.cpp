@@ -90,6 +90,7 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"lastrecv\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
+            "    \"blockbytesserved\": n,     (numeric) The bytes of blocks sent to this peer on request\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"pingtime\": n,             (numeric) ping time\n"
             "    \"pingwait\": n,             (numeric) ping wait\n"
@@ -103,7 +104,9 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"inflightlimit\": n,        (numeric) How many blocks we ask from this peer at a time, sized to its download rate\n"
+            "    \"blockdownloadrate\": n,    (numeric) The rate in bytes per second at which this peer sent requested blocks, 0 if not known yet\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -130,6 +133,7 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("lastrecv", stats.nLastRecv));
         obj.push_back(Pair("bytessent", stats.nSendBytes));
         obj.push_back(Pair("bytesrecv", stats.nRecvBytes));
+        obj.push_back(Pair("blockbytesserved", stats.nBlockBytesServed));
         obj.push_back(Pair("conntime", stats.nTimeConnected));
         obj.push_back(Pair("pingtime", stats.dPingTime));
         if (stats.dPingWait > 0.0)
@@ -150,6 +154,8 @@ Value getpeerinfo(const Array& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflightlimit", statestats.nBlocksInTransitLimit));
+            obj.push_back(Pair("blockdownloadrate", statestats.nBlockDownloadRate));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -337,7 +343,15 @@ Value getnettotals(const Array& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"buffers\": {           (json object) Message buffers\n"
+            "    \"recvmessages\": n,      (numeric) Messages received\n"
+            "    \"recvallocations\": n,   (numeric) Received messages whose buffer had to be allocated or grown\n"
+            "    \"sentmessages\": n,      (numeric) Messages sent\n"
+            "    \"sentallocations\": n,   (numeric) Sent messages whose buffer had to be allocated or grown\n"
+            "    \"pooledbuffers\": n,     (numeric) Free buffers kept for reuse\n"
+            "    \"pooledbytes\": n        (numeric) Capacity of the free buffers\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -348,9 +362,68 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    const CNetBufferPool& pool = GetNetBufferPool();
+    uint64_t nRecv, nRecvAllocated, nSend, nSendAllocated;
+    pool.GetMessageCounts(nRecv, nRecvAllocated, nSend, nSendAllocated);
+    Object buffers;
+    buffers.push_back(Pair("recvmessages", nRecv));
+    buffers.push_back(Pair("recvallocations", nRecvAllocated));
+    buffers.push_back(Pair("sentmessages", nSend));
+    buffers.push_back(Pair("sentallocations", nSendAllocated));
+    buffers.push_back(Pair("pooledbuffers", (uint64_t)pool.GetPooledBuffers()));
+    buffers.push_back(Pair("pooledbytes", (uint64_t)pool.GetPooledBytes()));
+    obj.push_back(Pair("buffers", buffers));
     return obj;
 }
 
+Value getmessagestats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagestats\n"
+            "\nReturns how long processing received messages has taken, by command.\n"
+            "Commands this node doesn't know are counted as \"other\".\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {            (json object) A command that has been received\n"
+            "    \"count\": n,            (numeric) Number of messages processed\n"
+            "    \"totalmicros\": n,      (numeric) Total processing time in microseconds\n"
+            "    \"maxmicros\": n,        (numeric) Longest processing time\n"
+            "    \"p50micros\": n,        (numeric) Upper bound of the median processing time\n"
+            "    \"p90micros\": n,        (numeric) Upper bound of the 90th percentile\n"
+            "    \"p99micros\": n,        (numeric) Upper bound of the 99th percentile\n"
+            "    \"histogram\": [ n,...]  (array) Message counts under 2us, then in [2^i, 2^(i+1)) us for i = 1, 2, ..., with the last bucket open-ended\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmessagestats", "")
+            + HelpExampleRpc("getmessagestats", "")
+       );
+
+    map<string, CLatencyHistogram> mapLatencies;
+    GetMessageLatencies(mapLatencies);
+
+    Object ret;
+    for (map<string, CLatencyHistogram>::const_iterator it = mapLatencies.begin(); it != mapLatencies.end(); it++) {
+        const CLatencyHistogram& histogram = it->second;
+        Object obj;
+        obj.push_back(Pair("count", histogram.nCount));
+        obj.push_back(Pair("totalmicros", histogram.nTotalMicros));
+        obj.push_back(Pair("maxmicros", histogram.nMaxMicros));
+        obj.push_back(Pair("p50micros", histogram.Percentile(0.5)));
+        obj.push_back(Pair("p90micros", histogram.Percentile(0.9)));
+        obj.push_back(Pair("p99micros", histogram.Percentile(0.99)));
+        Array buckets;
+        for (int i = 0; i < CLatencyHistogram::BUCKETS; i++)
+            buckets.push_back(histogram.vBuckets[i]);
+        obj.push_back(Pair("histogram", buckets));
+        ret.push_back(Pair(it->first, obj));
+    }
+    return ret;
+}
+
 static Array GetNetworksInfo()
 {
     Array networks;
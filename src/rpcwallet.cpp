@@ -951,6 +951,8 @@ Value addmultisigaddress(const Array& params, bool fHelp)
     CScript inner = _createmultisig_redeemScript(params);
     CScriptID innerID(inner);
     pwalletMain->AddCScript(inner);
+    // Outputs already in the wallet may pay to the script
+    pwalletMain->MarkDirty();
 
     pwalletMain->SetAddressBook(innerID, strAccount, "send");
     return CBitcoinAddress(innerID).ToString();
@@ -2011,3 +2013,44 @@ Value getwalletinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
     return obj;
 }
+
+Value getrescaninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "Returns the progress of the wallet rescan in progress, such as one started by importprivkey.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"rescanning\": true|false,   (boolean) whether a rescan is running\n"
+            "  \"startheight\": xxxxx,       (numeric) the height of the first block it scans\n"
+            "  \"height\": xxxxx,            (numeric) the height of the last block it has scanned\n"
+            "  \"tipheight\": xxxxx,         (numeric) the height it scans up to\n"
+            "  \"progress\": x.xxx,          (numeric) the fraction done, estimated by transaction count\n"
+            "  \"duration\": xxx,            (numeric) the seconds since it started\n"
+            "  \"eta\": xxx,                 (numeric) the estimated seconds left, or -1 if not known yet\n"
+            "  \"error\": \"...\"              (string) why the last rescan stopped before the tip, if it did\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrescaninfo", "")
+            + HelpExampleRpc("getrescaninfo", "")
+        );
+
+    // Doesn't take cs_wallet, which the rescan holds while adding what it found
+    CRescanProgress progress = pwalletMain->GetRescanProgress();
+    int64_t nNow = GetTime();
+    Object obj;
+    obj.push_back(Pair("rescanning", progress.fScanning));
+    if (progress.fScanning)
+    {
+        obj.push_back(Pair("startheight", progress.nStartHeight));
+        obj.push_back(Pair("height",      progress.nHeight));
+        obj.push_back(Pair("tipheight",   progress.nTipHeight));
+        obj.push_back(Pair("progress",    progress.dProgress));
+        obj.push_back(Pair("duration",    nNow - progress.nStartTime));
+        obj.push_back(Pair("eta",         progress.EstimateTimeLeft(nNow)));
+    }
+    if (!progress.strError.empty())
+        obj.push_back(Pair("error", progress.strError));
+    return obj;
+}
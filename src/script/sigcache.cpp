@@ -5,86 +5,160 @@
 
 #include "sigcache.h"
 
+#include "crypto/sha256.h"
 #include "pubkey.h"
 #include "random.h"
-#include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <algorithm>
+#include <limits>
 
-namespace {
+const size_t CSignatureCache::ENTRY_SIZE;
 
-/**
- * Valid signature cache, to avoid doing expensive ECDSA signature checking
- * twice for every transaction (once when accepted into memory pool, and
- * again when accepted into the block chain)
- */
-class CSignatureCache
+void CSignatureCache::Setup(size_t nBytes)
 {
-private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+    nonce = GetRandHash();
+    nSize = std::min(nBytes / sizeof(CEntry), (size_t)std::numeric_limits<uint32_t>::max());
+    table.reset(nSize ? new CEntry[nSize] : NULL);
+    for (uint32_t i = 0; i < nSize; i++)
+        for (int j = 0; j < 4; j++)
+            table[i].n[j].store(0, boost::memory_order_relaxed);
+    nMaxDepth = 1;
+    while (nMaxDepth < 32 && ((uint64_t)1 << nMaxDepth) < nSize)
+        nMaxDepth++;
+}
+
+void CSignatureCache::ComputeEntry(uint64_t entry[4], const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+{
+    unsigned char buf[CSHA256::OUTPUT_SIZE];
+    CSHA256 hasher;
+    hasher.Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(pubkey.begin(), pubkey.size());
+    if (!vchSig.empty())
+        hasher.Write(&vchSig[0], vchSig.size());
+    hasher.Finalize(buf);
+    memcpy(entry, buf, sizeof(buf));
+}
+
+bool CSignatureCache::Get(const uint64_t entry[4], bool fErase)
+{
+    if (nSize == 0)
         return false;
+    uint32_t slots[8];
+    GetSlots(entry, slots);
+    for (int i = 0; i < 8; i++) {
+        CEntry& slot = table[slots[i]];
+        if (Match(slot, entry)) {
+            if (fErase) {
+                // Fails harmlessly if an insert replaced the entry in the meantime
+                uint64_t n0 = entry[0];
+                slot.n[0].compare_exchange_strong(n0, 0, boost::memory_order_relaxed);
+            }
+            nHits.fetch_add(1, boost::memory_order_relaxed);
+            return true;
+        }
     }
+    nMisses.fetch_add(1, boost::memory_order_relaxed);
+    return false;
+}
+
+void CSignatureCache::Set(const uint64_t entryIn[4])
+{
+    boost::unique_lock<boost::mutex> lock(cs_insert);
+    if (nSize == 0)
+        return;
+    nInserts++;
+
+    uint64_t entry[4];
+    memcpy(entry, entryIn, sizeof(entry));
+    uint32_t slots[8];
+    uint32_t nLastSlot = nSize;
+    for (uint32_t nDepth = 0; nDepth < nMaxDepth; nDepth++) {
+        GetSlots(entry, slots);
+        for (int i = 0; i < 8; i++) {
+            if (IsFree(table[slots[i]]) || Match(table[slots[i]], entry)) {
+                Store(table[slots[i]], entry);
+                return;
+            }
+        }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        // All candidate slots are taken: displace one of their entries and
+        // find a new home for it. Never pick the slot the entry just came
+        // from, or two entries would keep swapping places.
+        int k = entry[3] & 7;
+        for (int i = 0; i < 8; i++) {
+            if (slots[i] == nLastSlot) {
+                k = (i + 1) & 7;
+                break;
+            }
         }
+        uint64_t displaced[4];
+        Load(table[slots[k]], displaced);
+        Store(table[slots[k]], entry);
+        memcpy(entry, displaced, sizeof(entry));
+        nLastSlot = slots[k];
+    }
+
+    // The last displaced entry falls out of the cache
+    nEvictions++;
+}
+
+void CSignatureCache::GetStats(CSignatureCacheStats& stats)
+{
+    boost::unique_lock<boost::mutex> lock(cs_insert);
+    stats.nHits = nHits.load(boost::memory_order_relaxed);
+    stats.nMisses = nMisses.load(boost::memory_order_relaxed);
+    stats.nInserts = nInserts;
+    stats.nEvictions = nEvictions;
+    stats.nCapacity = nSize;
+    stats.nBytes = (uint64_t)nSize * sizeof(CEntry);
+}
+
+namespace {
+
+CSignatureCache signatureCache;
+
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+void InitSignatureCache()
+{
+    uint64_t nBytes;
+    if (mapArgs.count("-maxsigcachesize") && !mapArgs.count("-sigcachesize")) {
+        // Before the cache was sized in MiB, -maxsigcachesize counted entries.
+        // Keep that meaning, rather than read an old 50000 as 50000 MiB.
+        int64_t nEntries = std::max((int64_t)0, std::min(GetArg("-maxsigcachesize", 0), (MAX_SIG_CACHE_SIZE << 20) / (int64_t)CSignatureCache::ENTRY_SIZE));
+        nBytes = (uint64_t)nEntries * CSignatureCache::ENTRY_SIZE;
+        LogPrintf("-maxsigcachesize is deprecated, use -sigcachesize=<n> in MiB instead\n");
+    } else {
+        int64_t nMaxCacheSize = std::max((int64_t)0, std::min(GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE), MAX_SIG_CACHE_SIZE));
+        nBytes = (uint64_t)nMaxCacheSize << 20;
     }
-};
+    // 32-bit builds can not address the largest sizes
+    nBytes = std::min(nBytes, (uint64_t)(std::numeric_limits<size_t>::max() / 2));
+    signatureCache.Setup((size_t)nBytes);
+    CSignatureCacheStats stats;
+    signatureCache.GetStats(stats);
+    LogPrintf("Using %u MiB for the signature cache, able to store %u entries\n", stats.nBytes >> 20, stats.nCapacity);
+}
 
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    signatureCache.GetStats(stats);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    uint64_t entry[4];
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // Signatures validated while connecting a block (store == false) are
+    // evicted on a hit, to make room for new mempool transactions.
+    if (signatureCache.Get(entry, !store))
         return true;
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store)
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
     return true;
 }
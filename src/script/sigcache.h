@@ -7,11 +7,127 @@
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
 #include "script/interpreter.h"
+#include "uint256.h"
 
+#include <stdint.h>
 #include <vector>
 
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Default size of the signature cache in MiB (-sigcachesize) */
+static const int64_t DEFAULT_SIG_CACHE_SIZE = 32;
+/** Maximum size of the signature cache in MiB */
+static const int64_t MAX_SIG_CACHE_SIZE = 16384;
+
 class CPubKey;
 
+/** Usage statistics of the signature cache, see GetSignatureCacheStats() */
+struct CSignatureCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+    uint64_t nCapacity;
+    uint64_t nBytes;
+};
+
+/**
+ * Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain)
+ *
+ * Entries are salted SHA256 hashes of (signature hash, public key, signature)
+ * stored in a fixed-size cuckoo hash table: every entry may live in one of
+ * eight slots derived from its own bits. The table is allocated once, so
+ * inserting never allocates.
+ *
+ * Lookups take no lock. The words of a slot are atomics, and a lookup only
+ * reports a hit if all four of them match. A concurrent insert can not make a
+ * torn slot match, as entries are unpredictable 256-bit values. Inserts are
+ * serialized by cs_insert.
+ */
+class CSignatureCache
+{
+private:
+    struct CEntry
+    {
+        boost::atomic<uint64_t> n[4];
+    };
+
+    //! Salt, so that an attacker can not predict which entries collide
+    uint256 nonce;
+    boost::scoped_array<CEntry> table;
+    uint32_t nSize;
+    //! Number of displacements after which an insert gives up
+    uint32_t nMaxDepth;
+
+    boost::mutex cs_insert;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+    boost::atomic<uint64_t> nHits;
+    boost::atomic<uint64_t> nMisses;
+
+    void GetSlots(const uint64_t entry[4], uint32_t slots[8]) const
+    {
+        for (int i = 0; i < 8; i++) {
+            uint32_t h = (uint32_t)(entry[i / 2] >> (32 * (i % 2)));
+            slots[i] = (uint32_t)(((uint64_t)h * nSize) >> 32);
+        }
+    }
+
+    bool Match(const CEntry& slot, const uint64_t entry[4]) const
+    {
+        for (int i = 0; i < 4; i++)
+            if (slot.n[i].load(boost::memory_order_relaxed) != entry[i])
+                return false;
+        return true;
+    }
+
+    //! A slot whose first word is zero is free (entries are erased by clearing it)
+    bool IsFree(const CEntry& slot) const
+    {
+        return slot.n[0].load(boost::memory_order_relaxed) == 0;
+    }
+
+    void Load(const CEntry& slot, uint64_t entry[4]) const
+    {
+        for (int i = 0; i < 4; i++)
+            entry[i] = slot.n[i].load(boost::memory_order_relaxed);
+    }
+
+    void Store(CEntry& slot, const uint64_t entry[4])
+    {
+        // Write the first word last, so the slot only stops looking free once complete
+        for (int i = 3; i >= 0; i--)
+            slot.n[i].store(entry[i], boost::memory_order_relaxed);
+    }
+
+public:
+    //! Memory taken by each entry of the table
+    static const size_t ENTRY_SIZE = sizeof(CEntry);
+
+    CSignatureCache() : nSize(0), nMaxDepth(0), nInserts(0), nEvictions(0), nHits(0), nMisses(0) {}
+
+    //! Allocate room for nBytes worth of entries. Not thread safe; call before use.
+    void Setup(size_t nBytes);
+
+    void ComputeEntry(uint64_t entry[4], const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const;
+
+    /**
+     * Look up an entry. With fErase, a hit also frees the slot: signatures
+     * checked as part of a block are unlikely to be needed again.
+     */
+    bool Get(const uint64_t entry[4], bool fErase);
+
+    //! Insert an entry, evicting an older one if all its slots are taken
+    void Set(const uint64_t entry[4]);
+
+    void GetStats(CSignatureCacheStats& stats);
+};
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -23,4 +139,11 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/**
+ * Allocate the signature cache according to -sigcachesize, or to
+ * -maxsigcachesize in entries. Must be called before script checking starts.
+ */
+void InitSignatureCache();
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -0,0 +1,132 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+CBlock RandomBlock(int nTx)
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = insecure_rand();
+    block.nNonce = insecure_rand();
+    for (int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = insecure_rand();
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+//! Append a block record to blk?????.dat the way WriteBlockToDisk does
+CDiskBlockPos AppendBlock(int nFile, const CBlock& block)
+{
+    CDiskBlockPos pos(nFile, 0);
+    FILE* file = fopen(GetBlockPosFilename(pos, "blk").string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    fseek(fileout.Get(), 0, SEEK_END);
+    unsigned int nSize = fileout.GetSerializeSize(block);
+    fileout << FLATDATA(Params().MessageStart()) << nSize;
+    pos.nPos = ftell(fileout.Get());
+    fileout << block;
+    return pos;
+}
+
+std::string Serialized(const CBlock& block)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    return ss.str();
+}
+}
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+BOOST_AUTO_TEST_CASE(blockfile_raw_reads)
+{
+    boost::filesystem::create_directories(GetBlockPosFilename(CDiskBlockPos(0, 0), "blk").parent_path());
+    CBlockFileCache cache(2);
+
+    // Blocks appended after their file was mapped are found too
+    std::vector<CBlock> vBlocks;
+    std::vector<CDiskBlockPos> vPos;
+    for (int i = 0; i < 20; i++) {
+        vBlocks.push_back(RandomBlock(1 + insecure_rand() % 50));
+        vPos.push_back(AppendBlock(900 + i % 3, vBlocks.back()));
+        CRawBlock raw;
+        BOOST_CHECK(cache.ReadRawBlock(vPos.back(), raw));
+        BOOST_CHECK(std::string(raw.begin(), raw.end()) == Serialized(vBlocks.back()));
+    }
+
+    // More files than mappings; a raw block outlives the eviction of its mapping
+    CRawBlock rawFirst;
+    BOOST_CHECK(cache.ReadRawBlock(vPos[0], rawFirst));
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        CRawBlock raw;
+        BOOST_CHECK(cache.ReadRawBlock(vPos[i], raw));
+        BOOST_CHECK(std::string(raw.begin(), raw.end()) == Serialized(vBlocks[i]));
+        cache.Forget(vPos[i].nFile);
+    }
+    BOOST_CHECK(std::string(rawFirst.begin(), rawFirst.end()) == Serialized(vBlocks[0]));
+
+    // Positions that don't hold a block
+    CRawBlock raw;
+    BOOST_CHECK(!cache.ReadRawBlock(CDiskBlockPos(900, 0), raw));
+    BOOST_CHECK(!cache.ReadRawBlock(CDiskBlockPos(900, vPos[0].nPos + 1), raw));
+    BOOST_CHECK(!cache.ReadRawBlock(CDiskBlockPos(950, 8), raw));
+
+    for (int nFile = 900; nFile < 903; nFile++)
+        boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_truncated)
+{
+    boost::filesystem::create_directories(GetBlockPosFilename(CDiskBlockPos(0, 0), "blk").parent_path());
+    CBlockFileCache cache(2);
+    CBlock block = RandomBlock(10);
+    CDiskBlockPos pos1 = AppendBlock(910, block);
+    CDiskBlockPos pos2 = AppendBlock(910, block);
+    boost::filesystem::path path = GetBlockPosFilename(pos1, "blk");
+
+    // Cut the file in the middle of the second block: the first still reads
+    boost::filesystem::resize_file(path, pos2.nPos + 10);
+    CRawBlock raw;
+    BOOST_CHECK(cache.ReadRawBlock(pos1, raw));
+    BOOST_CHECK(std::string(raw.begin(), raw.end()) == Serialized(block));
+    BOOST_CHECK(!cache.ReadRawBlock(pos2, raw));
+
+    // and before its header, and before the first block, as a file mapped anew
+    boost::filesystem::resize_file(path, pos2.nPos - 4);
+    cache.Forget(910);
+    BOOST_CHECK(!cache.ReadRawBlock(pos2, raw));
+    boost::filesystem::resize_file(path, pos1.nPos / 2);
+    cache.Forget(910);
+    BOOST_CHECK(!cache.ReadRawBlock(pos1, raw));
+    BOOST_CHECK(!cache.ReadRawBlock(pos2, raw));
+
+    // An index pointing far beyond the end of the file
+    BOOST_CHECK(!cache.ReadRawBlock(CDiskBlockPos(910, 1 << 20), raw));
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
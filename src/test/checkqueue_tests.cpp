@@ -0,0 +1,145 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static boost::atomic<int> nChecksRun(0);
+
+struct FakeCheck
+{
+    bool fOk;
+    FakeCheck(bool fOkIn = true) : fOk(fOkIn) {}
+    bool operator()()
+    {
+        nChecksRun++;
+        return fOk;
+    }
+    void swap(FakeCheck& x) { std::swap(fOk, x.fOk); }
+};
+
+class CheckQueueSetup
+{
+public:
+    CCheckQueue<FakeCheck> queue;
+    boost::thread_group threadGroup;
+
+    CheckQueueSetup() : queue(16, 4)
+    {
+        nChecksRun = 0;
+        // More workers than deques, so some have to share
+        for (int i = 0; i < 6; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<FakeCheck>::Thread, &queue));
+    }
+    ~CheckQueueSetup()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, CheckQueueSetup)
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_run)
+{
+    for (int n = 0; n < 1000; n += 37) {
+        nChecksRun = 0;
+        int nExpected = 0;
+        CCheckQueueControl<FakeCheck> control(&queue);
+        for (int i = 0; i < n; i++) {
+            vector<FakeCheck> vChecks(i % 5 + 1);
+            nExpected += vChecks.size();
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nChecksRun, nExpected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    for (int nFail = 0; nFail < 100; nFail += 9) {
+        CCheckQueueControl<FakeCheck> control(&queue);
+        for (int i = 0; i < 100; i++) {
+            vector<FakeCheck> vChecks(3);
+            if (i == nFail)
+                vChecks[1].fOk = false;
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(!control.Wait());
+    }
+}
+
+// A session can be filled and waited for while another one is in flight,
+// and a failure in one does not leak into the other.
+BOOST_AUTO_TEST_CASE(checkqueue_overlapping_sessions)
+{
+    for (int n = 0; n < 50; n++) {
+        CCheckQueueControl<FakeCheck> first(&queue);
+        CCheckQueueControl<FakeCheck> second(&queue);
+        for (int i = 0; i < 200; i++) {
+            vector<FakeCheck> vFirst(2);
+            vector<FakeCheck> vSecond(1, FakeCheck(!(n % 2 == 1 && i == 150)));
+            first.Add(vFirst);
+            second.Add(vSecond);
+        }
+        BOOST_CHECK(first.Wait());
+        BOOST_CHECK_EQUAL(second.Wait(), n % 2 == 0);
+    }
+}
+
+// Dropping a control without waiting must not leave work behind for a later session.
+BOOST_AUTO_TEST_CASE(checkqueue_abandoned_session)
+{
+    {
+        CCheckQueueControl<FakeCheck> control(&queue);
+        vector<FakeCheck> vChecks(500);
+        control.Add(vChecks);
+    }
+    nChecksRun = 0;
+    CCheckQueueControl<FakeCheck> control(&queue);
+    vector<FakeCheck> vChecks(10);
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nChecksRun, 10);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_run_parallel)
+{
+    for (int nThreads = 0; nThreads <= 4; nThreads++) {
+        nChecksRun = 0;
+        vector<FakeCheck> vChecks(100);
+        BOOST_CHECK(RunParallel(vChecks, nThreads));
+        BOOST_CHECK_EQUAL(nChecksRun, 100);
+
+        vChecks.assign(100, FakeCheck());
+        vChecks[50] = FakeCheck(false);
+        BOOST_CHECK(!RunParallel(vChecks, nThreads));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_pool)
+{
+    // One pool runs round after round, including after a failed one
+    CCheckQueuePool<FakeCheck> pool(4);
+    for (int i = 0; i < 10; i++) {
+        nChecksRun = 0;
+        vector<FakeCheck> vChecks(100);
+        if (i % 3 == 1)
+            vChecks[i] = FakeCheck(false);
+        BOOST_CHECK_EQUAL(pool.Run(vChecks), i % 3 != 1);
+        if (i % 3 != 1)
+            BOOST_CHECK_EQUAL(nChecksRun, 100);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
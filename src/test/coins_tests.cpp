@@ -4,6 +4,7 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
 
 #include <vector>
@@ -58,6 +59,57 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+// Allows writing records in the per-transaction layout of earlier versions
+class CCoinsViewDBLegacy : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBLegacy(size_t nStoredCacheSize = 1 << 23) : CCoinsViewDB(1 << 20, true, true, 0, nStoredCacheSize) {}
+
+    void WriteLegacy(const uint256& txid, const CCoins& coins)
+    {
+        db.Write(std::make_pair('c', txid), coins);
+    }
+
+    void WriteLegacyBestBlock(const uint256& hash)
+    {
+        db.Write('B', hash);
+    }
+
+    bool HaveLegacyBestBlock() const
+    {
+        return db.Exists('B');
+    }
+
+    size_t StoredSize() const
+    {
+        LOCK(cs_stored);
+        return mapStored.size();
+    }
+
+    size_t StoredUsage() const
+    {
+        LOCK(cs_stored);
+        return nStoredUsage;
+    }
+};
+
+CCoins RandomCoins(int nOutputs)
+{
+    CCoins coins;
+    coins.nVersion = 1 + insecure_rand() % 2;
+    coins.nHeight = insecure_rand() % 100000;
+    coins.fCoinBase = insecure_rand() % 2;
+    coins.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        // Leave some holes, but keep the last output
+        if (i + 1 < nOutputs && insecure_rand() % 3 == 0)
+            continue;
+        coins.vout[i].nValue = insecure_rand();
+        coins.vout[i].scriptPubKey.assign(insecure_rand() % 40, (unsigned char)i);
+    }
+    return coins;
+}
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -83,6 +135,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool prefetched_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
@@ -123,6 +176,18 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
             }
         }
 
+        // Once every 100 iterations, batch load some entries into the tip, which
+        // must not change what it represents.
+        if (insecure_rand() % 100 == 0) {
+            std::vector<uint256> prefetch;
+            for (unsigned int j = 0; j < 20; j++) {
+                prefetch.push_back(txids[insecure_rand() % txids.size()]);
+            }
+            if (stack.back()->Prefetch(prefetch) > 0) {
+                prefetched_an_entry = true;
+            }
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
             for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
@@ -173,6 +238,161 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(prefetched_an_entry);
+}
+
+// The chainstate stores outputs individually, and converts the layout of
+// earlier versions on Upgrade.
+BOOST_AUTO_TEST_CASE(coins_db_per_output)
+{
+    CCoinsViewDBLegacy db;
+    std::map<uint256, CCoins> mapExpected;
+    for (int i = 0; i < 100; i++) {
+        uint256 txid = GetRandHash();
+        mapExpected[txid] = RandomCoins(1 + insecure_rand() % 20);
+        db.WriteLegacy(txid, mapExpected[txid]);
+    }
+    uint256 hashBest = GetRandHash();
+    db.WriteLegacyBestBlock(hashBest);
+    BOOST_CHECK(db.GetBestBlock() == uint256(0));
+    BOOST_CHECK(db.Upgrade());
+    // The tip moved where earlier versions do not find it
+    BOOST_CHECK(db.GetBestBlock() == hashBest);
+    BOOST_CHECK(!db.HaveLegacyBestBlock());
+    // Nothing is left to convert
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.GetBestBlock() == hashBest);
+    for (std::map<uint256, CCoins>::const_iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK(db.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+    }
+
+    // Spend and add outputs through a cache; only the changes are written
+    {
+        CCoinsViewCache cache(&db);
+        for (std::map<uint256, CCoins>::iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+            CCoinsModifier coins = cache.ModifyCoins(it->first);
+            if (insecure_rand() % 4 == 0) {
+                while (!coins->vout.empty())
+                    coins->Spend(coins->vout.size() - 1);
+            } else {
+                coins->Spend(insecure_rand() % coins->vout.size());
+            }
+            it->second = *coins;
+        }
+        uint256 txid = GetRandHash();
+        mapExpected[txid] = RandomCoins(5);
+        *cache.ModifyCoins(txid) = mapExpected[txid];
+        BOOST_CHECK(cache.Flush());
+    }
+    // Spending one output of a transaction erases just that record (a
+    // one-byte prefix, the txid and the output index) and rewrites the header
+    // of the transaction (the prefix and txid, then at most its version,
+    // height and the three byte mask of unspent outputs)
+    {
+        uint256 txid = GetRandHash();
+        mapExpected[txid] = RandomCoins(20);
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txid) = mapExpected[txid];
+        BOOST_CHECK(cache.Flush());
+        mapExpected[txid].Spend(19);
+        cache.ModifyCoins(txid)->Spend(19);
+        // Reading the coins remembered what is stored, for the flush
+        BOOST_CHECK_EQUAL(db.StoredSize(), 1U);
+        uint64_t nBytesBefore = db.GetBytesWritten();
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(db.GetBytesWritten() - nBytesBefore <= (1U + 32 + 1) + (1U + 32) + (1 + 3 + 1 + 3));
+        BOOST_CHECK_EQUAL(db.StoredSize(), 0U);
+    }
+    // Without remembering, a flush looks up what is stored
+    {
+        std::map<uint256, CCoins>::iterator it = mapExpected.begin();
+        while (it->second.IsPruned())
+            it++;
+        CCoins coins;
+        BOOST_CHECK(db.GetCoins(it->first, coins));
+        CCoinsMap mapNone;
+        BOOST_CHECK(db.BatchWrite(mapNone, uint256(0)));
+        BOOST_CHECK_EQUAL(db.StoredSize(), 0U);
+        while (!coins.vout.empty())
+            coins.Spend(coins.vout.size() - 1);
+        CCoinsMap mapSpent;
+        mapSpent[it->first].coins = coins;
+        mapSpent[it->first].flags = CCoinsCacheEntry::DIRTY;
+        BOOST_CHECK(db.BatchWrite(mapSpent, uint256(0)));
+        it->second = coins;
+    }
+    for (std::map<uint256, CCoins>::const_iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(it->first, coins), !it->second.IsPruned());
+        BOOST_CHECK_EQUAL(db.HaveCoins(it->first), !it->second.IsPruned());
+        if (!it->second.IsPruned())
+            BOOST_CHECK(coins == it->second);
+    }
+}
+
+// Remembering what is stored stays within its memory bound; what is not
+// remembered is looked up when written
+BOOST_AUTO_TEST_CASE(coins_db_stored_bound)
+{
+    CCoinsViewDBLegacy db(2048);
+    std::map<uint256, CCoins> mapExpected;
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 100; i++) {
+            uint256 txid = GetRandHash();
+            mapExpected[txid] = RandomCoins(1 + insecure_rand() % 20);
+            *cache.ModifyCoins(txid) = mapExpected[txid];
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+    {
+        CCoinsViewCache cache(&db);
+        for (std::map<uint256, CCoins>::iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+            CCoinsModifier coins = cache.ModifyCoins(it->first);
+            coins->Spend(insecure_rand() % coins->vout.size());
+            it->second = *coins;
+        }
+        BOOST_CHECK(db.StoredSize() > 0);
+        BOOST_CHECK(db.StoredSize() < mapExpected.size());
+        BOOST_CHECK(db.StoredUsage() <= 2048);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(db.StoredUsage(), 0U);
+    }
+    for (std::map<uint256, CCoins>::const_iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(it->first, coins), !it->second.IsPruned());
+        if (!it->second.IsPruned())
+            BOOST_CHECK(coins == it->second);
+    }
+}
+
+// An earlier version does not find the tip of a converted chainstate and
+// rebuilds its own; converting that again drops the stale records.
+BOOST_AUTO_TEST_CASE(coins_db_rebuilt_by_earlier_version)
+{
+    CCoinsViewDBLegacy db;
+    uint256 txidStale = GetRandHash();
+    db.WriteLegacy(txidStale, RandomCoins(3));
+    db.WriteLegacyBestBlock(GetRandHash());
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.HaveCoins(txidStale));
+
+    // What the earlier version then writes
+    uint256 txid = GetRandHash();
+    CCoins coinsRebuilt = RandomCoins(4);
+    uint256 hashRebuilt = GetRandHash();
+    db.WriteLegacy(txid, coinsRebuilt);
+    db.WriteLegacyBestBlock(hashRebuilt);
+
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(!db.HaveCoins(txidStale));
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsRebuilt);
+    BOOST_CHECK(db.GetBestBlock() == hashRebuilt);
+    BOOST_CHECK(!db.HaveLegacyBestBlock());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
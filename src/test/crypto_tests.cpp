@@ -2,6 +2,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/common.h"
 #include "crypto/rfc6979_hmac_sha256.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
@@ -131,6 +132,46 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Every batch size up to a few rounds of the widest kernel, including the leftovers
+    for (int i = 0; i <= 32; i++) {
+        std::vector<unsigned char> in(64 * i), out1(32 * i), out2(32 * i);
+        for (int j = 0; j < 64 * i; j++)
+            in[j] = insecure_rand();
+        for (int j = 0; j < i; j++) {
+            unsigned char hash[CSHA256::OUTPUT_SIZE];
+            CSHA256().Write(&in[64 * j], 64).Finalize(hash);
+            CSHA256().Write(hash, CSHA256::OUTPUT_SIZE).Finalize(&out1[32 * j]);
+        }
+        if (i > 0)
+            SHA256D64(&out2[0], &in[0], i);
+        BOOST_CHECK(out1 == out2);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256d80)
+{
+    // Runs of nonces of every length up to a few rounds of the widest kernel,
+    // some of them wrapping around
+    unsigned char header[80];
+    for (int j = 0; j < 76; j++)
+        header[j] = insecure_rand();
+    CSHA256D80 hasher(header);
+    for (int i = 1; i <= 32; i++) {
+        uint32_t nNonce = (i % 2) ? insecure_rand() : 0xfffffff0;
+        std::vector<unsigned char> out1(32 * i), out2(32 * i);
+        for (int j = 0; j < i; j++) {
+            unsigned char hash[CSHA256::OUTPUT_SIZE];
+            WriteLE32(header + 76, nNonce + j);
+            CSHA256().Write(header, 80).Finalize(hash);
+            CSHA256().Write(hash, CSHA256::OUTPUT_SIZE).Finalize(&out1[32 * j]);
+        }
+        hasher.Hash(&out2[0], nNonce, i);
+        BOOST_CHECK(out1 == out2);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -0,0 +1,108 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "flatmap.h"
+
+#include "random.h"
+#include "util.h"
+
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+namespace
+{
+// A poor hash, so that probe sequences collide a lot
+struct PoorHasher
+{
+    size_t operator()(int n) const { return n % 61; }
+};
+
+typedef flatmap<int, string, PoorHasher> testmap;
+
+void CheckEqual(const testmap& fm, const map<int, string>& m)
+{
+    BOOST_CHECK_EQUAL(fm.size(), m.size());
+    size_t nSeen = 0;
+    for (testmap::const_iterator it = fm.begin(); it != fm.end(); it++) {
+        map<int, string>::const_iterator itm = m.find(it->first);
+        BOOST_CHECK(itm != m.end() && itm->second == it->second);
+        nSeen++;
+    }
+    BOOST_CHECK_EQUAL(nSeen, m.size());
+}
+}
+
+BOOST_AUTO_TEST_SUITE(flatmap_tests)
+
+// Random inserts, lookups and erases behave like std::map
+BOOST_AUTO_TEST_CASE(flatmap_like_map)
+{
+    testmap fm;
+    map<int, string> m;
+    for (int i = 0; i < 20000; i++) {
+        int k = insecure_rand() % 1000;
+        switch (insecure_rand() % 4) {
+        case 0:
+        case 1: {
+            string v = strprintf("%d", insecure_rand());
+            pair<testmap::iterator, bool> ret = fm.insert(make_pair(k, v));
+            BOOST_CHECK_EQUAL(ret.second, m.insert(make_pair(k, v)).second);
+            BOOST_CHECK_EQUAL(ret.first->first, k);
+            break;
+        }
+        case 2: {
+            testmap::iterator it = fm.find(k);
+            BOOST_CHECK_EQUAL(it != fm.end(), m.count(k) == 1);
+            if (it != fm.end()) {
+                fm.erase(it);
+                m.erase(k);
+            }
+            break;
+        }
+        case 3:
+            fm[k] += "x";
+            m[k] += "x";
+            BOOST_CHECK(fm.find(k)->second == m[k]);
+            break;
+        }
+        if (i % 1000 == 0)
+            CheckEqual(fm, m);
+    }
+    CheckEqual(fm, m);
+
+    // Erasing while iterating
+    for (testmap::iterator it = fm.begin(); it != fm.end();) {
+        if (it->first % 2)
+            m.erase(it->first);
+        if (it->first % 2)
+            fm.erase(it++);
+        else
+            it++;
+    }
+    CheckEqual(fm, m);
+
+    fm.clear();
+    BOOST_CHECK(fm.empty());
+    BOOST_CHECK(fm.begin() == fm.end());
+    BOOST_CHECK_EQUAL(fm.DynamicMemoryUsage(), 0U);
+}
+
+// Elements do not move when the table grows
+BOOST_AUTO_TEST_CASE(flatmap_stable_elements)
+{
+    testmap fm;
+    string* p = &fm[-1];
+    *p = "first";
+    for (int i = 0; i < 10000; i++)
+        fm[i] = "x";
+    BOOST_CHECK_EQUAL(p, &fm.find(-1)->second);
+    BOOST_CHECK_EQUAL(*p, "first");
+    BOOST_CHECK(fm.DynamicMemoryUsage() >= 10001 * sizeof(testmap::value_type));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,11 @@
 #include "primitives/transaction.h"
 #include "main.h"
 
+#include <set>
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(main_tests)
@@ -21,4 +26,73 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 192500000000000000ULL);
 }
 
+static CBlockFileInfo BlockFile(unsigned int nSize, unsigned int nUndoSize, unsigned int nHeightLast)
+{
+    CBlockFileInfo info;
+    info.AddBlock(nHeightLast, 0);
+    info.nSize = nSize;
+    info.nUndoSize = nUndoSize;
+    return info;
+}
+
+static std::set<int> Files(int nFirst, int nLast)
+{
+    std::set<int> setFiles;
+    for (int nFile = nFirst; nFile <= nLast; nFile++)
+        setFiles.insert(nFile);
+    return setFiles;
+}
+
+BOOST_AUTO_TEST_CASE(prune_select_files)
+{
+    // Five files of 100 bytes, 10 of them undo data, with 100 blocks each
+    std::vector<CBlockFileInfo> vinfo;
+    for (int i = 0; i < 5; i++)
+        vinfo.push_back(BlockFile(90, 10, 100 * (i + 1) - 1));
+    std::set<int> setPrune;
+
+    // Under the target, nothing goes
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, 4, 1000, 500, 0, 501, setPrune), 500U);
+    BOOST_CHECK(setPrune.empty());
+
+    // The oldest files go first, until the usage and buffer are under the target
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, 4, 1000, 500, 20, 350, setPrune), 300U);
+    BOOST_CHECK(setPrune == Files(0, 1));
+
+    // The file being written to is kept, however far over the target
+    setPrune.clear();
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, 4, 1000, 500, 0, 1, setPrune), 100U);
+    BOOST_CHECK(setPrune == Files(0, 3));
+
+    // and so are files with blocks in the reorganization window, and empty ones
+    setPrune.clear();
+    vinfo[1].SetNull();
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, 4, 250, 400, 0, 1, setPrune), 300U);
+    BOOST_CHECK(setPrune == Files(0, 0));
+}
+
+BOOST_AUTO_TEST_CASE(prune_unlink_files)
+{
+    std::set<int> setPrune;
+    for (int nFile = 920; nFile < 923; nFile++) {
+        FILE* file = fopen(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk").string().c_str(), "wb");
+        BOOST_REQUIRE(file);
+        fclose(file);
+        file = fopen(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "rev").string().c_str(), "wb");
+        BOOST_REQUIRE(file);
+        fclose(file);
+    }
+    setPrune.insert(920);
+    setPrune.insert(922);
+    UnlinkPrunedFiles(setPrune);
+    BOOST_CHECK(!boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(920, 0), "blk")));
+    BOOST_CHECK(!boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(920, 0), "rev")));
+    BOOST_CHECK(boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(921, 0), "blk")));
+    BOOST_CHECK(boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(921, 0), "rev")));
+    BOOST_CHECK(!boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(922, 0), "blk")));
+
+    boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(921, 0), "blk"));
+    boost::filesystem::remove(GetBlockPosFilename(CDiskBlockPos(921, 0), "rev"));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
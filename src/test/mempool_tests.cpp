@@ -3,10 +3,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
 #include <boost/test/unit_test.hpp>
+#include <limits>
 #include <list>
 
 BOOST_AUTO_TEST_SUITE(mempool_tests)
@@ -99,4 +101,243 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    std::list<CTransaction> removed;
+    int64_t nTime = 1000000;
+    SetMockTime(nTime);
+
+    // Three unrelated transactions paying 10000, 5000 and 20000 per kB,
+    // and a child of the cheapest one paying 30000 per kB
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = GetRandHash();
+        tx[i].vin[0].prevout.n = 0;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    tx[3].vin[0].prevout.hash = tx[1].GetHash();
+    CAmount nFeePerK[4] = { 10000, 5000, 20000, 30000 };
+    for (int i = 0; i < 4; i++) {
+        CTransaction t(tx[i]);
+        pool.addUnchecked(t.GetHash(), CTxMemPoolEntry(t, CFeeRate(nFeePerK[i]).GetFee(::GetSerializeSize(t, SER_NETWORK, PROTOCOL_VERSION)), i, 0.0, 1));
+    }
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() == 0);
+
+    // Fits: nothing happens
+    size_t nUsage = pool.DynamicMemoryUsage();
+    pool.TrimToSize(nUsage, removed);
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // One byte over: the cheapest package goes. The cheapest transaction
+    // stays, as its child pays for it.
+    pool.TrimToSize(nUsage - 1, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK(!pool.exists(tx[0].GetHash()));
+    BOOST_CHECK(pool.exists(tx[1].GetHash()));
+    BOOST_CHECK(pool.exists(tx[2].GetHash()));
+    BOOST_CHECK(pool.exists(tx[3].GetHash()));
+    removed.clear();
+
+    // New transactions now need the evicted fee rate plus the relay fee, until a block comes in
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(10000 + 1000));
+    std::vector<CTransaction> vtxNone;
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtxNone, 1, conflicts);
+    SetMockTime(nTime + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(5500));
+    SetMockTime(nTime + CTxMemPool::ROLLING_FEE_HALFLIFE * 3);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(1375));
+    // Dropped entirely once under half the relay fee
+    SetMockTime(nTime + CTxMemPool::ROLLING_FEE_HALFLIFE * 5);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+    SetMockTime(0);
+
+    // Entry times were 0 to 3: expiring the second takes its child with it
+    BOOST_CHECK_EQUAL(pool.Expire(2), 2);
+    BOOST_CHECK(!pool.exists(tx[1].GetHash()));
+    BOOST_CHECK(!pool.exists(tx[3].GetHash()));
+    BOOST_CHECK(pool.exists(tx[2].GetHash()));
+
+    // Everything gone, no memory left in use
+    pool.TrimToSize(0, removed);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+
+    // ... which raised the minimum fee, until the pool is cleared
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(20000 + 1000));
+    pool.clear();
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    std::list<CTransaction> removed;
+
+    // A chain: parent <- child <- grandchild, each with two outputs
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = i == 0 ? GetRandHash() : tx[i - 1].GetHash();
+        tx[i].vin[0].prevout.n = 0;
+        tx[i].vout.resize(2);
+        for (int j = 0; j < 2; j++) {
+            tx[i].vout[j].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx[i].vout[j].nValue = COIN;
+        }
+    }
+    CAmount nFee[3] = { 1000, 2000, 4000 };
+    int64_t nSize = ::GetSerializeSize(CTransaction(tx[0]), SER_NETWORK, PROTOCOL_VERSION);
+    for (int i = 0; i < 3; i++) {
+        CTransaction t(tx[i]);
+        BOOST_CHECK_EQUAL(::GetSerializeSize(t, SER_NETWORK, PROTOCOL_VERSION), nSize);
+        pool.addUnchecked(t.GetHash(), CTxMemPoolEntry(t, nFee[i], 0, 0.0, 1));
+    }
+
+    CTxMemPool::txiter it[3];
+    for (int i = 0; i < 3; i++)
+        it[i] = pool.mapTx.find(tx[i].GetHash());
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it[0]->GetSizeWithDescendants(), 3 * nSize);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 7000);
+    BOOST_CHECK_EQUAL(it[1]->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it[1]->GetModFeesWithDescendants(), 6000);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it[2]->GetSizeWithAncestors(), 3 * nSize);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 7000);
+    BOOST_CHECK_EQUAL(it[1]->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it[1]->GetModFeesWithAncestors(), 3000);
+    BOOST_CHECK(pool.GetMemPoolChildren(it[0]).count(it[1]));
+    BOOST_CHECK(pool.GetMemPoolParents(it[2]).count(it[1]));
+
+    // Limits on a fourth transaction spending the grandchild
+    CMutableTransaction txNext;
+    txNext.vin.resize(1);
+    txNext.vin[0].scriptSig = CScript() << OP_11;
+    txNext.vin[0].prevout.hash = tx[2].GetHash();
+    txNext.vin[0].prevout.n = 0;
+    txNext.vout.resize(2);
+    for (int j = 0; j < 2; j++) {
+        txNext.vout[j].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txNext.vout[j].nValue = COIN;
+    }
+    CTxMemPoolEntry entryNext(txNext, 8000, 0, 0.0, 1);
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string errString;
+    CTxMemPool::setEntries setAncestors;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entryNext, setAncestors, 4, nNoLimit, 4, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entryNext, setAncestors, 3, nNoLimit, nNoLimit, nNoLimit, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entryNext, setAncestors, nNoLimit, nNoLimit, 3, nNoLimit, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entryNext, setAncestors, nNoLimit, 4 * nSize - 1, nNoLimit, nNoLimit, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entryNext, setAncestors, nNoLimit, nNoLimit, nNoLimit, 4 * nSize - 1, errString));
+
+    // The parent confirms: its descendants stay, without it as an ancestor
+    pool.remove(CTransaction(tx[0]), removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK_EQUAL(it[1]->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it[1]->GetModFeesWithAncestors(), 2000);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it[2]->GetSizeWithAncestors(), 2 * nSize);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 6000);
+    BOOST_CHECK(pool.GetMemPoolParents(it[1]).empty());
+
+    // ... and comes back in a reorg
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], nFee[0], 0, 0.0, 1));
+    std::vector<uint256> vHashUpdate(1, tx[0].GetHash());
+    pool.UpdateTransactionsFromBlock(vHashUpdate);
+    it[0] = pool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 7000);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 7000);
+
+    // Removing the grandchild updates its ancestors' descendant state
+    pool.remove(CTransaction(tx[2]), removed, true);
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it[0]->GetSizeWithDescendants(), 2 * nSize);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 3000);
+    BOOST_CHECK_EQUAL(it[1]->GetCountWithDescendants(), 1);
+
+    // Recursive removal of the parent takes the child with it
+    pool.remove(CTransaction(tx[0]), removed, true);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPrioritiseTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    std::list<CTransaction> removed;
+
+    // A parent and child paying 1000 and 6000, an unrelated transaction
+    // paying 5000, and a fourth one that arrives later
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vin[0].prevout.hash = GetRandHash();
+        tx[i].vin[0].prevout.n = 0;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = COIN;
+    }
+    tx[1].vin[0].prevout.hash = tx[0].GetHash();
+    CAmount nFee[4] = { 1000, 6000, 5000, 100 };
+    for (int i = 0; i < 3; i++) {
+        CTransaction t(tx[i]);
+        pool.addUnchecked(t.GetHash(), CTxMemPoolEntry(t, nFee[i], 0, 0.0, 1));
+    }
+
+    // Prioritising the parent raises its package, and the child's ancestors
+    pool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0.0, 10000);
+    CTxMemPool::txiter it0 = pool.mapTx.find(tx[0].GetHash());
+    CTxMemPool::txiter it1 = pool.mapTx.find(tx[1].GetHash());
+    BOOST_CHECK_EQUAL(it0->GetFee(), 1000);
+    BOOST_CHECK_EQUAL(it0->GetModifiedFee(), 11000);
+    BOOST_CHECK_EQUAL(it0->GetModFeesWithDescendants(), 17000);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), 6000);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithAncestors(), 17000);
+
+    // A delta set before a transaction arrives counts from the start
+    pool.PrioritiseTransaction(tx[3].GetHash(), tx[3].GetHash().ToString(), 0.0, 20000);
+    CTransaction t3(tx[3]);
+    pool.addUnchecked(t3.GetHash(), CTxMemPoolEntry(t3, nFee[3], 0, 0.0, 1));
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx[3].GetHash());
+    BOOST_CHECK_EQUAL(it3->GetFee(), 100);
+    BOOST_CHECK_EQUAL(it3->GetModifiedFee(), 20100);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithDescendants(), 20100);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 20100);
+
+    // Without the deltas the parent and child would be evicted first
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK(!pool.exists(tx[2].GetHash()));
+    BOOST_CHECK(pool.exists(tx[0].GetHash()));
+    BOOST_CHECK(pool.exists(tx[1].GetHash()));
+    BOOST_CHECK(pool.exists(tx[3].GetHash()));
+    removed.clear();
+
+    // Taking the delta back restores the package state
+    pool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0.0, -10000);
+    BOOST_CHECK_EQUAL(it0->GetModifiedFee(), 1000);
+    BOOST_CHECK_EQUAL(it0->GetModFeesWithDescendants(), 7000);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithAncestors(), 7000);
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK(pool.exists(tx[3].GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
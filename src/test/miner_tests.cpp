@@ -8,6 +8,8 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <limits>
+
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(miner_tests)
@@ -257,6 +259,114 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     SetMockTime(0);
     mempool.clear();
 
+    // The cached template follows the mempool without rebuilding, at most
+    // every UPDATE_INTERVAL seconds
+    int64_t nNow = GetTime();
+    SetMockTime(nNow);
+    CBlockTemplateCache templatecache(scriptPubKey);
+    BOOST_CHECK(templatecache.Update());
+    BOOST_CHECK(!templatecache.Update());
+    BOOST_CHECK_EQUAL(templatecache.Get().block.vtx.size(), 1);
+    tx.vin[0].prevout.hash = txFirst[0]->GetHash();
+    tx.vin[0].nSequence = std::numeric_limits<uint32_t>::max();
+    tx.nLockTime = 0;
+    tx.vout[0].nValue = 4900000000LL;
+    hash = tx.GetHash();
+    tx2.vin[0].prevout.hash = hash;
+    tx2.vin[0].nSequence = std::numeric_limits<uint32_t>::max();
+    tx2.nLockTime = 0;
+    tx2.vout[0].nValue = 4800000000LL;
+    // A child paying for its parent: added together, parent first
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 1000, GetTime(), 111.0, 11));
+    mempool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 100000000LL, GetTime(), 111.0, 11));
+    BOOST_CHECK(!templatecache.Update());
+    SetMockTime(nNow += CBlockTemplateCache::UPDATE_INTERVAL);
+    BOOST_CHECK(templatecache.Update());
+    BOOST_CHECK(!templatecache.fLastUpdateRebuilt);
+    BOOST_CHECK_EQUAL(templatecache.Get().block.vtx.size(), 3);
+    BOOST_CHECK(templatecache.Get().block.vtx[1].GetHash() == hash);
+    BOOST_CHECK(templatecache.Get().block.vtx[2].GetHash() == tx2.GetHash());
+    BOOST_CHECK_EQUAL(templatecache.Get().vTxFees[0], -100001000LL);
+    {
+        CValidationState state;
+        BOOST_CHECK(TestBlockValidity(state, templatecache.Get().block, chainActive.Tip(), false, false));
+    }
+    // Both leave the template when the parent leaves the mempool
+    std::list<CTransaction> removed;
+    mempool.remove(tx, removed, true);
+    SetMockTime(nNow += CBlockTemplateCache::UPDATE_INTERVAL);
+    BOOST_CHECK(templatecache.Update());
+    BOOST_CHECK_EQUAL(templatecache.Get().block.vtx.size(), 1);
+    BOOST_CHECK_EQUAL(templatecache.Get().vTxFees[0], 0);
+    BOOST_CHECK_EQUAL(templatecache.nRebuilds, 1);
+    BOOST_CHECK_EQUAL(templatecache.nUpdates, 2);
+    // ... and is built from scratch again every REBUILD_INTERVAL seconds
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 1000, GetTime(), 111.0, 11));
+    SetMockTime(nNow += CBlockTemplateCache::REBUILD_INTERVAL);
+    BOOST_CHECK(templatecache.Update());
+    BOOST_CHECK(templatecache.fLastUpdateRebuilt);
+    BOOST_CHECK_EQUAL(templatecache.Get().block.vtx.size(), 2);
+    mempool.clear();
+
+    // Room for one transaction only, all of it sorted by fee
+    tx.vin[0].prevout.hash = txFirst[1]->GetHash();
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    tx.vout[0].nValue = txFirst[1]->vout[0].nValue - 10000;
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    mapArgs["-blockprioritysize"] = "0";
+    mapArgs["-blockmaxsize"] = i64tostr(1000 + nTxSize + 1);
+    hash = tx.GetHash();
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 10000, GetTime(), 111.0, 11));
+    SetMockTime(nNow += CBlockTemplateCache::UPDATE_INTERVAL);
+    BOOST_CHECK(templatecache.Update());
+    BOOST_CHECK_EQUAL(templatecache.Get().block.vtx.size(), 2);
+
+    // Mine the template: the new tip forces a rebuild without waiting
+    ModifiableParams()->setSkipProofOfWorkCheck(true);
+    {
+        CBlock block = templatecache.Get().block;
+        CMutableTransaction txCoinbase(block.vtx[0]);
+        txCoinbase.vin[0].scriptSig = CScript() << 1 << chainActive.Height();
+        block.vtx[0] = CTransaction(txCoinbase);
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        CValidationState state;
+        BOOST_CHECK(ProcessNewBlock(state, NULL, &block));
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    }
+    ModifiableParams()->setSkipProofOfWorkCheck(false);
+    BOOST_CHECK(!mempool.exists(hash));
+    tx.vin[0].prevout.hash = hash;
+    tx.vout[0].nValue -= 10000;
+    hash = tx.GetHash();
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 10000, GetTime(), 111.0, 11));
+    BOOST_CHECK(templatecache.Update());
+    BOOST_CHECK(templatecache.fLastUpdateRebuilt);
+    BOOST_CHECK_EQUAL(templatecache.Get().block.vtx.size(), 2);
+    BOOST_CHECK(templatecache.Get().block.vtx[1].GetHash() == hash);
+
+    // A better paying transaction that does not fit displaces it
+    tx2.vin[0].prevout.hash = txFirst[0]->GetHash();
+    tx2.vin[0].scriptSig = CScript() << OP_1;
+    tx2.vout[0].scriptPubKey = CScript() << OP_1;
+    tx2.vout[0].nValue = txFirst[0]->vout[0].nValue - 50000;
+    BOOST_CHECK_EQUAL(::GetSerializeSize(tx2, SER_NETWORK, PROTOCOL_VERSION), nTxSize);
+    mempool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 50000, GetTime(), 111.0, 11));
+    BOOST_CHECK(!templatecache.Update());
+    SetMockTime(nNow += CBlockTemplateCache::UPDATE_INTERVAL);
+    BOOST_CHECK(templatecache.Update());
+    BOOST_CHECK(templatecache.fLastUpdateRebuilt);
+    BOOST_CHECK_EQUAL(templatecache.Get().block.vtx.size(), 2);
+    BOOST_CHECK(templatecache.Get().block.vtx[1].GetHash() == tx2.GetHash());
+    {
+        CValidationState state;
+        BOOST_CHECK(TestBlockValidity(state, templatecache.Get().block, chainActive.Tip(), false, false));
+    }
+    mapArgs.erase("-blockprioritysize");
+    mapArgs.erase("-blockmaxsize");
+    SetMockTime(0);
+    mempool.clear();
+
     BOOST_FOREACH(CTransaction *tx, txFirst)
         delete tx;
 
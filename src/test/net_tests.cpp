@@ -0,0 +1,167 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include "random.h"
+#include "streams.h"
+#include "version.h"
+
+#include <limits>
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(latency_histogram)
+{
+    CLatencyHistogram histogram;
+    BOOST_CHECK_EQUAL(histogram.Percentile(0.5), 0);
+
+    histogram.Add(0);
+    histogram.Add(1);
+    histogram.Add(-5); // clock went backwards
+    histogram.Add(2);
+    histogram.Add(3);
+    histogram.Add(1000);
+    histogram.Add(std::numeric_limits<int64_t>::max() / 2);
+    BOOST_CHECK_EQUAL(histogram.nCount, 7U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[0], 3U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[1], 2U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[9], 1U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[CLatencyHistogram::BUCKETS - 1], 1U);
+    BOOST_CHECK_EQUAL(histogram.nMaxMicros, std::numeric_limits<int64_t>::max() / 2);
+
+    BOOST_CHECK_EQUAL(histogram.Percentile(0.1), 2);
+    BOOST_CHECK_EQUAL(histogram.Percentile(0.5), 4);
+    BOOST_CHECK_EQUAL(histogram.Percentile(0.8), 1024);
+    BOOST_CHECK_EQUAL(histogram.Percentile(1.0), histogram.nMaxMicros);
+}
+
+BOOST_AUTO_TEST_CASE(message_latencies)
+{
+    map<string, CLatencyHistogram> mapBefore;
+    GetMessageLatencies(mapBefore);
+
+    RecordMessageLatency("ping", 10);
+    RecordMessageLatency("ping", 20);
+    RecordMessageLatency("made-up", 30);
+
+    map<string, CLatencyHistogram> mapAfter;
+    GetMessageLatencies(mapAfter);
+    BOOST_CHECK_EQUAL(mapAfter["ping"].nCount, mapBefore["ping"].nCount + 2);
+    BOOST_CHECK_EQUAL(mapAfter["ping"].nTotalMicros, mapBefore["ping"].nTotalMicros + 30);
+    BOOST_CHECK_EQUAL(mapAfter["other"].nCount, mapBefore["other"].nCount + 1);
+    BOOST_CHECK(!mapAfter.count("made-up"));
+}
+
+BOOST_AUTO_TEST_CASE(net_buffer_pool)
+{
+    CNetBufferPool pool(1 << 20);
+
+    // Nothing pooled yet: small buffers are allocated at their class size
+    CSerializeData buf;
+    BOOST_CHECK(!pool.Get(buf, 100));
+    BOOST_CHECK_EQUAL(buf.capacity(), CNetBufferPool::CLASS_SIZE[0]);
+    buf.resize(100);
+    pool.Put(buf);
+    BOOST_CHECK(buf.empty());
+    BOOST_CHECK_EQUAL(pool.GetPooledBuffers(), 1U);
+    BOOST_CHECK(pool.Get(buf, 500));
+    BOOST_CHECK(buf.empty());
+    BOOST_CHECK(buf.capacity() >= 500);
+    BOOST_CHECK_EQUAL(pool.GetPooledBuffers(), 0U);
+
+    // Too small to be worth keeping
+    CSerializeData small;
+    small.reserve(10);
+    pool.Put(small);
+    BOOST_CHECK_EQUAL(pool.GetPooledBuffers(), 0U);
+
+    // A buffer in the class of the requested size is only used if it fits
+    CSerializeData other;
+    other.reserve(20000);
+    pool.Put(other);
+    other.reserve(17000);
+    pool.Put(other);
+    BOOST_CHECK_EQUAL(pool.GetPooledBuffers(), 2U);
+    BOOST_CHECK(pool.Get(buf, 18000));
+    BOOST_CHECK(buf.capacity() >= 18000);
+    BOOST_CHECK(!pool.Get(buf, 18000));
+    BOOST_CHECK_EQUAL(pool.GetPooledBuffers(), 1U);
+
+    // Large buffers aren't allocated ahead of the data
+    BOOST_CHECK(!pool.Get(buf, 500000));
+    BOOST_CHECK_EQUAL(buf.capacity(), 0U);
+
+    // The pool holds no more than its limit
+    for (int i = 0; i < 3; i++) {
+        other.reserve(400000);
+        pool.Put(other);
+    }
+    BOOST_CHECK_EQUAL(pool.GetPooledBuffers(), 3U);
+    BOOST_CHECK(pool.GetPooledBytes() <= 1 << 20);
+}
+
+static void WriteMessage(CDataStream& ss, const char* pszCommand, const std::vector<char>& vPayload)
+{
+    ss << CMessageHeader(pszCommand, vPayload.size());
+    ss.write(&vPayload[0], vPayload.size());
+}
+
+BOOST_AUTO_TEST_CASE(receive_messages)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0)));
+
+    std::vector<char> vBlock(300000), vPing(8);
+    for (size_t i = 0; i < vBlock.size(); i++)
+        vBlock[i] = insecure_rand();
+    for (size_t i = 0; i < vPing.size(); i++)
+        vPing[i] = insecure_rand();
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteMessage(ss, "block", vBlock);
+    WriteMessage(ss, "ping", vPing);
+
+    // The way the socket handler receives: straight into the message where
+    // there is room for a good part of it, through a copy otherwise
+    LOCK(node.cs_vRecvMsg);
+    size_t nPos = 0;
+    bool fDirect = false;
+    while (nPos < ss.size()) {
+        char* pch;
+        unsigned int nReserved = node.ReserveRecvBytes(pch);
+        if (nReserved >= 10000) {
+            unsigned int nBytes = std::min((size_t)nReserved, ss.size() - nPos);
+            memcpy(pch, &ss[nPos], nBytes);
+            node.CommitRecvBytes(nBytes);
+            nPos += nBytes;
+            fDirect = true;
+        } else {
+            unsigned int nBytes = std::min((size_t)1000, ss.size() - nPos);
+            BOOST_CHECK(node.ReceiveMsgBytes(&ss[nPos], nBytes));
+            nPos += nBytes;
+        }
+    }
+    BOOST_CHECK(fDirect);
+
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 2U);
+    BOOST_CHECK(node.vRecvMsg[0].complete());
+    BOOST_CHECK_EQUAL(node.vRecvMsg[0].hdr.GetCommand(), "block");
+    BOOST_CHECK(std::vector<char>(node.vRecvMsg[0].vRecv.begin(), node.vRecvMsg[0].vRecv.end()) == vBlock);
+    BOOST_CHECK(node.vRecvMsg[1].complete());
+    BOOST_CHECK_EQUAL(node.vRecvMsg[1].hdr.GetCommand(), "ping");
+    BOOST_CHECK(std::vector<char>(node.vRecvMsg[1].vRecv.begin(), node.vRecvMsg[1].vRecv.end()) == vPing);
+
+    // Their buffers are kept for the next messages
+    size_t nPooled = GetNetBufferPool().GetPooledBuffers();
+    node.EraseRecvMsgs(node.vRecvMsg.end());
+    BOOST_CHECK(node.vRecvMsg.empty());
+    BOOST_CHECK(GetNetBufferPool().GetPooledBuffers() > nPooled);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "netbase.h"
+#include "script/sigcache.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/test/unit_test.hpp>
@@ -139,6 +140,19 @@ BOOST_AUTO_TEST_CASE(rpc_parse_monetary_values)
     BOOST_CHECK_EQUAL(AmountFromValue(ValueFromString("20999999.99999999")), 2099999999999999LL);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_getsigcacheinfo)
+{
+    Value r;
+    BOOST_CHECK_THROW(CallRPC("getsigcacheinfo extra"), runtime_error);
+    BOOST_CHECK_NO_THROW(r = CallRPC("getsigcacheinfo"));
+    const Object& info = r.get_obj();
+    BOOST_CHECK(find_value(info, "hits").get_int64() >= 0);
+    BOOST_CHECK(find_value(info, "misses").get_int64() >= 0);
+    BOOST_CHECK(find_value(info, "evictions").get_int64() <= find_value(info, "inserts").get_int64());
+    BOOST_CHECK(find_value(info, "capacity").get_int64() > 0);
+    BOOST_CHECK_EQUAL(find_value(info, "bytes").get_int64(), DEFAULT_SIG_CACHE_SIZE << 20);
+}
+
 BOOST_AUTO_TEST_CASE(rpc_boostasiotocnetaddr)
 {
     // Check IPv4 addresses
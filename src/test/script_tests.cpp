@@ -102,6 +102,13 @@ void DoTest(const CScript& scriptPubKey, const CScript& scriptSig, int flags, bo
     CMutableTransaction tx2 = tx;
     BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, scriptPubKey, flags, MutableTransactionSignatureChecker(&tx, 0), &err) == expect, message);
     BOOST_CHECK_MESSAGE(expect == (err == SCRIPT_ERR_OK), std::string(ScriptErrorString(err)) + ": " + message);
+
+    // The OpenSSL verifier must agree with libsecp256k1 on every vector.
+    ScriptError errOpenSSL;
+    fVerifyOpenSSL = true;
+    BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, scriptPubKey, flags, MutableTransactionSignatureChecker(&tx, 0), &errOpenSSL) == expect, "OpenSSL: " + message);
+    fVerifyOpenSSL = false;
+    BOOST_CHECK_MESSAGE(err == errOpenSSL, std::string(ScriptErrorString(errOpenSSL)) + " (OpenSSL): " + message);
 #if defined(HAVE_CONSENSUS_LIB)
     CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
     stream << tx2;
@@ -0,0 +1,120 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "script/sigcache.h"
+
+#include "pubkey.h"
+#include "random.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+static void RandomEntry(const CSignatureCache& cache, uint64_t entry[4])
+{
+    std::vector<unsigned char> vchSig(72);
+    cache.ComputeEntry(entry, GetRandHash(), vchSig, CPubKey());
+}
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_insert_erase)
+{
+    CSignatureCache cache;
+    cache.Setup(CSignatureCache::ENTRY_SIZE * 1024);
+    uint64_t entry[4], other[4];
+    RandomEntry(cache, entry);
+    RandomEntry(cache, other);
+
+    BOOST_CHECK(!cache.Get(entry, false));
+    cache.Set(entry);
+    BOOST_CHECK(cache.Get(entry, false));
+    BOOST_CHECK(!cache.Get(other, false));
+
+    // Inserting again does not take a second slot, so one erase removes it
+    cache.Set(entry);
+    BOOST_CHECK(cache.Get(entry, true));
+    BOOST_CHECK(!cache.Get(entry, false));
+
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nHits, 2U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 3U);
+    BOOST_CHECK_EQUAL(stats.nInserts, 2U);
+    BOOST_CHECK_EQUAL(stats.nEvictions, 0U);
+    BOOST_CHECK_EQUAL(stats.nCapacity, 1024U);
+    BOOST_CHECK_EQUAL(stats.nBytes, CSignatureCache::ENTRY_SIZE * 1024);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_eviction)
+{
+    CSignatureCache cache;
+    cache.Setup(CSignatureCache::ENTRY_SIZE * 16);
+    std::vector<std::vector<uint64_t> > vEntries(200, std::vector<uint64_t>(4));
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        RandomEntry(cache, &vEntries[i][0]);
+        cache.Set(&vEntries[i][0]);
+    }
+
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nInserts, vEntries.size());
+    BOOST_CHECK(stats.nEvictions > 0);
+
+    // Every insert either found a slot or evicted exactly one entry
+    uint64_t nPresent = 0;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        if (cache.Get(&vEntries[i][0], false))
+            nPresent++;
+    BOOST_CHECK(nPresent <= 16);
+    BOOST_CHECK_EQUAL(nPresent, stats.nInserts - stats.nEvictions);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_empty)
+{
+    CSignatureCache cache;
+    cache.Setup(0);
+    uint64_t entry[4];
+    RandomEntry(cache, entry);
+    cache.Set(entry);
+    BOOST_CHECK(!cache.Get(entry, false));
+
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nCapacity, 0U);
+    BOOST_CHECK_EQUAL(stats.nInserts, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_size_options)
+{
+    CSignatureCacheStats stats;
+
+    // -maxsigcachesize still counts entries
+    mapArgs["-maxsigcachesize"] = "50000";
+    InitSignatureCache();
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK_EQUAL(stats.nCapacity, 50000U);
+
+    // -sigcachesize is in MiB, and wins over the old option
+    mapArgs["-sigcachesize"] = "1";
+    InitSignatureCache();
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBytes, 1U << 20);
+    BOOST_CHECK_EQUAL(stats.nCapacity, (1U << 20) / CSignatureCache::ENTRY_SIZE);
+
+    // Out of range values are clamped
+    mapArgs.erase("-maxsigcachesize");
+    mapArgs["-sigcachesize"] = "-1";
+    InitSignatureCache();
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK_EQUAL(stats.nCapacity, 0U);
+
+    mapArgs.erase("-sigcachesize");
+    InitSignatureCache();
+    GetSignatureCacheStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBytes, (uint64_t)DEFAULT_SIG_CACHE_SIZE << 20);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -148,6 +148,13 @@ BOOST_AUTO_TEST_CASE(tx_valid)
                                                  verify_flags, TransactionSignatureChecker(&tx, i), &err),
                                     strTest);
                 BOOST_CHECK_MESSAGE(err == SCRIPT_ERR_OK, ScriptErrorString(err));
+
+                // The OpenSSL verifier must agree with libsecp256k1
+                fVerifyOpenSSL = true;
+                BOOST_CHECK_MESSAGE(VerifyScript(tx.vin[i].scriptSig, mapprevOutScriptPubKeys[tx.vin[i].prevout],
+                                                 verify_flags, TransactionSignatureChecker(&tx, i), &err),
+                                    "OpenSSL: " + strTest);
+                fVerifyOpenSSL = false;
             }
         }
     }
@@ -221,6 +228,14 @@ BOOST_AUTO_TEST_CASE(tx_invalid)
                 unsigned int verify_flags = ParseScriptFlags(test[2].get_str());
                 fValid = VerifyScript(tx.vin[i].scriptSig, mapprevOutScriptPubKeys[tx.vin[i].prevout],
                                       verify_flags, TransactionSignatureChecker(&tx, i), &err);
+
+                // The OpenSSL verifier must agree with libsecp256k1
+                ScriptError errOpenSSL;
+                fVerifyOpenSSL = true;
+                bool fValidOpenSSL = VerifyScript(tx.vin[i].scriptSig, mapprevOutScriptPubKeys[tx.vin[i].prevout],
+                                                  verify_flags, TransactionSignatureChecker(&tx, i), &errOpenSSL);
+                fVerifyOpenSSL = false;
+                BOOST_CHECK_MESSAGE(fValid == fValidOpenSSL && err == errOpenSSL, "OpenSSL: " + strTest);
             }
             BOOST_CHECK_MESSAGE(!fValid, strTest);
             BOOST_CHECK_MESSAGE(err != SCRIPT_ERR_OK, ScriptErrorString(err));
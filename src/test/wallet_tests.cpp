@@ -4,6 +4,13 @@
 
 #include "wallet.h"
 
+#include "coinselection.h"
+#include "key.h"
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+
+#include <algorithm>
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -305,4 +312,339 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_exact_tests)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    // powers of two from 1 to 2^19 satoshi, and one big coin: every target
+    // below 2^20 has exactly one subset that makes it, which the search
+    // must find rather than settling for the big coin
+    empty_wallet();
+    for (int i = 0; i < 20; i++)
+        add_coin(1 << i);
+    add_coin(1 * COIN);
+    for (int i = 0; i < RUN_TESTS; i++)
+    {
+        CAmount nTarget = 1 + insecure_rand() % ((1 << 20) - 1);
+        BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, nTarget);
+    }
+
+    // a wallet with many more coins than the stochastic search visits in
+    // full still pays, and still finds exact matches
+    empty_wallet();
+    for (int i = 0; i < 20000; i++)
+        add_coin((3 + i % 7) * CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(1234 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 1234 * CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(1234 * CENT + 1, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_GT(nValueRet, 1234 * CENT);
+
+    // one selector answers for every fee it is asked about
+    CCoinSelector selector(vCoins, false);
+    for (int i = 0; i < 5; i++)
+    {
+        BOOST_CHECK(selector.Select((100 + i) * CENT, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, (100 + i) * CENT);
+    }
+    BOOST_CHECK(!selector.Select(200000 * CENT, setCoinsRet, nValueRet));
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(unspent_index_tests)
+{
+    CWallet wallet("wallet_unspent_tests.dat");
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(wallet.AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptOther = CScript() << OP_TRUE;
+    vector<COutput> vAvailable;
+
+    // Received in the tip block: two outputs of ours, and one that isn't
+    CMutableTransaction txReceive;
+    txReceive.vin.resize(1);
+    txReceive.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txReceive.vout.resize(3);
+    txReceive.vout[0] = CTxOut(1 * COIN, scriptMine);
+    txReceive.vout[1] = CTxOut(2 * COIN, scriptMine);
+    txReceive.vout[2] = CTxOut(4 * COIN, scriptOther);
+    CWalletTx wtxReceive(&wallet, txReceive);
+    wtxReceive.hashBlock = chainActive.Tip()->GetBlockHash();
+    wtxReceive.nIndex = 0;
+    wtxReceive.fMerkleVerified = true;
+    BOOST_CHECK(wallet.AddToWallet(wtxReceive));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 3 * COIN);
+    wallet.AvailableCoins(vAvailable);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 2U);
+
+    // A spend of the first output that is neither mined nor in the mempool
+    // doesn't count
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(wtxReceive.GetHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0] = CTxOut(1 * COIN, scriptOther);
+    BOOST_CHECK(wallet.AddToWallet(CWalletTx(&wallet, txSpend)));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 3 * COIN);
+    wallet.AvailableCoins(vAvailable);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 2U);
+
+    // Once it is mined, it does (its merkle branch isn't real)
+    wallet.mapWallet[txSpend.GetHash()].fMerkleVerified = true;
+    CWalletTx wtxSpend(&wallet, txSpend);
+    wtxSpend.hashBlock = chainActive.Tip()->GetBlockHash();
+    wtxSpend.nIndex = 1;
+    BOOST_CHECK(wallet.AddToWallet(wtxSpend));
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 2 * COIN);
+    wallet.AvailableCoins(vAvailable);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK(vAvailable[0].i == 1);
+
+    // and when its block is disconnected, it is synced again and doesn't
+    wallet.mapWallet[txSpend.GetHash()].hashBlock = GetRandHash();
+    wallet.SyncTransaction(txSpend, NULL);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 3 * COIN);
+    wallet.AvailableCoins(vAvailable);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(ismine_cache_tests)
+{
+    CWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+    CKey key;
+    key.MakeNewKey(true);
+
+    // Received to a key the wallet doesn't have yet
+    CMutableTransaction txReceive;
+    txReceive.vin.resize(1);
+    txReceive.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txReceive.vout.resize(1);
+    txReceive.vout[0] = CTxOut(1 * COIN, GetScriptForDestination(key.GetPubKey().GetID()));
+    BOOST_CHECK(wallet.AddToWallet(CWalletTx(&wallet, txReceive)));
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(txReceive.GetHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0] = CTxOut(1 * COIN, CScript() << OP_TRUE);
+    BOOST_CHECK(!wallet.IsFromMe(txSpend));
+
+    // Topping up the keypool keeps what is cached
+    unsigned int nGeneration = wallet.nKeysGeneration;
+    wallet.GenerateNewKey();
+    BOOST_CHECK_EQUAL(wallet.nKeysGeneration, nGeneration);
+
+    // Importing the key makes the cached IsMine stale without MarkDirty,
+    // as a rescan of the imported keys relies on
+    BOOST_CHECK(wallet.AddKeyPubKey(key, key.GetPubKey()));
+    BOOST_CHECK(wallet.IsFromMe(txSpend));
+    BOOST_CHECK_EQUAL(wallet.GetDebit(txSpend, ISMINE_SPENDABLE), 1 * COIN);
+
+    // and so does watching or no longer watching a script
+    CScript scriptWatch = CScript() << OP_TRUE;
+    txReceive.vout[0].scriptPubKey = scriptWatch;
+    txSpend.vin[0].prevout = COutPoint(txReceive.GetHash(), 0);
+    BOOST_CHECK(wallet.AddToWallet(CWalletTx(&wallet, txReceive)));
+    BOOST_CHECK(!wallet.IsFromMe(txSpend));
+    BOOST_CHECK(wallet.AddWatchOnly(scriptWatch));
+    BOOST_CHECK_EQUAL(wallet.GetDebit(txSpend, ISMINE_WATCH_ONLY), 1 * COIN);
+    BOOST_CHECK(wallet.RemoveWatchOnly(scriptWatch));
+    BOOST_CHECK_EQUAL(wallet.GetDebit(txSpend, ISMINE_WATCH_ONLY), 0);
+}
+
+BOOST_AUTO_TEST_CASE(rescan_tests)
+{
+    CWallet wallet("wallet_rescan_tests.dat");
+    CBlock genesis;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(ReadBlockFromDisk(genesis, chainActive.Genesis()));
+    }
+    const CTransaction& txGenesis = genesis.vtx[0];
+    std::string strError;
+
+    // Nothing in the chain is ours yet
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Genesis(), true, strError), 0);
+
+    // Watching the genesis output makes its coinbase pass the filter
+    {
+        LOCK(wallet.cs_wallet);
+        BOOST_CHECK(wallet.AddWatchOnly(txGenesis.vout[0].scriptPubKey));
+    }
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Genesis(), true, strError), 1);
+    BOOST_CHECK(wallet.mapWallet.count(txGenesis.GetHash()));
+
+    // Transactions the wallet has are only found again when updating
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Genesis(), false, strError), 0);
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Genesis(), true, strError), 1);
+
+    // A rescan that completed leaves nothing to resume
+    CRescanProgress progress = wallet.GetRescanProgress();
+    BOOST_CHECK(!progress.fScanning);
+    BOOST_CHECK_EQUAL(progress.nHeight, chainActive.Height());
+    CBlockLocator locator;
+    BOOST_CHECK(!CWalletDB(wallet.strWalletFile).ReadRescanProgress(locator));
+    BOOST_CHECK(strError.empty());
+    BOOST_CHECK(progress.strError.empty());
+
+    // A block that cannot be read, such as a pruned one, stops the rescan,
+    // which says so rather than skipping the block
+    {
+        LOCK(cs_main);
+        chainActive.Genesis()->nStatus &= ~BLOCK_HAVE_DATA;
+    }
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Genesis(), true, strError), 0);
+    BOOST_CHECK(!strError.empty());
+    progress = wallet.GetRescanProgress();
+    BOOST_CHECK(!progress.fScanning);
+    BOOST_CHECK_EQUAL(progress.strError, strError);
+    {
+        LOCK(cs_main);
+        chainActive.Genesis()->nStatus |= BLOCK_HAVE_DATA;
+    }
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Genesis(), true, strError), 1);
+    BOOST_CHECK(strError.empty());
+    BOOST_CHECK(wallet.GetRescanProgress().strError.empty());
+}
+
+BOOST_AUTO_TEST_CASE(receive_in_block_tests)
+{
+    // A new transaction found in a block is written in a batch, and ordering
+    // it then lists the wallet through a cursor, which must read inside that
+    // batch rather than wait on it
+    const std::string strFile = "wallet_receive_tests.dat";
+    CWallet wallet(strFile);
+    bool fFirstRun;
+    BOOST_CHECK(wallet.LoadWallet(fFirstRun) == DB_LOAD_OK);
+    CBlock genesis;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(ReadBlockFromDisk(genesis, chainActive.Genesis()));
+    }
+    const CTransaction& txGenesis = genesis.vtx[0];
+    {
+        LOCK(wallet.cs_wallet);
+        BOOST_CHECK(wallet.AddWatchOnly(txGenesis.vout[0].scriptPubKey));
+    }
+    wallet.SyncTransaction(txGenesis, &genesis);
+    BOOST_CHECK(wallet.mapWallet.count(txGenesis.GetHash()));
+
+    // and the batch committed it
+    vector<uint256> vTxHash;
+    vector<CWalletTx> vWtx;
+    BOOST_CHECK(CWalletDB(strFile).FindWalletTx(&wallet, vTxHash, vWtx) == DB_LOAD_OK);
+    BOOST_CHECK(std::find(vTxHash.begin(), vTxHash.end(), txGenesis.GetHash()) != vTxHash.end());
+}
+
+BOOST_AUTO_TEST_CASE(batch_tests)
+{
+    const std::string strFile = "wallet_batch_tests.dat";
+    CWalletDB(strFile, "cr+");
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyPool keypool(key.GetPubKey());
+    CKeyPool keypoolRead;
+
+    {
+        CWalletDBBatch batch(strFile);
+        BOOST_CHECK(batch.WritePool(1, keypool));
+
+        // Other handles the thread opens join the batch and see its writes
+        {
+            CWalletDB walletdb(strFile);
+            BOOST_CHECK(walletdb.ReadPool(1, keypoolRead));
+            BOOST_CHECK(keypoolRead.vchPubKey == keypool.vchPubKey);
+            BOOST_CHECK(walletdb.WritePool(2, keypool));
+        }
+
+        // So does a nested batch, which leaves the commit to the outer one
+        {
+            CWalletDBBatch batchInner(strFile);
+            BOOST_CHECK(batchInner.WritePool(3, keypool));
+            BOOST_CHECK(batchInner.Commit());
+        }
+        BOOST_CHECK_EQUAL(bitdb.mapBatchTxn.count(strFile), 1U);
+
+        // A transaction inside the batch can still be undone on its own
+        {
+            CWalletDB walletdb(strFile);
+            BOOST_CHECK(walletdb.TxnBegin());
+            BOOST_CHECK(walletdb.WritePool(4, keypool));
+            BOOST_CHECK(walletdb.TxnAbort());
+            BOOST_CHECK(!walletdb.ReadPool(4, keypoolRead));
+        }
+    }
+    BOOST_CHECK_EQUAL(bitdb.mapBatchTxn.count(strFile), 0U);
+
+    // Everything but the aborted write was committed when the batch ended
+    CWalletDB walletdb(strFile);
+    for (int64_t nIndex = 1; nIndex <= 3; nIndex++)
+        BOOST_CHECK(walletdb.ReadPool(nIndex, keypoolRead));
+    BOOST_CHECK(!walletdb.ReadPool(4, keypoolRead));
+}
+
+static void check_loaded_ismine(const std::string& strFile, const uint256& hash, isminetype mine0, isminetype mine1)
+{
+    CWallet wallet(strFile);
+    bool fFirstRun;
+    BOOST_CHECK(wallet.LoadWallet(fFirstRun) == DB_LOAD_OK);
+    LOCK(wallet.cs_wallet);
+    BOOST_REQUIRE(wallet.mapWallet.count(hash));
+    const CWalletTx& wtx = wallet.mapWallet[hash];
+    BOOST_CHECK(wtx.GetIsMine(0) == mine0);
+    BOOST_CHECK(wtx.GetIsMine(1) == mine1);
+    BOOST_CHECK_EQUAL(wtx.GetCredit(ISMINE_SPENDABLE), (mine0 ? wtx.vout[0].nValue : 0) + (mine1 ? wtx.vout[1].nValue : 0));
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_tests)
+{
+    const std::string strFile = "wallet_snapshot_tests.dat";
+    CKey key;
+    key.MakeNewKey(true);
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(2);
+    tx.vout[0] = CTxOut(1 * COIN, GetScriptForDestination(key.GetPubKey().GetID()));
+    tx.vout[1] = CTxOut(2 * COIN, CScript() << OP_TRUE);
+    const uint256 hash = tx.GetHash();
+    uint256 hashKeys;
+    {
+        CWallet wallet(strFile);
+        CWalletDB(strFile, "cr+");
+        LOCK2(cs_main, wallet.cs_wallet);
+        BOOST_CHECK(wallet.AddKeyPubKey(key, key.GetPubKey()));
+        BOOST_CHECK(wallet.AddToWallet(CWalletTx(&wallet, tx)));
+        BOOST_CHECK(wallet.WriteSnapshot());
+        hashKeys = wallet.GetKeyStoreHash();
+    }
+    check_loaded_ismine(strFile, hash, ISMINE_SPENDABLE, ISMINE_NO);
+
+    // What a snapshot of the same keys says is taken as it is
+    CWalletSnapshot snapshot;
+    snapshot.hashKeys = hashKeys;
+    vector<unsigned char> vIsMine;
+    vIsMine.push_back(ISMINE_NO);
+    vIsMine.push_back(ISMINE_SPENDABLE);
+    snapshot.vIsMine.push_back(make_pair(hash, vIsMine));
+    BOOST_CHECK(CWalletDB(strFile).WriteSnapshot(snapshot));
+    check_loaded_ismine(strFile, hash, ISMINE_NO, ISMINE_SPENDABLE);
+
+    // but not one of other keys, nor one whose transaction has other outputs
+    snapshot.hashKeys = GetRandHash();
+    BOOST_CHECK(CWalletDB(strFile).WriteSnapshot(snapshot));
+    check_loaded_ismine(strFile, hash, ISMINE_SPENDABLE, ISMINE_NO);
+
+    snapshot.hashKeys = hashKeys;
+    snapshot.vIsMine[0].second.push_back(ISMINE_SPENDABLE);
+    BOOST_CHECK(CWalletDB(strFile).WriteSnapshot(snapshot));
+    check_loaded_ismine(strFile, hash, ISMINE_SPENDABLE, ISMINE_NO);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
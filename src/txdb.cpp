@@ -5,40 +5,281 @@
 
 #include "txdb.h"
 
+#include "checkqueue.h"
+#include "memusage.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
+#include "utiltime.h"
 
+#include <cmath>
 #include <stdint.h>
 
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+/**
+ * The chainstate stores each transaction with unspent outputs as a header
+ * under DB_COINS_HEADER, which lists the unspent outputs, and one record per
+ * unspent output keyed by outpoint, so that spending an output of a
+ * transaction does not rewrite the others. Chainstates from earlier versions
+ * hold one CCoins per transaction under DB_COINS and their tip under
+ * DB_BEST_BLOCK_LEGACY; CCoinsViewDB::Upgrade converts them. The tip moves to
+ * a new key so that earlier versions do not mistake the converted chainstate
+ * for an empty one at their tip.
+ */
+static const char DB_COINS = 'c';
+static const char DB_COINS_HEADER = 'h';
+static const char DB_COIN_OUTPUT = 'o';
+static const char DB_BEST_BLOCK = 'T';
+static const char DB_BEST_BLOCK_LEGACY = 'B';
+
+namespace {
+
+bool IsBitSet(const std::vector<unsigned char> &vMask, uint32_t n)
+{
+    return n / 8 < vMask.size() && ((vMask[n / 8] >> (n % 8)) & 1);
+}
+
+struct CCoinsOutputKey
+{
+    uint256 txid;
+    uint32_t n;
+
+    CCoinsOutputKey() : n(0) {}
+    CCoinsOutputKey(const uint256 &txidIn, uint32_t nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        char chType = DB_COIN_OUTPUT;
+        READWRITE(chType);
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/** The metadata of a transaction, and which of its outputs are unspent. */
+struct CCoinsHeader
+{
+    int nVersion;
+    int nHeight;
+    bool fCoinBase;
+    //! Bit n is set if output n is unspent; no trailing zero bytes
+    std::vector<unsigned char> vMask;
+
+    CCoinsHeader() : nVersion(0), nHeight(0), fCoinBase(false) {}
+    explicit CCoinsHeader(const CCoins &coins) : nVersion(coins.nVersion), nHeight(coins.nHeight), fCoinBase(coins.fCoinBase) {
+        for (uint32_t n = 0; n < coins.vout.size(); n++) {
+            if (coins.vout[n].IsNull())
+                continue;
+            vMask.resize(n / 8 + 1, 0);
+            vMask[n / 8] |= 1 << (n % 8);
+        }
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(VARINT(this->nVersion));
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        nHeight = nCode / 2;
+        fCoinBase = nCode & 1;
+        READWRITE(vMask);
+    }
+};
+
+/**
+ * Queue the changes that turn the outputs listed as unspent in vStored into
+ * those of coins. An output does not change while it stays unspent, so only
+ * outputs that were spent or added are touched. Returns the number of
+ * outputs written or erased.
+ */
+size_t BatchWriteCoins(CLevelDBBatch &batch, const uint256 &txid, const CCoins &coins, const std::vector<unsigned char> &vStored)
+{
+    CCoinsHeader header(coins);
+    size_t nChanged = 0;
+    uint32_t nMax = std::max(header.vMask.size(), vStored.size()) * 8;
+    for (uint32_t n = 0; n < nMax; n++) {
+        bool fStored = IsBitSet(vStored, n);
+        if (IsBitSet(header.vMask, n) && !fStored) {
+            CTxOut out = coins.vout[n];
+            batch.Write(CCoinsOutputKey(txid, n), CTxOutCompressor(out));
+            nChanged++;
+        } else if (!IsBitSet(header.vMask, n) && fStored) {
+            batch.Erase(CCoinsOutputKey(txid, n));
+            nChanged++;
+        }
+    }
+    if (!header.vMask.empty())
+        batch.Write(make_pair(DB_COINS_HEADER, txid), header);
+    else if (!vStored.empty())
+        batch.Erase(make_pair(DB_COINS_HEADER, txid));
+    return nChanged;
+}
+
+/** Erase every record whose key, of type K, starts with chType. */
+template <typename K>
+bool EraseRecords(CLevelDBWrapper &db, char chType)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << chType;
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CLevelDBBatch batch;
+    for (pcursor->Seek(slPrefix); pcursor->Valid() && pcursor->key().starts_with(slPrefix); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        K key;
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            ssKey >> key;
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        batch.Erase(key);
+        if (batch.SizeEstimate() > (16 << 20)) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+        }
+    }
+    HandleError(pcursor->status());
+    return db.WriteBatch(batch, true);
+}
+
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
-    batch.Write('B', hash);
+    batch.Write(DB_BEST_BLOCK, hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+/** A single coins lookup, run on the CCoinsViewDB read threads. */
+class CCoinsReadJob
+{
+private:
+    const CCoinsViewDB *pview;
+    uint256 txid;
+    CCoins *pcoins;
+    char *pfFound;
+    boost::atomic<int64_t> *pnReadTime;
+
+public:
+    CCoinsReadJob() : pview(NULL), pcoins(NULL), pfFound(NULL), pnReadTime(NULL) {}
+    CCoinsReadJob(const CCoinsViewDB *pviewIn, const uint256 &txidIn, CCoins *pcoinsIn, char *pfFoundIn, boost::atomic<int64_t> *pnReadTimeIn) :
+        pview(pviewIn), txid(txidIn), pcoins(pcoinsIn), pfFound(pfFoundIn), pnReadTime(pnReadTimeIn) {}
+
+    bool operator()() {
+        int64_t nTimeStart = GetTimeMicros();
+        try {
+            *pfFound = pview->GetCoins(txid, *pcoins);
+        } catch (const std::runtime_error&) {
+            // Already logged by the wrapper; reported to the caller by GetCoinsBatch
+            return false;
+        }
+        pnReadTime->fetch_add(GetTimeMicros() - nTimeStart, boost::memory_order_relaxed);
+        return true;
+    }
+
+    void swap(CCoinsReadJob &job) {
+        std::swap(pview, job.pview);
+        std::swap(txid, job.txid);
+        std::swap(pcoins, job.pcoins);
+        std::swap(pfFound, job.pfFound);
+        std::swap(pnReadTime, job.pnReadTime);
+    }
+};
+
+/** Memory taken by remembering which outputs of a transaction are stored */
+static size_t StoredUsage(const std::vector<unsigned char> &vMask) {
+    return memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<const uint256, std::vector<unsigned char> > >)) + memusage::DynamicUsage(vMask);
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, int nReadThreads, size_t nStoredCacheSize) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), nBytesWritten(0), nStoredUsage(0), nMaxStoredUsage(nStoredCacheSize) {
+    if (nReadThreads > 1) {
+        preadqueue.reset(new CCheckQueue<CCoinsReadJob>(16, nReadThreads - 1));
+        preadthreads.reset(new boost::thread_group());
+        for (int i = 0; i < nReadThreads - 1; i++)
+            preadthreads->create_thread(boost::bind(&CCheckQueue<CCoinsReadJob>::Thread, preadqueue.get()));
+    }
+}
+
+CCoinsViewDB::~CCoinsViewDB() {
+    if (preadthreads) {
+        preadthreads->interrupt_all();
+        preadthreads->join_all();
+    }
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair('c', txid), coins);
+    CCoinsHeader header;
+    if (!db.Read(make_pair(DB_COINS_HEADER, txid), header))
+        return false;
+    coins.Clear();
+    coins.nVersion = header.nVersion;
+    coins.nHeight = header.nHeight;
+    coins.fCoinBase = header.fCoinBase;
+    coins.vout.resize(header.vMask.size() * 8);
+    for (uint32_t n = 0; n < coins.vout.size(); n++) {
+        if (!IsBitSet(header.vMask, n))
+            continue;
+        CTxOutCompressor out(coins.vout[n]);
+        if (!db.Read(CCoinsOutputKey(txid, n), out)) {
+            LogPrintf("LevelDB read failure: output %s:%u is missing\n", txid.ToString(), n);
+            throw leveldb_error("Database corrupted");
+        }
+    }
+    coins.Cleanup();
+    {
+        LOCK(cs_stored);
+        std::map<uint256, std::vector<unsigned char> >::iterator itStored = mapStored.find(txid);
+        if (itStored != mapStored.end()) {
+            nStoredUsage -= StoredUsage(itStored->second);
+            itStored->second.swap(header.vMask);
+            nStoredUsage += StoredUsage(itStored->second);
+        } else if (nStoredUsage + StoredUsage(header.vMask) <= nMaxStoredUsage) {
+            nStoredUsage += StoredUsage(header.vMask);
+            mapStored[txid].swap(header.vMask);
+        }
+    }
+    return true;
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair('c', txid));
+    return db.Exists(make_pair(DB_COINS_HEADER, txid));
+}
+
+void CCoinsViewDB::GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<CCoins> &vCoins, std::vector<char> &vFound) const {
+    if (!preadqueue || vTxid.size() < 2)
+        return CCoinsView::GetCoinsBatch(vTxid, vCoins, vFound);
+
+    int64_t nTimeStart = GetTimeMicros();
+    boost::atomic<int64_t> nReadTime(0);
+    vCoins.resize(vTxid.size());
+    vFound.assign(vTxid.size(), false);
+    std::vector<CCoinsReadJob> vJobs;
+    vJobs.reserve(vTxid.size());
+    for (size_t i = 0; i < vTxid.size(); i++)
+        vJobs.push_back(CCoinsReadJob(this, vTxid[i], &vCoins[i], &vFound[i], &nReadTime));
+    CCheckQueueControl<CCoinsReadJob> control(preadqueue.get());
+    control.Add(vJobs);
+    if (!control.Wait())
+        throw leveldb_error("Database read failure");
+    // The difference between the summed read times and the elapsed time is what reading in parallel saved
+    int64_t nElapsed = GetTimeMicros() - nTimeStart;
+    LogPrint("bench", "        - Read %u coins: %.2fms (%.2fms of reads, %.2fms hidden)\n", (unsigned int)vTxid.size(), 0.001 * nElapsed, 0.001 * nReadTime, 0.001 * std::max((int64_t)0, nReadTime - nElapsed));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256(0);
     return hashBestChain;
 }
@@ -47,9 +288,27 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
+    size_t outputs = 0;
+    size_t lookups = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            // Entries flagged FRESH have nothing stored yet. The others were
+            // read through GetCoins since the last flush, which remembered
+            // what is stored; only look it up if that was forgotten.
+            std::vector<unsigned char> vStored;
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH)) {
+                LOCK(cs_stored);
+                std::map<uint256, std::vector<unsigned char> >::iterator itStored = mapStored.find(it->first);
+                if (itStored != mapStored.end()) {
+                    vStored.swap(itStored->second);
+                } else {
+                    CCoinsHeader header;
+                    if (db.Read(make_pair(DB_COINS_HEADER, it->first), header))
+                        vStored.swap(header.vMask);
+                    lookups++;
+                }
+            }
+            outputs += BatchWriteCoins(batch, it->first, it->second.coins, vStored);
             changed++;
         }
         count++;
@@ -59,8 +318,17 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transactions (out of %u, %u outputs, %u lookups, %u bytes) to coin database...\n", (unsigned int)changed, (unsigned int)count, (unsigned int)outputs, (unsigned int)lookups, (unsigned int)batch.SizeEstimate());
+    nBytesWritten += batch.SizeEstimate();
+    bool fOk = db.WriteBatch(batch);
+    {
+        // What was remembered may be out of date now, and the caches that
+        // read it have been flushed
+        LOCK(cs_stored);
+        mapStored.clear();
+        nStoredUsage = 0;
+    }
+    return fOk;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
@@ -99,56 +367,144 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter &ss, const uint256 &txid, const CCoins &coins) {
+    ss << txid;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i=0; i<coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i+1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << DB_COINS_HEADER;
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    // The outputs are read along with a second cursor; both go in txid order
+    boost::scoped_ptr<leveldb::Iterator> poutputs(db.NewIterator());
+    pcursor->Seek(slPrefix);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
+    stats.nTotalAmount = 0;
+    for (; pcursor->Valid() && pcursor->key().starts_with(slPrefix); pcursor->Next()) {
         boost::this_thread::interruption_point();
+        uint256 txid;
+        CCoins coins;
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsHeader header;
+            ssValue >> header;
+            stats.nSerializedSize += slKey.size() + slValue.size();
+            coins.nVersion = header.nVersion;
+            coins.nHeight = header.nHeight;
+            coins.fCoinBase = header.fCoinBase;
+
+            CDataStream ssOutputs(SER_DISK, CLIENT_VERSION);
+            ssOutputs << DB_COIN_OUTPUT << txid;
+            leveldb::Slice slOutputs(&ssOutputs[0], ssOutputs.size());
+            for (poutputs->Seek(slOutputs); poutputs->Valid() && poutputs->key().starts_with(slOutputs); poutputs->Next()) {
+                leveldb::Slice slOutKey = poutputs->key();
+                CDataStream ssOutKey(slOutKey.data(), slOutKey.data()+slOutKey.size(), SER_DISK, CLIENT_VERSION);
+                CCoinsOutputKey key;
+                ssOutKey >> key;
+                if (key.n >= coins.vout.size())
+                    coins.vout.resize(key.n + 1);
+                leveldb::Slice slOutValue = poutputs->value();
+                CDataStream ssOutValue(slOutValue.data(), slOutValue.data()+slOutValue.size(), SER_DISK, CLIENT_VERSION);
+                ssOutValue >> REF(CTxOutCompressor(coins.vout[key.n]));
+                stats.nSerializedSize += slOutKey.size() + slOutValue.size();
             }
-            pcursor->Next();
         } catch (std::exception &e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
+        // Same as for the per-transaction layout of earlier versions
+        ApplyStats(stats, ss, txid, coins);
     }
+    HandleError(pcursor->status());
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    return true;
+}
+
+bool CCoinsViewDB::Upgrade() {
+    uint256 hashLegacyBest;
+    bool fLegacyBest = db.Read(DB_BEST_BLOCK_LEGACY, hashLegacyBest);
+    if (fLegacyBest && db.Exists(DB_BEST_BLOCK)) {
+        // Both tips are only there if an earlier version, unable to find the
+        // tip of the converted chainstate, rebuilt its own. Its records are
+        // the current ones; drop ours and convert again.
+        LogPrintf("The chainstate was rebuilt by an earlier version, converting it again\n");
+        if (!EraseRecords<std::pair<char, uint256> >(db, DB_COINS_HEADER) || !EraseRecords<CCoinsOutputKey>(db, DB_COIN_OUTPUT) || !db.Erase(DB_BEST_BLOCK, true))
+            return false;
+    }
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << DB_COINS;
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    pcursor->Seek(slPrefix);
+    if (!fLegacyBest && (!pcursor->Valid() || !pcursor->key().starts_with(slPrefix)))
+        return true;
+
+    LogPrintf("Upgrading the chainstate to the per-output layout...\n");
+    uiInterface.InitMessage(_("Upgrading UTXO database..."));
+    int64_t nStart = GetTimeMillis();
+    size_t nTransactions = 0;
+    size_t nOutputs = 0;
+    CLevelDBBatch batch;
+    // The tip moves in the first batch, so an earlier version started on a
+    // partly converted chainstate does not take it for its own.
+    if (fLegacyBest) {
+        BatchWriteHashBestChain(batch, hashLegacyBest);
+        batch.Erase(DB_BEST_BLOCK_LEGACY);
+    }
+    // Every transaction is converted and erased in the same batch, so an
+    // interrupted upgrade simply continues with the rest on the next start.
+    for (; pcursor->Valid() && pcursor->key().starts_with(slPrefix); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        uint256 txid;
+        CCoins coins;
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> coins;
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        nOutputs += BatchWriteCoins(batch, txid, coins, std::vector<unsigned char>());
+        batch.Erase(make_pair(DB_COINS, txid));
+        nTransactions++;
+        if (batch.SizeEstimate() > (16 << 20)) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+        }
+    }
+    HandleError(pcursor->status());
+    if (!db.WriteBatch(batch, true))
+        return false;
+    LogPrintf("Upgraded %u transactions to %u outputs in %dms\n", (unsigned int)nTransactions, (unsigned int)nOutputs, GetTimeMillis() - nStart);
     return true;
 }
 
@@ -175,15 +531,58 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+/** Hashes a range of block index entries read from disk and checks their proof of work. */
+class CBlockIndexHashJob
 {
+private:
+    CBlockIndex **ppindex;
+    const uint256 *phashPrev;
+    uint256 *phash;
+    size_t nCount;
+
+public:
+    CBlockIndexHashJob() : ppindex(NULL), phashPrev(NULL), phash(NULL), nCount(0) {}
+    CBlockIndexHashJob(CBlockIndex **ppindexIn, const uint256 *phashPrevIn, uint256 *phashIn, size_t nCountIn) :
+        ppindex(ppindexIn), phashPrev(phashPrevIn), phash(phashIn), nCount(nCountIn) {}
+
+    bool operator()() {
+        for (size_t i = 0; i < nCount; i++) {
+            const CBlockIndex *pindex = ppindex[i];
+            CBlockHeader header;
+            header.nVersion       = pindex->nVersion;
+            header.hashPrevBlock  = phashPrev[i];
+            header.hashMerkleRoot = pindex->hashMerkleRoot;
+            header.nTime          = pindex->nTime;
+            header.nBits          = pindex->nBits;
+            header.nNonce         = pindex->nNonce;
+            phash[i] = header.GetHash();
+            if (!CheckProofOfWork(phash[i], pindex->nBits))
+                return error("LoadBlockIndex() : CheckProofOfWork failed: %s", phash[i].ToString());
+        }
+        return true;
+    }
+
+    void swap(CBlockIndexHashJob &job) {
+        std::swap(ppindex, job.ppindex);
+        std::swap(phashPrev, job.phashPrev);
+        std::swap(phash, job.phash);
+        std::swap(nCount, job.nCount);
+    }
+};
+
+bool CBlockTreeDB::LoadBlockIndexGuts(int nThreads)
+{
+    int64_t nTimeStart = GetTimeMicros();
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
+    // Read all entries first; computing their hashes is the expensive part,
+    // and is done in parallel afterwards
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<uint256> vHashPrev;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -198,8 +597,7 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 ssValue >> diskindex;
 
                 // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+                CBlockIndex* pindexNew = NewBlockIndex();
                 pindexNew->nHeight        = diskindex.nHeight;
                 pindexNew->nFile          = diskindex.nFile;
                 pindexNew->nDataPos       = diskindex.nDataPos;
@@ -211,9 +609,8 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 pindexNew->nNonce         = diskindex.nNonce;
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
-
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                    return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
+                vIndex.push_back(pindexNew);
+                vHashPrev.push_back(diskindex.hashPrev);
 
                 pcursor->Next();
             } else {
@@ -223,6 +620,29 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    int64_t nTimeRead = GetTimeMicros();
+
+    std::vector<uint256> vHash(vIndex.size());
+    std::vector<CBlockIndexHashJob> vJobs;
+    static const size_t nJobSize = 1024;
+    for (size_t i = 0; i < vIndex.size(); i += nJobSize)
+        vJobs.push_back(CBlockIndexHashJob(&vIndex[i], &vHashPrev[i], &vHash[i], std::min(nJobSize, vIndex.size() - i)));
+    if (!RunParallel(vJobs, nThreads))
+        return false;
+    int64_t nTimeHash = GetTimeMicros();
+
+    // Add all entries to mapBlockIndex before linking them, so that only
+    // predecessors missing from the database get a placeholder
+    mapBlockIndex.rehash(std::ceil((mapBlockIndex.size() + vIndex.size()) / mapBlockIndex.max_load_factor()));
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        BlockMap::iterator mi = mapBlockIndex.insert(make_pair(vHash[i], vIndex[i])).first;
+        vIndex[i]->phashBlock = &((*mi).first);
+    }
+    for (size_t i = 0; i < vIndex.size(); i++)
+        vIndex[i]->pprev = InsertBlockIndex(vHashPrev[i]);
+    int64_t nTimeLink = GetTimeMicros();
 
+    LogPrintf("%s: read %u entries in %.2fms, hashed in %.2fms (%d threads), linked in %.2fms\n", __func__, (unsigned int)vIndex.size(),
+        0.001 * (nTimeRead - nTimeStart), 0.001 * (nTimeHash - nTimeRead), std::max(nThreads, 1), 0.001 * (nTimeLink - nTimeHash));
     return true;
 }
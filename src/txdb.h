@@ -14,9 +14,19 @@
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+
 class CCoins;
+class CCoinsReadJob;
 class uint256;
 
+namespace boost {
+class thread_group;
+}
+
+template <typename T>
+class CCheckQueue;
+
 //! -dbcache default (MiB)
 static const int64_t nDefaultDbCache = 100;
 //! max. -dbcache in (MiB)
@@ -29,14 +39,40 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+
+    //! Threads serving GetCoinsBatch, if any
+    boost::scoped_ptr<CCheckQueue<CCoinsReadJob> > preadqueue;
+    boost::scoped_ptr<boost::thread_group> preadthreads;
+
+    //! Key and value bytes handed to the database by BatchWrite so far
+    uint64_t nBytesWritten;
+
+    //! Which outputs are stored, for transactions read since the last
+    //! BatchWrite, so that writing does not need to read them again. Once
+    //! nStoredUsage reaches nMaxStoredUsage further reads are not remembered,
+    //! and BatchWrite looks those up.
+    mutable CCriticalSection cs_stored;
+    mutable std::map<uint256, std::vector<unsigned char> > mapStored;
+    mutable size_t nStoredUsage;
+    size_t nMaxStoredUsage;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    //! nReadThreads is the number of threads GetCoinsBatch reads with, including the caller's;
+    //! nStoredCacheSize bounds the memory used to remember what is stored
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, int nReadThreads = 0, size_t nStoredCacheSize = 1 << 23);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
+    void GetCoinsBatch(const std::vector<uint256> &vTxid, std::vector<CCoins> &vCoins, std::vector<char> &vFound) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+    uint64_t GetBytesWritten() const { return nBytesWritten; }
+
+    //! Convert a chainstate with one record per transaction, as written by
+    //! earlier versions, to one record per output, and move its tip to where
+    //! earlier versions do not look. Does nothing if there is nothing to convert.
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -59,7 +95,7 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts();
+    bool LoadBlockIndexGuts(int nThreads = 1);
 };
 
 #endif // BITCOIN_TXDB_H
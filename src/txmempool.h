@@ -7,12 +7,17 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -32,6 +37,11 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Each entry also caches the totals of its in-pool ancestors and
+ * descendants (all transactions it depends on, and all transactions that
+ * depend on it), including itself. CTxMemPool keeps these up to date as
+ * transactions are added and removed.
  */
 class CTxMemPoolEntry
 {
@@ -43,6 +53,18 @@ private:
     int64_t nTime; //! Local time when entering the mempool
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    size_t nUsageSize; //! ... and heap memory used by tx
+    CAmount feeDelta; //! Fee adjustment from prioritisetransaction
+
+    // Descendants of this transaction in the pool, which are removed along with it
+    uint64_t nCountWithDescendants; //! number of descendant transactions, including this one
+    uint64_t nSizeWithDescendants; //! ... and their total size
+    CAmount nModFeesWithDescendants; //! ... and their total modified fees (see GetModifiedFee)
+
+    // Ancestors of this transaction in the pool, which have to be mined before it
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -53,11 +75,132 @@ public:
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
+    //! The fee with the prioritisetransaction delta, which eviction and mining go by
+    CAmount GetModifiedFee() const { return nFee + feeDelta; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    //! Adjust the descendant state, when a descendant is added or removed
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    //! Adjust the ancestor state, when an ancestor is added or removed
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    //! Replace the prioritisetransaction delta; the caller updates the relatives
+    void UpdateFeeDelta(CAmount newFeeDelta);
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which only exposes const entries
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    CAmount modifyFee;
+    int64_t modifyCount;
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    CAmount modifyFee;
+    int64_t modifyCount;
+};
+
+struct update_fee_delta
+{
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+
+/** Extracts the transaction hash of a mempool entry, for indexing. */
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/**
+ * Sort entries by the higher of their own fee rate and the fee rate of
+ * the package of them and their descendants, lowest first. Evicting the
+ * first entry with its descendants thus loses the least fees per byte,
+ * while a parent that a child pays for is kept. Fees are the modified ones,
+ * so prioritisetransaction protects a transaction from eviction.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        bool fUseADescendants = UseDescendantScore(a);
+        bool fUseBDescendants = UseDescendantScore(b);
+
+        double aFees = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+        double bFees = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        // Cross-multiply instead of dividing (in double, as fee * size may overflow)
+        double f1 = aFees * bSize;
+        double f2 = bFees * aSize;
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 < f2;
+    }
+
+    //! Whether the package fee rate is higher than the entry's own
+    bool UseDescendantScore(const CTxMemPoolEntry& a) const
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+        return f2 > f1;
+    }
 };
 
+/** Sort entries by the time they entered the pool, oldest first. */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        if (a.GetTime() == b.GetTime())
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+// Multi-index tags
+struct descendant_score {};
+struct entry_time {};
+
 class CMinerPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -92,10 +235,79 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+
+    //! Fee rate (per kB) transactions must pay after the pool was trimmed, decaying over time
+    mutable double rollingMinimumFeeRate;
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
+    //! Time for the rolling minimum fee rate to halve, in seconds
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+    /**
+     * Entries are indexed by:
+     * - transaction hash
+     * - descendant score, for evicting the cheapest packages when the pool is full
+     * - entry time, for expiring old transactions
+     */
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by fee rate with descendants
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime
+            >
+        >
+    > indexed_transaction_set;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
+
+    typedef indexed_transaction_set::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+private:
+    //! The in-pool parents and children of each entry
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    //! Add or remove entry as a child of its parents, and from the descendant state of its ancestors
+    void UpdateAncestorsOf(bool add, txiter entry, const setEntries &setAncestors);
+    //! Set the ancestor state of a new entry
+    void UpdateEntryForAncestors(txiter entry, const setEntries &setAncestors);
+    //! Update the cached state of everything related to the entries about to be removed
+    void UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants);
+    //! Unlink the children of an entry about to be removed
+    void UpdateChildrenForRemoval(txiter entry);
+    //! Remove an entry whose relatives were already updated
+    void removeUnchecked(txiter entry);
+
+public:
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
@@ -111,6 +323,12 @@ public:
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /**
+     * Add an entry whose in-pool ancestors were computed with
+     * CalculateMemPoolAncestors. The short form computes them itself,
+     * without limits.
+     */
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, const setEntries &setAncestors);
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight);
@@ -123,11 +341,32 @@ public:
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
-    /** Affect CreateNewBlock prioritisation of transactions */
+    /**
+     * Affect CreateNewBlock prioritisation of transactions. The fee delta
+     * also counts for eviction, and for a transaction already in the pool
+     * updates the package state of its relatives.
+     */
     void PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta);
     void ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    /**
+     * The minimum fee rate to get into the pool, which is raised above the
+     * relay fee while the pool is full. It decays back as long as blocks
+     * keep coming, faster when the pool is well below sizelimit.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /**
+     * Remove the transactions with the lowest fee rate, along with the
+     * transactions spending them, until the pool uses at most sizelimit
+     * bytes of memory.
+     */
+    void TrimToSize(size_t sizelimit, std::list<CTransaction>& removed);
+
+    /** Remove transactions that entered the pool before time, and their descendants. Returns the number removed. */
+    int Expire(int64_t time);
+
     unsigned long size()
     {
         LOCK(cs);
@@ -147,6 +386,36 @@ public:
 
     bool lookup(uint256 hash, CTransaction& result) const;
 
+    /** Heap memory used by the pool: its entries and indexes. */
+    size_t DynamicMemoryUsage() const;
+
+    /**
+     * Find all in-pool ancestors of an entry, failing if that or adding the
+     * entry would exceed any of the limits. With fSearchForParents the
+     * entry's parents are looked up by its inputs, otherwise it has to be
+     * in the pool already.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors,
+                                   uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                   uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                   std::string &errString, bool fSearchForParents = true) const;
+
+    /** Add an entry and all its in-pool descendants to setDescendants. */
+    void CalculateDescendants(txiter it, setEntries &setDescendants) const;
+
+    /** Remove a set of entries, which has to include all their descendants unless updateDescendants is set. */
+    void RemoveStaged(const setEntries &stage, bool updateDescendants, std::list<CTransaction>& removed);
+
+    /**
+     * After transactions of a disconnected block were added back, link
+     * them to the pool transactions already spending them. vHashesToUpdate
+     * is in block order.
+     */
+    void UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate);
+
+    const setEntries & GetMemPoolParents(txiter entry) const;
+    const setEntries & GetMemPoolChildren(txiter entry) const;
+
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
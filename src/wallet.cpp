@@ -7,7 +7,11 @@
 
 #include "base58.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
+#include "coinselection.h"
+#include "hash.h"
+#include "init.h"
 #include "net.h"
 #include "script/script.h"
 #include "script/sign.h"
@@ -18,6 +22,7 @@
 #include <assert.h>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -43,15 +48,6 @@ CFeeRate CWallet::minTxFee = CFeeRate(1000);
  * @{
  */
 
-struct CompareValueOnly
-{
-    bool operator()(const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 std::string COutput::ToString() const
 {
     return strprintf("COutput(%s, %d, %d) [%s]", tx->GetHash().ToString(), i, nDepth, FormatMoney(tx->vout[i].nValue));
@@ -88,8 +84,12 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
+    // A fresh key can not match any output the wallet has seen, so the
+    // cached IsMine of its transactions stays valid
+    unsigned int nGeneration = nKeysGeneration;
     if (!AddKeyPubKey(secret, pubkey))
         throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
+    nKeysGeneration = nGeneration;
     return pubkey;
 }
 
@@ -98,6 +98,7 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    nKeysGeneration++;
 
     // check if we need to remove from watch-only
     CScript script;
@@ -155,6 +156,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    nKeysGeneration++;
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -180,6 +182,7 @@ bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    nKeysGeneration++;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
@@ -192,6 +195,7 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    nKeysGeneration++;
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
@@ -417,6 +421,64 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+void CWallet::UpdateUnspent(const COutPoint& outpoint)
+{
+    AssertLockHeld(cs_main);
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    bool fUnspent = mi != mapWallet.end() && outpoint.n < mi->second.vout.size() &&
+                    mi->second.GetIsMine(outpoint.n) != ISMINE_NO;
+    if (fUnspent)
+    {
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(outpoint);
+        for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+        {
+            std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+            if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0)
+            {
+                fUnspent = false;
+                break;
+            }
+        }
+    }
+    if (fUnspent)
+        setUnspent.insert(outpoint);
+    else
+        setUnspent.erase(outpoint);
+}
+
+void CWallet::UpdateUnspent(const CWalletTx& wtx)
+{
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        UpdateUnspent(COutPoint(hash, i));
+    if (!wtx.IsCoinBase())
+    {
+        // What the outputs it spends leave available changes too
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+        {
+            UpdateUnspent(txin.prevout);
+            std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(txin.prevout.hash);
+            if (mi != mapWallet.end())
+                mi->second.MarkDirty();
+        }
+    }
+    fBalancesCached = false;
+}
+
+void CWallet::RebuildUnspent(bool fKeysChanged)
+{
+    LOCK2(cs_main, cs_wallet);
+    setUnspent.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        if (fKeysChanged)
+            it->second.vIsMineCached.clear();
+        for (unsigned int i = 0; i < it->second.vout.size(); i++)
+            UpdateUnspent(COutPoint(it->first, i));
+    }
+    fBalancesCached = false;
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -554,6 +616,8 @@ void CWallet::MarkDirty()
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
     }
+    // Called when keys were added, so outputs we had not counted may now be ours
+    RebuildUnspent();
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
@@ -659,6 +723,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        UpdateUnspent(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -693,6 +758,11 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
             // Get merkle branch if transaction was found in a block
             if (pblock)
                 wtx.SetMerkleBranch(*pblock);
+            // A transaction found in a block is found again by rescanning
+            // from the best block the wallet recorded last, and recording
+            // that waits for the log, so the flush thread can make a whole
+            // block's worth of them durable at once
+            boost::scoped_ptr<CWalletDBBatch> pwalletdb(fFileBacked && pblock ? new CWalletDBBatch(strWalletFile, false) : NULL);
             return AddToWallet(wtx);
         }
     }
@@ -720,9 +790,15 @@ void CWallet::EraseFromWallet(const uint256 &hash)
     if (!fFileBacked)
         return;
     {
-        LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        LOCK2(cs_main, cs_wallet);
+        std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            CWalletTx wtx = mi->second;
+            mapWallet.erase(mi);
+            UpdateUnspent(wtx);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -737,7 +813,7 @@ isminetype CWallet::IsMine(const CTxIn &txin) const
         {
             const CWalletTx& prev = (*mi).second;
             if (txin.prevout.n < prev.vout.size())
-                return IsMine(prev.vout[txin.prevout.n]);
+                return prev.GetIsMine(txin.prevout.n);
         }
     }
     return ISMINE_NO;
@@ -752,13 +828,29 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
         {
             const CWalletTx& prev = (*mi).second;
             if (txin.prevout.n < prev.vout.size())
-                if (IsMine(prev.vout[txin.prevout.n]) & filter)
+                if (prev.GetIsMine(txin.prevout.n) & filter)
                     return prev.vout[txin.prevout.n].nValue;
         }
     }
     return 0;
 }
 
+CAmount CWallet::GetCredit(const CWalletTx& wtx, const isminefilter& filter) const
+{
+    CAmount nCredit = 0;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        const CTxOut& txout = wtx.vout[i];
+        if (!MoneyRange(txout.nValue))
+            throw std::runtime_error("CWallet::GetCredit() : value out of range");
+        if (wtx.GetIsMine(i) & filter)
+            nCredit += txout.nValue;
+        if (!MoneyRange(nCredit))
+            throw std::runtime_error("CWallet::GetCredit() : value out of range");
+    }
+    return nCredit;
+}
+
 bool CWallet::IsChange(const CTxOut& txout) const
 {
     // TODO: fix handling of 'change' outputs. The assumption is that any
@@ -781,6 +873,16 @@ bool CWallet::IsChange(const CTxOut& txout) const
     return false;
 }
 
+void CWalletTx::CacheIsMine() const
+{
+    if (vIsMineCached.size() == vout.size() && nIsMineGeneration == pwallet->nKeysGeneration)
+        return;
+    nIsMineGeneration = pwallet->nKeysGeneration;
+    vIsMineCached.resize(vout.size());
+    for (unsigned int i = 0; i < vout.size(); i++)
+        vIsMineCached[i] = pwallet->IsMine(vout[i]);
+}
+
 int64_t CWalletTx::GetTxTime() const
 {
     int64_t n = nTimeSmart;
@@ -927,12 +1029,161 @@ bool CWalletTx::WriteToDisk()
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  */
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+namespace
+{
+/**
+ * A copy of what can make a transaction the wallet's: the ids of its keys and
+ * scripts, its watch-only scripts and the transactions it has. It is read
+ * without locks, so blocks can be matched against it in parallel, and it errs
+ * towards a match: AddToWalletIfInvolvingMe still decides about the
+ * transactions that pass.
+ */
+class CWalletScanFilter
 {
+private:
+    std::vector<uint160> vIDs;
+    std::vector<uint256> vTxids;
+    std::set<CScript> setWatchOnly;
+
+    bool HaveID(const uint160& id) const
+    {
+        return std::binary_search(vIDs.begin(), vIDs.end(), id);
+    }
+
+    bool HaveTx(const uint256& hash) const
+    {
+        return std::binary_search(vTxids.begin(), vTxids.end(), hash);
+    }
+
+    bool IsRelevant(const CTxOut& txout) const
+    {
+        if (setWatchOnly.count(txout.scriptPubKey))
+            return true;
+
+        std::vector<std::vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        if (!Solver(txout.scriptPubKey, whichType, vSolutions))
+            return false;
+        switch (whichType)
+        {
+        case TX_PUBKEY:
+            return HaveID(CPubKey(vSolutions[0]).GetID());
+        case TX_PUBKEYHASH:
+        case TX_SCRIPTHASH:
+            return HaveID(uint160(vSolutions[0]));
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                if (HaveID(CPubKey(vSolutions[i]).GetID()))
+                    return true;
+            return false;
+        default:
+            return false;
+        }
+    }
+
+public:
+    CWalletScanFilter(const std::set<CKeyID>& setKeys, const std::set<CScriptID>& setScripts,
+                      const std::set<CScript>& setWatchOnlyIn, const std::map<uint256, CWalletTx>& mapWallet) :
+        setWatchOnly(setWatchOnlyIn)
+    {
+        vIDs.reserve(setKeys.size() + setScripts.size());
+        vIDs.insert(vIDs.end(), setKeys.begin(), setKeys.end());
+        vIDs.insert(vIDs.end(), setScripts.begin(), setScripts.end());
+        std::sort(vIDs.begin(), vIDs.end());
+
+        vTxids.reserve(mapWallet.size());
+        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            vTxids.push_back(it->first);
+
+        // Solver fills its table of templates on first use: have that happen
+        // here rather than on several threads at once
+        std::vector<std::vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        Solver(CScript(), whichType, vSolutions);
+    }
+
+    //! Add a transaction found by the scan, once no block is being matched
+    void AddTx(const uint256& hash)
+    {
+        std::vector<uint256>::iterator it = std::lower_bound(vTxids.begin(), vTxids.end(), hash);
+        if (it == vTxids.end() || *it != hash)
+            vTxids.insert(it, hash);
+    }
+
+    bool IsRelevant(const CTransaction& tx) const
+    {
+        if (HaveTx(tx.GetHash()))
+            return true;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (HaveTx(txin.prevout.hash))
+                return true;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            if (IsRelevant(txout))
+                return true;
+        return false;
+    }
+};
+
+/** Reads one block of a rescan and lists the transactions in it that pass the filter. */
+class CWalletScanJob
+{
+private:
+    CDiskBlockPos pos;
+    uint256 hash;
+    const CWalletScanFilter* pfilter;
+    CBlock* pblock;
+    std::vector<unsigned int>* pvMatches;
+    char* pfRead;
+
+public:
+    CWalletScanJob() : pfilter(NULL), pblock(NULL), pvMatches(NULL), pfRead(NULL) {}
+    CWalletScanJob(const CDiskBlockPos& posIn, const uint256& hashIn, const CWalletScanFilter* pfilterIn,
+                   CBlock* pblockIn, std::vector<unsigned int>* pvMatchesIn, char* pfReadIn) :
+        pos(posIn), hash(hashIn), pfilter(pfilterIn), pblock(pblockIn), pvMatches(pvMatchesIn), pfRead(pfReadIn) {}
+
+    //! Always succeeds, so the other blocks of the batch are read anyway; *pfRead tells whether this one was
+    bool operator()() {
+        if (pos.IsNull() || !ReadBlockFromDisk(*pblock, pos) || pblock->GetHash() != hash)
+            return true;
+        *pfRead = true;
+        for (unsigned int i = 0; i < pblock->vtx.size(); i++)
+            if (pfilter->IsRelevant(pblock->vtx[i]))
+                pvMatches->push_back(i);
+        return true;
+    }
+
+    void swap(CWalletScanJob& job) {
+        std::swap(pos, job.pos);
+        std::swap(hash, job.hash);
+        std::swap(pfilter, job.pfilter);
+        std::swap(pblock, job.pblock);
+        std::swap(pvMatches, job.pvMatches);
+        std::swap(pfRead, job.pfRead);
+    }
+};
+}
+
+/** Whether tx spends an output of one of the transactions in setTxids. */
+static bool SpendsAny(const CTransaction& tx, const std::set<uint256>& setTxids)
+{
+    if (setTxids.empty())
+        return false;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (setTxids.count(txin.prevout.hash))
+            return true;
+    return false;
+}
+
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, std::string& strError)
+{
+    LOCK(cs_scanning);
     int ret = 0;
     int64_t nNow = GetTime();
+    strError.clear();
 
     CBlockIndex* pindex = pindexStart;
+    boost::scoped_ptr<CWalletScanFilter> pfilter;
+    double dProgressStart, dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -942,31 +1193,142 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             pindex = chainActive.Next(pindex);
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+
+        std::set<CKeyID> setKeys;
+        std::set<CScriptID> setScripts;
+        GetKeys(setKeys);
+        for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+            setScripts.insert(it->first);
+        pfilter.reset(new CWalletScanFilter(setKeys, setScripts, setWatchOnly, mapWallet));
+
+        LOCK(cs_rescan);
+        rescanProgress = CRescanProgress();
+        rescanProgress.fScanning = true;
+        rescanProgress.nStartHeight = pindex ? pindex->nHeight : 0;
+        rescanProgress.nHeight = rescanProgress.nStartHeight;
+        rescanProgress.nTipHeight = chainActive.Height();
+        rescanProgress.nStartTime = nNow;
+    }
+
+    CBlockIndex* pindexLast = NULL;
+    int64_t nLastSaved = nNow;
+    CCheckQueuePool<CWalletScanJob> pool(nScriptCheckThreads);
+    while (pindex && strError.empty())
+    {
+        if (ShutdownRequested()) {
+            LogPrintf("Rescan interrupted at block %d\n", pindex->nHeight);
+            break;
+        }
+
+        // Pruning changes where blocks are, so the positions are taken
+        // under cs_main; a block pruned after that fails to read
+        std::vector<CBlockIndex*> vIndex;
+        std::vector<CDiskBlockPos> vPos;
+        {
+            LOCK(cs_main);
+            for (; pindex && vIndex.size() < RESCAN_BATCH_BLOCKS; pindex = chainActive.Next(pindex))
+            {
+                vIndex.push_back(pindex);
+                vPos.push_back((pindex->nStatus & BLOCK_HAVE_DATA) ? pindex->GetBlockPos() : CDiskBlockPos());
+            }
+        }
+
+        // Read and filter the blocks in parallel, without the locks
+        std::vector<CBlock> vBlocks(vIndex.size());
+        std::vector<std::vector<unsigned int> > vMatches(vIndex.size());
+        std::vector<char> vRead(vIndex.size(), false);
+        std::vector<CWalletScanJob> vJobs;
+        for (unsigned int i = 0; i < vIndex.size(); i++)
+            vJobs.push_back(CWalletScanJob(vPos[i], vIndex[i]->GetBlockHash(), pfilter.get(), &vBlocks[i], &vMatches[i], &vRead[i]));
+        pool.Run(vJobs);
+
+        // Add the matches in chain order. A block may spend outputs found
+        // earlier in the same batch, which the filter didn't know about yet.
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            LOCK2(cs_main, cs_wallet);
+            std::set<uint256> setFound;
+            for (unsigned int k = 0; k < vIndex.size(); k++)
+            {
+                if (!chainActive.Contains(vIndex[k])) {
+                    // The chain was reorganised while reading: go on from the fork
+                    pindex = chainActive.Next(chainActive.FindFork(vIndex[k]));
+                    break;
+                }
+                if (!vRead[k]) {
+                    // Stop, to resume from here once the block is there again
+                    strError = strprintf("Rescan failed to read block %d, which may have been pruned", vIndex[k]->nHeight);
+                    LogPrintf("%s\n", strError);
+                    pindex = vIndex[k];
+                    if (!pindexLast)
+                        pindexLast = vIndex[k]->pprev;
+                    break;
+                }
+                const CBlock& block = vBlocks[k];
+                for (unsigned int i = 0, m = 0; i < block.vtx.size(); i++)
+                {
+                    const CTransaction& tx = block.vtx[i];
+                    if (m < vMatches[k].size() && vMatches[k][m] == i)
+                        m++;
+                    else if (!SpendsAny(tx, setFound))
+                        continue;
+                    if (AddToWalletIfInvolvingMe(tx, &block, fUpdate)) {
+                        ret++;
+                        setFound.insert(tx.GetHash());
+                    }
+                }
+                pindexLast = vIndex[k];
+            }
+            BOOST_FOREACH(const uint256& hash, setFound)
+                pfilter->AddTx(hash);
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            if (!pindexLast)
+                continue;
+            nNow = GetTime();
+            double dProgress = dProgressTip - dProgressStart > 0.0 ? (Checkpoints::GuessVerificationProgress(pindexLast, false) - dProgressStart) / (dProgressTip - dProgressStart) : 1.0;
+            dProgress = std::max(0.0, std::min(1.0, dProgress));
+            ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)(dProgress * 100))));
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                LOCK(cs_rescan);
+                rescanProgress.nHeight = pindexLast->nHeight;
+                rescanProgress.nTipHeight = chainActive.Height();
+                rescanProgress.dProgress = dProgress;
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+            if (nNow >= nLastSaved + 60) {
+                nLastSaved = nNow;
+                if (fFileBacked)
+                    CWalletDB(strWalletFile).WriteRescanProgress(chainActive.GetLocator(pindexLast));
+                LogPrintf("Still rescanning. At block %d. Progress=%f, about %ds left\n", pindexLast->nHeight,
+                          Checkpoints::GuessVerificationProgress(pindexLast), GetRescanProgress().EstimateTimeLeft(nNow));
             }
         }
+    }
+
+    {
+        LOCK2(cs_main, cs_wallet);
+        // Remember where an interrupted rescan got to, and forget it once done
+        if (fFileBacked) {
+            if (pindex && pindexLast)
+                CWalletDB(strWalletFile).WriteRescanProgress(chainActive.GetLocator(pindexLast));
+            else if (!pindex)
+                CWalletDB(strWalletFile).EraseRescanProgress();
+        }
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+        LOCK(cs_rescan);
+        rescanProgress.fScanning = false;
+        rescanProgress.strError = strError;
     }
     return ret;
 }
 
+CRescanProgress CWallet::GetRescanProgress() const
+{
+    LOCK(cs_rescan);
+    return rescanProgress;
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     LOCK2(cs_main, cs_wallet);
@@ -1059,94 +1421,73 @@ void CWallet::ResendWalletTransactions()
  */
 
 
-CAmount CWallet::GetBalance() const
+CWalletBalances CWallet::GetBalances() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    LOCK2(cs_main, cs_wallet);
+    if (fBalancesCached && pindexBalances == chainActive.Tip() &&
+        nBalancesTransactionsUpdated == mempool.GetTransactionsUpdated())
+        return cachedBalances;
+
+    // Only transactions with an output in the index have a balance to count;
+    // their outputs are next to each other there.
+    CWalletBalances balances;
+    const CWalletTx* pcoinLast = NULL;
+    BOOST_FOREACH(const COutPoint& outpoint, setUnspent)
+    {
+        const CWalletTx* pcoin = &mapWallet.find(outpoint.hash)->second;
+        if (pcoin == pcoinLast)
+            continue;
+        pcoinLast = pcoin;
+
+        if (pcoin->IsTrusted())
+        {
+            balances.nTrusted += pcoin->GetAvailableCredit();
+            balances.nWatchOnlyTrusted += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            balances.nUntrusted += pcoin->GetAvailableCredit();
+            balances.nWatchOnlyUntrusted += pcoin->GetAvailableWatchOnlyCredit();
         }
+        balances.nImmature += pcoin->GetImmatureCredit();
+        balances.nWatchOnlyImmature += pcoin->GetImmatureWatchOnlyCredit();
     }
 
-    return nTotal;
+    cachedBalances = balances;
+    fBalancesCached = true;
+    pindexBalances = chainActive.Tip();
+    nBalancesTransactionsUpdated = mempool.GetTransactionsUpdated();
+    return balances;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUntrusted;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nWatchOnlyTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyUntrusted;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyImmature;
 }
 
 /**
@@ -1158,191 +1499,49 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletTx* pcoin = NULL;
+        int nDepth = 0;
+        bool fSkip = false;
+        BOOST_FOREACH(const COutPoint& outpoint, setUnspent)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!IsFinalTx(*pcoin))
-                continue;
+            const uint256& wtxid = outpoint.hash;
+            unsigned int i = outpoint.n;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
-                continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
-            }
-        }
-    }
-}
-
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
-                                  vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
-{
-    vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
-
-    seed_insecure_rand();
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        CAmount nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
-        {
-            for (unsigned int i = 0; i < vValue.size(); i++)
+            // The outputs of a transaction are next to each other in the
+            // index, so check the transaction itself once
+            if (!pcoin || pcoin->GetHash() != wtxid)
             {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng is fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
+                pcoin = &mapWallet.find(wtxid)->second;
+                nDepth = pcoin->GetDepthInMainChain();
+                fSkip = !IsFinalTx(*pcoin) ||
+                        (fOnlyConfirmed && !pcoin->IsTrusted()) ||
+                        (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0) ||
+                        nDepth < 0;
             }
+            if (fSkip)
+                continue;
+
+            isminetype mine = IsMine(pcoin->vout[i]);
+            if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
+                !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue > 0 &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
+                    vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
         }
     }
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
-    setCoinsRet.clear();
-    nValueRet = 0;
-
-    // List of values less than target
-    pair<CAmount, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<CAmount>::max();
-    coinLowestLarger.second.first = NULL;
-    vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
-    CAmount nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(const COutput &output, vCoins)
-    {
-        if (!output.fSpendable)
-            continue;
-
-        const CWalletTx *pcoin = output.tx;
-
-        if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
-            continue;
-
-        int i = output.i;
-        CAmount n = pcoin->vout[i].nValue;
-
-        pair<CAmount,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
-
-        if (n == nTargetValue)
-        {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
-        }
-        else if (n < nTargetValue + CENT)
-        {
-            vValue.push_back(coin);
-            nTotalLower += n;
-        }
-        else if (n < coinLowestLarger.first)
-        {
-            coinLowestLarger = coin;
-        }
-    }
-
-    if (nTotalLower == nTargetValue)
-    {
-        for (unsigned int i = 0; i < vValue.size(); ++i)
-        {
-            setCoinsRet.insert(vValue[i].second);
-            nValueRet += vValue[i].first;
-        }
-        return true;
-    }
-
-    if (nTotalLower < nTargetValue)
-    {
-        if (coinLowestLarger.second.first == NULL)
-            return false;
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-        return true;
-    }
-
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-    vector<char> vfBest;
-    CAmount nBest;
-
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
-
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
-        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
-    {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    }
-    else {
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-            {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-            }
-
-        LogPrint("selectcoins", "SelectCoins() best subset: ");
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-                LogPrint("selectcoins", "%s ", FormatMoney(vValue[i].first));
-        LogPrint("selectcoins", "total %s\n", FormatMoney(nBest));
-    }
-
-    return true;
+    return CCoinSelectionSet(vCoins, nConfMine, nConfTheirs).Select(nTargetValue, setCoinsRet, nValueRet);
 }
 
-bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
+bool CWallet::SelectCoins(const CAmount& nTargetValue, CCoinSelector& selector, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
-
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
-        BOOST_FOREACH(const COutput& out, vCoins)
+        BOOST_FOREACH(const COutput& out, selector.GetAvailable())
         {
             if(!out.fSpendable)
                 continue;
@@ -1352,9 +1551,7 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    return selector.Select(nTargetValue, setCoinsRet, nValueRet);
 }
 
 
@@ -1386,6 +1583,11 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
     {
         LOCK2(cs_main, cs_wallet);
         {
+            // The coins to choose from don't change as the fee does
+            vector<COutput> vAvailable;
+            AvailableCoins(vAvailable, true, coinControl);
+            CCoinSelector selector(vAvailable, bSpendZeroConfChange);
+
             nFeeRet = 0;
             while (true)
             {
@@ -1410,7 +1612,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 CAmount nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
+                if (!SelectCoins(nTotalValue, selector, setCoins, nValueIn, coinControl))
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -1557,10 +1759,11 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.ToString());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r") : NULL;
+            // Write the transaction, the spent coins and the key taken from
+            // the pool in one batch, durable after a single log flush. This
+            // also keeps the database open to defeat the auto-flush for the
+            // duration of this scope.
+            CWalletDBBatch* pwalletdb = fFileBacked ? new CWalletDBBatch(strWalletFile) : NULL;
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -1644,6 +1847,7 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
     if (nLoadWalletRet != DB_LOAD_OK)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
+    RebuildUnspent(false);
 
     uiInterface.LoadWallet(this);
 
@@ -1651,6 +1855,78 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
 }
 
 
+uint256 CWallet::GetKeyStoreHash() const
+{
+    // Everything IsMine looks at: the keys, the scripts and the watch-only scripts
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << setKeys;
+    {
+        LOCK(cs_KeyStore);
+        for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+            ss << it->first;
+        ss << setWatchOnly;
+    }
+    return ss.GetHash();
+}
+
+void CWallet::LoadSnapshot(const CWalletSnapshot& snapshot)
+{
+    LOCK(cs_wallet);
+    if (snapshot.nVersion != CWalletSnapshot::CURRENT_VERSION || snapshot.vIsMine.empty())
+        return;
+    if (snapshot.hashKeys != GetKeyStoreHash())
+    {
+        LogPrintf("Wallet snapshot was taken with other keys, not used\n");
+        return;
+    }
+
+    // Both are in txid order. The IsMine of a transaction's outputs depends
+    // on nothing but the keys, so it holds for every transaction the snapshot
+    // has, whenever it was taken; those it doesn't have are worked out anew.
+    unsigned int nRestored = 0;
+    map<uint256, CWalletTx>::iterator mi = mapWallet.begin();
+    for (vector<pair<uint256, vector<unsigned char> > >::const_iterator it = snapshot.vIsMine.begin(); it != snapshot.vIsMine.end(); ++it)
+    {
+        while (mi != mapWallet.end() && mi->first < it->first)
+            ++mi;
+        if (mi == mapWallet.end())
+            break;
+        if (mi->first != it->first || mi->second.vout.size() != it->second.size())
+            continue;
+        bool fValid = true;
+        BOOST_FOREACH(unsigned char ch, it->second)
+            if (ch > ISMINE_SPENDABLE)
+                fValid = false;
+        if (!fValid)
+            continue;
+        mi->second.vIsMineCached = it->second;
+        mi->second.nIsMineGeneration = nKeysGeneration;
+        nRestored++;
+    }
+    LogPrintf("Wallet snapshot: %u of %u transactions restored\n", nRestored, mapWallet.size());
+}
+
+bool CWallet::WriteSnapshot()
+{
+    if (!fFileBacked)
+        return false;
+
+    CWalletSnapshot snapshot;
+    {
+        LOCK(cs_wallet);
+        snapshot.hashKeys = GetKeyStoreHash();
+        snapshot.vIsMine.reserve(mapWallet.size());
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            it->second.CacheIsMine();
+            snapshot.vIsMine.push_back(make_pair(it->first, it->second.vIsMineCached));
+        }
+    }
+    return CWalletDB(strWalletFile).WriteSnapshot(snapshot);
+}
+
 DBErrors CWallet::ZapWalletTx(std::vector<CWalletTx>& vWtx)
 {
     if (!fFileBacked)
@@ -1739,7 +2015,7 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
+        CWalletDBBatch walletdb(strWalletFile);
         BOOST_FOREACH(int64_t nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
         setKeyPool.clear();
@@ -1767,7 +2043,8 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
+        // The new keys and their pool entries go in together
+        CWalletDBBatch walletdb(strWalletFile);
 
         // Top up key pool
         unsigned int nTargetSize;
@@ -46,9 +46,12 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 0.1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! Number of blocks a rescan reads and filters in parallel before adding what it found
+static const unsigned int RESCAN_BATCH_BLOCKS = 64;
 
 class CAccountingEntry;
 class CCoinControl;
+class CCoinSelector;
 class COutput;
 class CReserveKey;
 class CScript;
@@ -87,6 +90,44 @@ public:
     }
 };
 
+/** The wallet's balances, by confirmation state and ismine filter */
+struct CWalletBalances
+{
+    CAmount nTrusted;
+    CAmount nUntrusted;
+    CAmount nImmature;
+    CAmount nWatchOnlyTrusted;
+    CAmount nWatchOnlyUntrusted;
+    CAmount nWatchOnlyImmature;
+
+    CWalletBalances() : nTrusted(0), nUntrusted(0), nImmature(0),
+        nWatchOnlyTrusted(0), nWatchOnlyUntrusted(0), nWatchOnlyImmature(0) {}
+};
+
+/** How far the rescan in progress has got */
+struct CRescanProgress
+{
+    bool fScanning;
+    int nStartHeight;
+    int nHeight;
+    int nTipHeight;
+    int64_t nStartTime;
+    //! Fraction of the work done, estimated by transaction count
+    double dProgress;
+    //! Why the last rescan stopped before the tip, empty if it didn't or was interrupted
+    std::string strError;
+
+    CRescanProgress() : fScanning(false), nStartHeight(0), nHeight(0), nTipHeight(0), nStartTime(0), dProgress(0) {}
+
+    //! Seconds left at the rate so far, or -1 while there is no rate yet
+    int64_t EstimateTimeLeft(int64_t nNow) const
+    {
+        if (dProgress <= 0)
+            return -1;
+        return (int64_t)((nNow - nStartTime) * (1 - dProgress) / dProgress);
+    }
+};
+
 /** Address book data */
 class CAddressBookData
 {
@@ -110,7 +151,7 @@ public:
 class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
-    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
+    bool SelectCoins(const CAmount& nTargetValue, CCoinSelector& selector, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -135,6 +176,29 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * The outputs that may be unspent: those that are ours and not spent by
+     * a transaction in the main chain. Spends from the mempool and conflicts
+     * are checked when it is read. It is updated by AddToWallet, which also
+     * sees the transactions of blocks that are disconnected.
+     */
+    std::set<COutPoint> setUnspent;
+    void UpdateUnspent(const COutPoint& outpoint);
+    void UpdateUnspent(const CWalletTx& wtx);
+
+    //! The balances computed from setUnspent, valid until the tip, the mempool or the wallet change
+    mutable CWalletBalances cachedBalances;
+    mutable bool fBalancesCached;
+    mutable const CBlockIndex* pindexBalances;
+    mutable unsigned int nBalancesTransactionsUpdated;
+
+    //! Progress of ScanForWalletTransactions, readable without cs_wallet while it runs
+    mutable CCriticalSection cs_rescan;
+    CRescanProgress rescanProgress;
+    //! Held for the whole of ScanForWalletTransactions, so that rescans run
+    //! one at a time and don't overwrite each other's progress; taken before cs_main
+    CCriticalSection cs_scanning;
+
 public:
     /*
      * Main wallet lock.
@@ -185,6 +249,10 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        nKeysGeneration = 0;
+        fBalancesCached = false;
+        pindexBalances = NULL;
+        nBalancesTransactionsUpdated = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -199,6 +267,9 @@ public:
     std::set<COutPoint> setLockedCoins;
 
     int64_t nTimeFirstKey;
+    //! Bumped when keys, scripts or watch-only addresses are added (except
+    //! by GenerateNewKey), which makes the cached IsMine of transactions stale
+    unsigned int nKeysGeneration;
 
     const CWalletTx* GetWalletTx(const uint256& hash) const;
 
@@ -206,7 +277,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL) const;
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -275,13 +346,25 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
     void MarkDirty();
+    //! Rebuild the index of unspent outputs, after keys were added (working out IsMine again) or at load
+    void RebuildUnspent(bool fKeysChanged = true);
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    /**
+     * Scan the main chain from pindexStart for transactions of the wallet.
+     * Blocks are read and filtered in parallel, and what they contain of
+     * ours is added in chain order. Progress is saved to the wallet file so
+     * that a rescan interrupted by shutdown is resumed at the next start.
+     * A rescan started while another runs waits for it. strError says why
+     * the rescan stopped before the tip, and is empty if it didn't.
+     */
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, std::string& strError);
+    CRescanProgress GetRescanProgress() const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
+    CWalletBalances GetBalances() const;
     CAmount GetBalance() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;
@@ -353,6 +436,8 @@ public:
         }
         return nDebit;
     }
+    //! The credit of a wallet transaction, from the remembered IsMine of its outputs
+    CAmount GetCredit(const CWalletTx& wtx, const isminefilter& filter) const;
     CAmount GetCredit(const CTransaction& tx, const isminefilter& filter) const
     {
         CAmount nCredit = 0;
@@ -378,6 +463,12 @@ public:
     void SetBestChain(const CBlockLocator& loc);
 
     DBErrors LoadWallet(bool& fFirstRunRet);
+    //! A hash of everything that decides what IsMine returns
+    uint256 GetKeyStoreHash() const;
+    //! Take the IsMine of the outputs from a snapshot, if it was of the same keys; called at load
+    void LoadSnapshot(const CWalletSnapshot& snapshot);
+    //! Save the IsMine of the outputs for the next load, e.g. at shutdown
+    bool WriteSnapshot();
     DBErrors ZapWalletTx(std::vector<CWalletTx>& vWtx);
 
     bool SetAddressBook(const CTxDestination& address, const std::string& strName, const std::string& purpose);
@@ -589,6 +680,9 @@ public:
     mutable CAmount nImmatureWatchCreditCached;
     mutable CAmount nAvailableWatchCreditCached;
     mutable CAmount nChangeCached;
+    //! IsMine of each output, kept until the wallet's keys change; may be restored from the wallet snapshot
+    mutable std::vector<unsigned char> vIsMineCached;
+    mutable unsigned int nIsMineGeneration;
 
     CWalletTx()
     {
@@ -638,6 +732,8 @@ public:
         nAvailableWatchCreditCached = 0;
         nImmatureWatchCreditCached = 0;
         nChangeCached = 0;
+        vIsMineCached.clear();
+        nIsMineGeneration = 0;
         nOrderPos = -1;
     }
 
@@ -704,6 +800,14 @@ public:
         MarkDirty();
     }
 
+    //! Work out the IsMine of the outputs, unless it is known already
+    void CacheIsMine() const;
+    isminetype GetIsMine(unsigned int n) const
+    {
+        CacheIsMine();
+        return (isminetype)vIsMineCached[n];
+    }
+
     //! filter decides which addresses will count towards the debit
     CAmount GetDebit(const isminefilter& filter) const
     {
@@ -138,6 +138,23 @@ bool CWalletDB::ReadBestBlock(CBlockLocator& locator)
     return Read(std::string("bestblock"), locator);
 }
 
+bool CWalletDB::WriteRescanProgress(const CBlockLocator& locator)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("rescanblock"), locator);
+}
+
+bool CWalletDB::ReadRescanProgress(CBlockLocator& locator)
+{
+    return Read(std::string("rescanblock"), locator);
+}
+
+bool CWalletDB::EraseRescanProgress()
+{
+    nWalletDBUpdated++;
+    return Erase(std::string("rescanblock"));
+}
+
 bool CWalletDB::WriteOrderPosNext(int64_t nOrderPosNext)
 {
     nWalletDBUpdated++;
@@ -172,6 +189,12 @@ bool CWalletDB::WriteMinVersion(int nVersion)
     return Write(std::string("minversion"), nVersion);
 }
 
+bool CWalletDB::WriteSnapshot(const CWalletSnapshot& snapshot)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("snapshot"), snapshot);
+}
+
 bool CWalletDB::ReadAccount(const string& strAccount, CAccount& account)
 {
     account.SetNull();
@@ -333,6 +356,7 @@ public:
     bool fAnyUnordered;
     int nFileVersion;
     vector<uint256> vWalletUpgrade;
+    CWalletSnapshot snapshot;
 
     CWalletScanState() {
         nKeys = nCKeys = nKeyMeta = 0;
@@ -590,6 +614,15 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 return false;
             }
         }
+        else if (strType == "snapshot")
+        {
+            // The snapshot only saves work, so one that can't be read is no error
+            try {
+                ssValue >> wss.snapshot;
+            } catch (...) {
+                wss.snapshot.SetNull();
+            }
+        }
     } catch (...)
     {
         return false;
@@ -691,6 +724,10 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     BOOST_FOREACH(uint256 hash, wss.vWalletUpgrade)
         WriteTx(hash, pwallet->mapWallet[hash]);
 
+    // All records were read above; the snapshot only spares working out
+    // the IsMine of the transactions again
+    pwallet->LoadSnapshot(wss.snapshot);
+
     // Rewrite encrypted wallets of versions 0.4.0 and 0.5.0rc:
     if (wss.fIsEncrypted && (wss.nFileVersion == 40000 || wss.nFileVersion == 50000))
         return DB_NEED_REWRITE;
@@ -787,6 +824,28 @@ DBErrors CWalletDB::ZapWalletTx(CWallet* pwallet, vector<CWalletTx>& vWtx)
     return DB_LOAD_OK;
 }
 
+CWalletDBBatch::CWalletDBBatch(const string& strFilename, bool fSyncIn) : CWalletDB(strFilename), fSync(fSyncIn)
+{
+    // Without a batch the writes still happen, one transaction each
+    if (!BatchBegin())
+        LogPrintf("CWalletDBBatch : Failed to begin a batch on %s\n", strFilename);
+}
+
+CWalletDBBatch::~CWalletDBBatch()
+{
+    // What was written is in the wallet's memory already, so keep it on disk
+    // too rather than leave the two out of step
+    if (!Commit())
+        LogPrintf("CWalletDBBatch : Failed to commit the batch on %s\n", strFile);
+}
+
+bool CWalletDBBatch::Commit()
+{
+    if (!batchTxn)
+        return true;
+    return BatchCommit(fSync);
+}
+
 void ThreadFlushWalletDB(const string& strFile)
 {
     // Make this thread recognisable as the wallet flushing thread
@@ -796,8 +855,7 @@ void ThreadFlushWalletDB(const string& strFile)
     if (fOneThread)
         return;
     fOneThread = true;
-    if (!GetBoolArg("-flushwallet", true))
-        return;
+    bool fFlushWallet = GetBoolArg("-flushwallet", true);
 
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
@@ -806,6 +864,14 @@ void ThreadFlushWalletDB(const string& strFile)
     {
         MilliSleep(500);
 
+        // Make the commits that left their log flush to this thread durable
+        // together, with one fsync however many there were
+        if (bitdb.IsSyncPending())
+            bitdb.SyncLog();
+
+        if (!fFlushWallet)
+            continue;
+
         if (nLastSeen != nWalletDBUpdated)
         {
             nLastSeen = nWalletDBUpdated;
@@ -10,6 +10,7 @@
 #include "db.h"
 #include "key.h"
 #include "keystore.h"
+#include "uint256.h"
 
 #include <list>
 #include <stdint.h>
@@ -26,7 +27,6 @@ class CScript;
 class CWallet;
 class CWalletTx;
 class uint160;
-class uint256;
 
 /** Error statuses for the wallet database */
 enum DBErrors
@@ -72,6 +72,48 @@ public:
     }
 };
 
+/**
+ * What the wallet worked out about its transactions when it was last closed:
+ * the IsMine of each output, for transactions in txid order. It only holds
+ * for the keys, scripts and watch-only scripts it was taken with, whose hash
+ * it records, and a transaction whose outputs don't match is worked out again.
+ *
+ * It saves the IsMine scan, not reading the wallet: the "tx" records are the
+ * only copy of the transactions, so every one of them is still read at load.
+ */
+class CWalletSnapshot
+{
+public:
+    static const int CURRENT_VERSION=1;
+    int nVersion;
+    uint256 hashKeys;
+    std::vector<std::pair<uint256, std::vector<unsigned char> > > vIsMine;
+
+    CWalletSnapshot()
+    {
+        SetNull();
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(this->nVersion);
+        // A snapshot of another version is not read, and so not used
+        if (this->nVersion != CWalletSnapshot::CURRENT_VERSION)
+            return;
+        READWRITE(hashKeys);
+        READWRITE(vIsMine);
+    }
+
+    void SetNull()
+    {
+        nVersion = CWalletSnapshot::CURRENT_VERSION;
+        hashKeys = 0;
+        vIsMine.clear();
+    }
+};
+
 /** Access to the wallet database (wallet.dat) */
 class CWalletDB : public CDB
 {
@@ -101,6 +143,10 @@ public:
     bool WriteBestBlock(const CBlockLocator& locator);
     bool ReadBestBlock(CBlockLocator& locator);
 
+    bool WriteRescanProgress(const CBlockLocator& locator);
+    bool ReadRescanProgress(CBlockLocator& locator);
+    bool EraseRescanProgress();
+
     bool WriteOrderPosNext(int64_t nOrderPosNext);
 
     bool WriteDefaultKey(const CPubKey& vchPubKey);
@@ -111,6 +157,8 @@ public:
 
     bool WriteMinVersion(int nVersion);
 
+    bool WriteSnapshot(const CWalletSnapshot& snapshot);
+
     bool ReadAccount(const std::string& strAccount, CAccount& account);
     bool WriteAccount(const std::string& strAccount, const CAccount& account);
 
@@ -137,6 +185,25 @@ private:
     bool WriteAccountingEntry(const uint64_t nAccEntryNum, const CAccountingEntry& acentry);
 };
 
+/**
+ * A wallet database handle that batches, for bulk operations such as topping
+ * up the key pool or importing keys: every write the thread makes to the
+ * wallet while it is in scope, through it or any other handle, goes into one
+ * transaction that is committed and made durable when it is destroyed.
+ * Nested inside another batch it simply joins that one.
+ */
+class CWalletDBBatch : public CWalletDB
+{
+private:
+    bool fSync;
+
+public:
+    CWalletDBBatch(const std::string& strFilename, bool fSyncIn = true);
+    ~CWalletDBBatch();
+
+    bool Commit();
+};
+
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
 
 #endif // BITCOIN_WALLETDB_H